@@ -0,0 +1,310 @@
+#include <common.h>
+
+// Capture of the raw ADC samples to a file, so that the samples can later be
+// replayed, and re-analyzed, using the file source (refer to mccdaq_src.c).
+//
+// The capture_writer_thread reads the samples directly from the mccdaq ring,
+// behind the consumer thread. It does not hold back the producer; so if it
+// falls too far behind, the samples that were overwritten are skipped, and
+// a gap is left in the capture file. This way the capture never stalls the
+// pulse detection.
+//
+// Capture file format:
+// - capture_hdr_t, which contains the number of channels; the samples are
+//   the frames of the ADC channels, as in the mccdaq ring (refer to common.h)
+// - blocks, each is a capture_block_hdr_t followed by nbytes of compressed
+//   samples; the block's sample_pos is the position of the block's first
+//   sample on the sample clock, that is the samples produced plus the samples
+//   lost before it; gaps in the sample_pos sequence are samples that were lost,
+//   for example by a usb restart, or that were not captured
+//
+// Compression: the samples are 12 bit values, and except during pulses they
+// vary only slightly from the baseline. Each block is compressed as groups of
+// 64 samples; each sample is encoded as the zigzag encoded difference from the
+// prior sample, and all of a group's differences are bit packed using the
+// minimum width needed for the group. A group is a width byte, followed by
+// 8*width bytes. The first sample of the block is the difference from 0.
+// With baseline noise of a few ADC counts a group is typically 25 bytes,
+// rather than 128.
+
+//
+// defines
+//
+
+#define WRITE_BUFF_SIZE  (1024*1024)   // size of the writes to the capture file
+#define WRITE_BUFF_MAX   (WRITE_BUFF_SIZE + sizeof(capture_block_hdr_t) + CAPTURE_BLOCK_MAX_BYTES)
+
+//
+// variables
+//
+
+static int        fd = -1;
+static char       filename[200];
+static pthread_t  writer_thread_id;
+static bool       writer_terminate;
+static uint8_t  * write_buff;
+static int32_t    write_buff_len;
+
+static uint64_t   stat_samples;
+static uint64_t   stat_samples_skipped;
+static uint64_t   stat_bytes;
+
+//
+// prototypes
+//
+
+static void * capture_writer_thread(void * cx);
+static int32_t write_buff_flush(void);
+
+// -----------------  PUBLIC ROUTINES  ----------------------------------
+
+int32_t capture_start(char * filename_arg, time_t start_time)
+{
+    capture_hdr_t hdr;
+    int32_t rc;
+
+    // allocate the write buffer, aligned to the page size
+    if (posix_memalign((void**)&write_buff, 4096, WRITE_BUFF_MAX) != 0) {
+        ERROR("posix_memalign failed\n");
+        return -1;
+    }
+
+    // create the capture file, and write the hdr
+    strncpy(filename, filename_arg, sizeof(filename)-1);
+    fd = open(filename, O_WRONLY|O_CREAT|O_EXCL, 0644);
+    if (fd < 0) {
+        ERROR("%s, open for writing, %s\n", filename, strerror(errno));
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CAPTURE_MAGIC;
+    hdr.hdr_size = sizeof(hdr);
+    hdr.start_time = start_time;
+    hdr.num_chan = mccdaq_get_num_chan();
+    hdr.frequency = CHAN_FREQUENCY(hdr.num_chan) * hdr.num_chan;
+    memcpy(write_buff, &hdr, sizeof(hdr));
+    write_buff_len = sizeof(hdr);
+
+    // create the writer thread
+    rc = pthread_create(&writer_thread_id, NULL, capture_writer_thread, NULL);
+    if (rc != 0) {
+        ERROR("pthread_create capture_writer_thread, %s\n", strerror(rc));
+        return -1;
+    }
+
+    INFO("capturing to %s\n", filename);
+    return 0;
+}
+
+void capture_stop(void)
+{
+    if (fd < 0) {
+        return;
+    }
+
+    writer_terminate = true;
+    pthread_join(writer_thread_id, NULL);
+
+    INFO("%s: samples=%lld skipped=%lld bytes=%lld ratio=%.2f\n",
+         filename, (long long)stat_samples, (long long)stat_samples_skipped, (long long)stat_bytes,
+         stat_bytes ? (double)stat_samples * sizeof(uint16_t) / stat_bytes : 0);
+    close(fd);
+    fd = -1;
+}
+
+// -----------------  CAPTURE WRITER THREAD  ----------------------------
+
+static void * capture_writer_thread(void * cx)
+{
+    uint64_t             pos = 0, produced, next, end, time_last_stat_us = 0;
+    int64_t              lost;
+    int32_t              n;
+    uint16_t           * data;
+    bool                 terminate;
+    capture_block_hdr_t  block_hdr;
+
+    rt_thread("capture", RT_WRITER, 0);
+
+    while (true) {
+        // read the terminate flag prior to checking for data, so that
+        // all of the data produced prior to terminating is captured
+        terminate = writer_terminate;
+
+        // if the samples at pos have been overwritten then skip to
+        // the oldest samples that are still available
+        produced = mccdaq_ring_produced(0);
+        if (mccdaq_ring_overwritten(0, pos)) {
+            uint64_t new_pos = pos;
+            while (mccdaq_ring_overwritten(0, new_pos)) {
+                new_pos += CAPTURE_BLOCK_SAMPLES;
+            }
+            WARN("falling behind, skipping %lld samples\n", (long long)(new_pos - pos));
+            stat_samples_skipped += new_pos - pos;
+            pos = new_pos;
+        }
+
+        // get the samples lost before pos, which place pos on the sample clock;
+        // a block must not span a loss, so it ends at the next loss; if the 
+        // losses at pos are no longer recorded then skip to the oldest recorded
+        lost = mccdaq_ring_lost_before(0, pos, &next);
+        if (lost < 0) {
+            if (next > pos) {
+                WARN("falling behind, skipping %lld samples\n", (long long)(next - pos));
+                stat_samples_skipped += next - pos;
+                pos = next;
+            }
+            continue;
+        }
+
+        // if a full block of samples is not available then wait, unless terminating;
+        // the block is short when it ends at the end of the ring, or at a loss
+        data = mccdaq_ring_data(0, pos, &n);
+        end = (next - pos < CAPTURE_BLOCK_SAMPLES ? next : pos + CAPTURE_BLOCK_SAMPLES);
+        if (n > end - pos) {
+            n = end - pos;
+        }
+        if (n < end - pos && produced < end && !terminate) {
+            usleep(10000);
+            continue;
+        }
+        if (n == 0) {
+            break;  // terminating, and all samples have been captured
+        }
+
+        // compress the block into the write buffer; if the samples were overwritten
+        // while being compressed then discard the block, it will be skipped above
+        block_hdr.magic = CAPTURE_BLOCK_MAGIC;
+        block_hdr.nsamples = n;
+        block_hdr.sample_pos = pos + lost;
+        block_hdr.nbytes = capture_encode(data, n,
+                                          write_buff + write_buff_len + sizeof(block_hdr));
+        if (mccdaq_ring_overwritten(0, pos)) {
+            continue;
+        }
+        memcpy(write_buff + write_buff_len, &block_hdr, sizeof(block_hdr));
+        write_buff_len += sizeof(block_hdr) + block_hdr.nbytes;
+        pos += n;
+        stat_samples += n;
+
+        // when the write buffer is full, write it to the file
+        if (write_buff_len >= WRITE_BUFF_SIZE) {
+            if (write_buff_flush() < 0) {
+                break;
+            }
+        }
+
+        // periodically log the compression stats
+        if (verbose[0] && microsec_timer() - time_last_stat_us > 60000000) {
+            VERBOSE0("capture: samples=%lld skipped=%lld bytes=%lld ratio=%.2f\n",
+                     (long long)stat_samples, (long long)stat_samples_skipped, (long long)stat_bytes,
+                     stat_bytes ? (double)stat_samples * sizeof(uint16_t) / stat_bytes : 0);
+            time_last_stat_us = microsec_timer();
+        }
+    }
+
+    // write the remaining data
+    write_buff_flush();
+    return NULL;
+}
+
+// write WRITE_BUFF_SIZE bytes, or less when the write buffer contains
+// less; the remainder is moved to the start of the write buffer
+static int32_t write_buff_flush(void)
+{
+    int32_t len, rc;
+
+    len = (write_buff_len < WRITE_BUFF_SIZE ? write_buff_len : WRITE_BUFF_SIZE);
+    if (len == 0) {
+        return 0;
+    }
+
+    rc = write(fd, write_buff, len);
+    if (rc != len) {
+        ERROR("%s, write, rc=%d, %s\n", filename, rc, strerror(errno));
+        return -1;
+    }
+    stat_bytes += len;
+
+    memmove(write_buff, write_buff + len, write_buff_len - len);
+    write_buff_len -= len;
+    return 0;
+}
+
+// -----------------  COMPRESSION  --------------------------------------
+
+// returns the number of bytes written to out, which must have room for
+// CAPTURE_BLOCK_MAX_BYTES
+int32_t capture_encode(uint16_t * in, int32_t n, uint8_t * out)
+{
+    uint8_t  * p = out;
+    uint32_t   zz[64], all, acc;
+    int32_t    i, j, cnt, width, bits, d, prev = 0;
+
+    for (i = 0; i < n; i += 64) {
+        // zigzag encode the differences, and determine the width
+        // needed for the largest
+        cnt = (n - i < 64 ? n - i : 64);
+        all = 0;
+        for (j = 0; j < cnt; j++) {
+            d = (int32_t)in[i+j] - prev;
+            prev = in[i+j];
+            zz[j] = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+            all |= zz[j];
+        }
+        for (; j < 64; j++) {
+            zz[j] = 0;
+        }
+        width = (all ? 32 - __builtin_clz(all) : 0);
+
+        // bit pack the group, 64*width bits is always 8*width bytes
+        *p++ = width;
+        acc = 0;
+        bits = 0;
+        for (j = 0; j < 64; j++) {
+            acc |= zz[j] << bits;
+            bits += width;
+            while (bits >= 8) {
+                *p++ = acc;
+                acc >>= 8;
+                bits -= 8;
+            }
+        }
+    }
+
+    return p - out;
+}
+
+// returns the number of bytes of in that were decoded, or -1 if in is invalid
+int32_t capture_decode(uint8_t * in, int32_t nbytes, uint16_t * out, int32_t n)
+{
+    uint8_t  * p = in, * end = in + nbytes, * group;
+    uint32_t   acc, mask, zz;
+    int32_t    i, j, cnt, width, bits, prev = 0;
+
+    for (i = 0; i < n; i += 64) {
+        cnt = (n - i < 64 ? n - i : 64);
+        if (p >= end || (width = *p++) > CAPTURE_MAX_WIDTH || p + 8 * width > end) {
+            return -1;
+        }
+        group = p;
+
+        acc = 0;
+        bits = 0;
+        mask = (1 << width) - 1;
+        for (j = 0; j < cnt; j++) {
+            while (bits < width) {
+                acc |= (uint32_t)*p++ << bits;
+                bits += 8;
+            }
+            zz = acc & mask;
+            acc >>= width;
+            bits -= width;
+            prev += (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+            out[i+j] = prev;
+        }
+
+        p = group + 8 * width;
+    }
+
+    return p - in;
+}
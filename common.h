@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
@@ -15,14 +16,15 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 // -----------------  LOGGING  -----------------------
 
 #define MAX_VERBOSE 4
-FILE *fp_log;
-FILE *fp_log2;
-bool verbose[MAX_VERBOSE];
+extern FILE *fp_log;
+extern FILE *fp_log2;
+extern bool verbose[MAX_VERBOSE];
 
 #define PRINT_COMMON(lvl, fmt, args...) \
     do { \
@@ -58,23 +60,261 @@ static inline int PULSE_HEIGHT_TO_BUCKET_IDX(int ph) {
 
 typedef struct {
     int bucket[MAX_BUCKET];
+    int samples;         // number of ADC samples analyzed
+    int samples_lost;    // number of ADC samples lost, not analyzed
+    int rejected;        // number of pulses rejected by the pulse shape discrimination
+    int busy;            // number of ADC samples during which a pulse is missed, dead time
+    int piled_up;        // number of pulses, included in bucket, that were separated from pile-up
 } pulse_count_t;
 
-typedef int32_t (*mccdaq_callback_t)(uint16_t * data, int32_t max_data);
+// histogram of the pulse height and shape (fwhm), of all pulses detected
+// since the program started; refer to mccdaq_cb.c
+#define SHAPE_HIST_MAGIC   0x50414853
+#define MAX_SHAPE_BUCKET   32
+#define SHAPE_BUCKET_SIZE  8      // 1/16 samples, so each bucket is 0.5 sample of fwhm
+
+typedef struct {
+    int magic;
+    int max_bucket;
+    int max_shape_bucket;
+    int pad;
+    uint64_t start_time;
+    uint32_t count[MAX_BUCKET][MAX_SHAPE_BUCKET];
+} shape_hist_t;
+
+#define FILE_MAGIC     0x77777777   // version 1: hdr.pad is 0, records are int bucket[MAX_BUCKET]
+#define FILE_MAGIC_V2  0x77777778   // version 2: hdr_size and record_size are in the hdr
+#define FILE_MAGIC_V3  0x77777779   // version 3: as version 2, and the records are encoded, refer to main.c
+#define FILE_MAGIC_V4  0x7777777a   // version 4: as version 3, in chunks with summaries, refer to main.c
+
+#define FILE_HDR_V1_SIZE     16
+#define FILE_RECORD_V1_SIZE  (MAX_BUCKET*sizeof(int))
+
+// file_hdr_t fields may be added following record_size, and fields may be 
+// added to the end of pulse_count_t; the hdr_size and record_size allow 
+// files written by earlier versions of this program to be read
+typedef struct {
+    int magic;
+    int hdr_size;
+    uint64_t data_start_time;
+    int record_size;
+    int num_chan;        // 0 in files written by earlier versions, which is 1 channel
+} file_hdr_t;
+
+// a version 4 file's chunks, each of an hour, begin with a dat_chunk_hdr_t;
+// the file ends with the index of the chunks' offsets, and dat_index_trailer_t
+#define DAT_CHUNK_MAGIC  0x6b6e6863
+#define DAT_INDEX_MAGIC  0x78646e69
+
+typedef struct {
+    int magic;
+    int seg;             // the chunk's first second is seg * 3600
+    int secs;            // number of seconds, 0 while the chunk is being written
+    int data_len;        // of the encoded records
+    int sum_len;         // of the encoded summary, which follows the records
+} dat_chunk_hdr_t;
+
+typedef struct {
+    int magic;
+    int num_chunks;
+    int64_t index_offset;  // of the int64_t offset of each chunk
+} dat_index_trailer_t;
+
+// the ADC samples the channels 0 to num_chan-1 in turn, each at FREQUENCY/num_chan
+// samples per second; the samples are interleaved in the mccdaq ring, a frame of
+// num_chan samples at a time; when there are multiple channels the .dat file
+// contains a record of each channel per second, in channel order
+#define FREQUENCY  499999         // ADC samples per second, of all channels
+#define MAX_CHAN   8              // the num_chan must be 1, 2, 4 or 8
+#define CHAN_FREQUENCY(num_chan)  (FREQUENCY / (num_chan))
+
+// there may be multiple ADC devices, each has the same num_chan; the channels
+// of all of the devices are numbered dev*num_chan+chan, and this is the 
+// channel number used by the pulse detection, the .dat file, and the other 
+// files; so the .dat file's num_chan is the total of all of the devices
+#define MAX_DEV         4
+#define MAX_TOTAL_CHAN  (MAX_DEV * MAX_CHAN)
+
+// capture file, refer to capture.c
+#define CAPTURE_MAGIC            0x5041434e
+#define CAPTURE_BLOCK_MAGIC      0x4b4c4243
+#define CAPTURE_BLOCK_SAMPLES    65536
+#define CAPTURE_MAX_WIDTH        17
+#define CAPTURE_BLOCK_MAX_BYTES  ((CAPTURE_BLOCK_SAMPLES/64) * (1 + 8*CAPTURE_MAX_WIDTH))
+
+typedef struct {
+    int magic;
+    int hdr_size;
+    uint64_t start_time;
+    int frequency;       // samples per second, of all channels
+    int num_chan;        // 0 in files written by earlier versions, which is 1 channel
+} capture_hdr_t;
+
+typedef struct {
+    int magic;
+    int nbytes;
+    uint64_t sample_pos;
+    int nsamples;
+    int pad;
+} capture_block_hdr_t;
+
+// list mode file, refer to listmode.c; the time of a pulse is
+// start_time + pos / frequency
+#define LISTMODE_MAGIC  0x5453494c
+
+typedef struct {
+    int magic;
+    int hdr_size;
+    uint64_t start_time;
+    int frequency;       // samples per second, of each channel
+    int record_size;
+    int num_chan;
+    int pad;
+} listmode_hdr_t;
+
+#define LISTMODE_ACCEPTED  1   // the pulse passed the pulse shape discrimination
+#define LISTMODE_PILEUP    2   // the pulse was separated from pile-up
+
+typedef struct {
+    uint64_t pos;        // sample position of the start of the pulse
+    uint16_t height;     // max ADC value minus baseline
+    uint16_t width;      // samples at or above MIN_PULSE_HEIGHT
+    uint32_t area;       // sum of the ADC values minus baseline, over the width
+    uint16_t rise;       // 10% to 90% rise time, 1/16 samples
+    uint16_t fwhm;       // full width at half maximum, 1/16 samples
+    uint16_t flags;
+    uint16_t chan;
+} listmode_event_t;
+
+// multichannel analyser file, refer to mca.c; each entry is a bin number
+// and its count
+#define MCA_MAGIC      0x3141434d
+#define MCA_MAX_BINS   4096
+#define MCA_MAX_COUNT  0xfffff
+#define MCA_ENTRY(bin, count)  (((uint32_t)(bin) << 20) | (count))
+#define MCA_ENTRY_BIN(e)       ((e) >> 20)
+#define MCA_ENTRY_COUNT(e)     ((e) & MCA_MAX_COUNT)
+
+typedef struct {
+    int magic;
+    int hdr_size;
+    uint64_t start_time;
+    int bin_width;       // ADC units per bin
+    int num_bins;
+    int num_chan;        // not present in files written by earlier versions
+    int pad;
+} mca_hdr_t;
+
+typedef struct {
+    uint32_t time_idx;   // seconds since start_time
+    uint16_t n;          // number of entries that follow
+    uint16_t chan;       // was the upper half of n, which is at most MCA_MAX_BINS
+} mca_record_hdr_t;
+
+// the roles of the threads, for their real-time scheduling, refer to rt.c
+#define RT_PRODUCER  0
+#define RT_CONSUMER  1
+#define RT_WORKER    2
+#define RT_WRITER    3
+
+// a histogram of intervals, in log2 buckets of microseconds; bucket b counts
+// the intervals less than 1<<b, and not less than 1<<(b-1)
+#define MAX_JITTER_BUCKET  32
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t interval_max_us;    // since the last call to jitter_interval_max
+    uint32_t bucket[MAX_JITTER_BUCKET];
+} jitter_t;
+
+typedef int32_t (*mccdaq_callback_t)(int32_t dev, uint16_t * data, int32_t max_data);
+
+// a source of ADC samples for a device, selected by mccdaq_init; the run routine
+// is called by the device's producer thread, and adds samples to the device's 
+// ring until mccdaq_stopping
+typedef struct {
+    char    * name;
+    int32_t (*init)(int32_t dev, char * args);
+    void    (*run)(int32_t dev);
+    void    (*exit)(int32_t dev);
+} mccdaq_source_t;
 
 // main.c ...
-void publish(time_t time_now, pulse_count_t *pc);
+void publish(int chan, time_t time_now, pulse_count_t *pc, uint32_t *heights);
 
 // mccdaq_cb.c ...
-int32_t mccdaq_callback(uint16_t * d, int32_t max_d);
+int32_t mccdaq_callback(int32_t dev, uint16_t * d, int32_t max_d);
+int32_t pulse_discrim_init(char * args);
+void pulse_get_shape_hist(int32_t chan, shape_hist_t * sh);
+int32_t pulse_threads_init(int32_t nthreads);
 
 // util_mccdaq.c ...
-int32_t mccdaq_init(void);
+int32_t mccdaq_init(char *source_spec, int32_t num_xfer, int32_t num_chan);
 int32_t  mccdaq_start(mccdaq_callback_t cb);
 int32_t  mccdaq_stop(void);
-int32_t mccdaq_get_restart_count(void);
+int32_t mccdaq_get_num_dev(void);
+int32_t mccdaq_get_restart_count(int32_t dev);
+int32_t mccdaq_get_lost_samples(int32_t dev);
+int32_t mccdaq_get_ring_high_water(int32_t dev);
+void mccdaq_get_jitter(int32_t dev, int32_t * gap_max_us, int32_t * wakeup_max_us);
+time_t mccdaq_get_sample_clock(int32_t dev);
+int32_t mccdaq_get_num_chan(void);
+bool mccdaq_stopping(void);
+uint16_t * mccdaq_ring_space(int32_t dev, int32_t * max_samples);
+void mccdaq_ring_commit(int32_t dev, int32_t samples);
+void mccdaq_ring_lost(int32_t dev, int32_t samples);
+void mccdaq_set_sample_clock(int32_t dev, time_t start_time);
+int32_t mccdaq_set_num_chan(int32_t num_chan);
+uint64_t mccdaq_ring_produced(int32_t dev);
+uint64_t mccdaq_ring_consumed(int32_t dev);
+uint16_t * mccdaq_ring_data(int32_t dev, uint64_t pos, int32_t * max_samples);
+int64_t mccdaq_ring_lost_before(int32_t dev, uint64_t pos, uint64_t * next);
+bool mccdaq_ring_overwritten(int32_t dev, uint64_t pos);
+
+// mccdaq_src.c ...
+extern mccdaq_source_t mccdaq_source_sim;
+extern mccdaq_source_t mccdaq_source_file;
+extern mccdaq_source_t mccdaq_source_synth;
+
+// capture.c ...
+int32_t capture_start(char * filename, time_t start_time);
+void capture_stop(void);
+int32_t capture_encode(uint16_t * in, int32_t n, uint8_t * out);
+int32_t capture_decode(uint8_t * in, int32_t nbytes, uint16_t * out, int32_t n);
+
+// listmode.c ...
+int32_t listmode_start(char * filename, time_t start_time);
+void listmode_stop(void);
+void listmode_add(int32_t chan, uint64_t pos, int32_t height, int32_t width, int32_t area,
+                  int32_t rise, int32_t fwhm, int32_t flags);
+
+// mca.c ...
+int32_t mca_start(char * filename, time_t start_time, int32_t bin_width, int32_t num_chan);
+void mca_stop(void);
+int32_t mca_load(char * filename);
+void mca_add(int32_t chan, int32_t time_idx, uint32_t * heights);
+int32_t mca_get_bin_width(void);
+bool mca_get_hist(int32_t chan, int32_t first, int32_t last, uint32_t * hist);
+
+// shaper.c ...
+int32_t shaper_init(char * args);
+void shaper_reset(int32_t chan);
+int32_t shaper_process(int32_t chan, uint16_t * in, int32_t n, int16_t ** out);
+bool shaper_enabled(void);
+void shaper_plan(int32_t chan, uint16_t * in, int32_t n);
+void shaper_filter(int32_t chan, uint16_t * in, int32_t a, int32_t b, int16_t * out);
+
+// rt.c ...
+int32_t rt_init(char * args);
+void rt_thread(char * name, int32_t role, int32_t dev);
+void jitter_add(jitter_t * j, uint64_t us);
+uint64_t jitter_interval_max(jitter_t * j);
+void jitter_log(char * name, jitter_t * j);
 
 // utils.c ...
 uint64_t microsec_timer(void);
 char *time2str(time_t t, char *s, bool filename_format);
+bool getarg(char *args, char *key, char *value, int32_t max_value);
 
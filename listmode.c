@@ -0,0 +1,193 @@
+#include <common.h>
+
+// List mode: a record for each pulse detected, written to a file, so that the
+// pulse arrival times can be analyzed; such as the time between pulses, or
+// coincidences with other data.
+//
+// listmode_add is called by the pulse detector, in the mccdaq consumer thread,
+// and adds the record to a single-producer/single-consumer ring. The
+// listmode_writer_thread writes the records from the ring to the file, in
+// large batches. If the ring is full the record is dropped, and counted; so
+// the pulse detection is never held up by the file writes. When there are
+// multiple devices listmode_add is called by each device's consumer thread,
+// so the producers are serialized by a mutex.
+//
+// List mode file format:
+// - listmode_hdr_t
+// - listmode_event_t records, in the order the pulses were detected on each
+//   channel; the records of the channels are interleaved, in the order that
+//   the channels were scanned, and the pos is the position in the channel's 
+//   samples; the chan is the channel's number among all of the devices
+
+//
+// defines
+//
+
+#define MAX_EVENTS   (1 << 20)         // ring size, must be power of 2
+#define WRITE_BATCH  (64 * 1024)       // max records per write
+
+//
+// variables
+//
+
+static bool               enabled;
+static int                fd = -1;
+static char               filename[200];
+static pthread_t          writer_thread_id;
+static bool               writer_terminate;
+static listmode_event_t * events;
+static uint64_t           events_produced;
+static uint64_t           events_consumed;
+static uint64_t           events_dropped;
+static pthread_mutex_t    mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// prototypes
+//
+
+static void * listmode_writer_thread(void * cx);
+
+// -----------------  PUBLIC ROUTINES  ----------------------------------
+
+int32_t listmode_start(char * filename_arg, time_t start_time)
+{
+    listmode_hdr_t hdr;
+    int32_t rc;
+
+    // allocate the ring of events
+    events = calloc(MAX_EVENTS, sizeof(listmode_event_t));
+    if (events == NULL) {
+        ERROR("calloc events failed\n");
+        return -1;
+    }
+
+    // create the list mode file, and write the hdr
+    strncpy(filename, filename_arg, sizeof(filename)-1);
+    fd = open(filename, O_WRONLY|O_CREAT|O_EXCL, 0644);
+    if (fd < 0) {
+        ERROR("%s, open for writing, %s\n", filename, strerror(errno));
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = LISTMODE_MAGIC;
+    hdr.hdr_size = sizeof(hdr);
+    hdr.start_time = start_time;
+    hdr.num_chan = mccdaq_get_num_chan() * mccdaq_get_num_dev();
+    hdr.frequency = CHAN_FREQUENCY(mccdaq_get_num_chan());
+    hdr.record_size = sizeof(listmode_event_t);
+    rc = write(fd, &hdr, sizeof(hdr));
+    if (rc != sizeof(hdr)) {
+        ERROR("%s, write hdr, rc=%d, %s\n", filename, rc, strerror(errno));
+        return -1;
+    }
+
+    // create the writer thread
+    rc = pthread_create(&writer_thread_id, NULL, listmode_writer_thread, NULL);
+    if (rc != 0) {
+        ERROR("pthread_create listmode_writer_thread, %s\n", strerror(rc));
+        return -1;
+    }
+
+    INFO("list mode to %s\n", filename);
+    enabled = true;
+    return 0;
+}
+
+void listmode_stop(void)
+{
+    if (!enabled) {
+        return;
+    }
+
+    writer_terminate = true;
+    pthread_join(writer_thread_id, NULL);
+
+    INFO("%s: events=%lld dropped=%lld\n",
+         filename, (long long)events_consumed, (long long)events_dropped);
+    close(fd);
+    fd = -1;
+    enabled = false;
+}
+
+// called by the pulse detector for each pulse
+void listmode_add(int32_t chan, uint64_t pos, int32_t height, int32_t width, int32_t area,
+                  int32_t rise, int32_t fwhm, int32_t flags)
+{
+    listmode_event_t * ev;
+
+    if (!enabled) {
+        return;
+    }
+
+    // if the ring is full then drop the event
+    pthread_mutex_lock(&mutex);
+    if (events_produced - __atomic_load_n(&events_consumed, __ATOMIC_ACQUIRE) == MAX_EVENTS) {
+        if (events_dropped++ == 0) {
+            WARN("%s: ring is full, dropping events\n", filename);
+        }
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+
+    // add the event to the ring
+    ev = &events[events_produced & (MAX_EVENTS-1)];
+    ev->pos    = pos;
+    ev->height = height;
+    ev->width  = width;
+    ev->area   = area;
+    ev->rise   = rise;
+    ev->fwhm   = fwhm;
+    ev->flags  = flags;
+    ev->chan   = chan;
+    __atomic_store_n(&events_produced, events_produced+1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mutex);
+}
+
+// -----------------  LIST MODE WRITER THREAD  --------------------------
+
+static void * listmode_writer_thread(void * cx)
+{
+    uint64_t produced, consumed = 0;
+    int64_t  n;
+    int32_t  len, rc;
+    bool     terminate;
+
+    rt_thread("listmode", RT_WRITER, 0);
+
+    while (true) {
+        // read the terminate flag prior to checking for events, so that
+        // all of the events added prior to terminating are written
+        terminate = writer_terminate;
+
+        // if there are no events then wait, unless terminating
+        produced = __atomic_load_n(&events_produced, __ATOMIC_ACQUIRE);
+        if (produced == consumed) {
+            if (terminate) {
+                break;
+            }
+            usleep(100000);
+            continue;
+        }
+
+        // write the events, up to the end of the ring, and at most WRITE_BATCH
+        n = produced - consumed;
+        if (n > MAX_EVENTS - (consumed & (MAX_EVENTS-1))) {
+            n = MAX_EVENTS - (consumed & (MAX_EVENTS-1));
+        }
+        if (n > WRITE_BATCH) {
+            n = WRITE_BATCH;
+        }
+        len = n * sizeof(listmode_event_t);
+        rc = write(fd, &events[consumed & (MAX_EVENTS-1)], len);
+        if (rc != len) {
+            ERROR("%s, write, rc=%d, %s\n", filename, rc, strerror(errno));
+            break;
+        }
+
+        // release the ring space
+        consumed += n;
+        __atomic_store_n(&events_consumed, consumed, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
@@ -1,10 +1,38 @@
 #include <common.h>
 
+#include <limits.h>
+#include <sys/mman.h>
+
 //
 // defines
 //
 
-#define MAX_DATA (20*86400)
+// the pulse count data is stored in segments of SEG_SECS seconds, each has the 
+// same layout as the .dat file, num_chan records per second
+#define SEG_SECS  3600
+#define MAX_SEG   (50*366*24)    // 50 years, time_idx is an int
+
+// the segment s, and its summary; these are read with an acquire load, which
+// pairs with publish's release store of a newly allocated segment
+#define SEG(s)      __atomic_load_n(&seg[s], __ATOMIC_ACQUIRE)
+#define SEG_SUM(s)  __atomic_load_n(&seg_sum[s], __ATOMIC_ACQUIRE)
+
+// the number of seconds that can be read, refer to publish
+#define MAX_DATA_LOAD()  __atomic_load_n(&max_data, __ATOMIC_ACQUIRE)
+
+// the pulse_count of chan, for second tidx
+#define DATA_CHAN(tidx,chan) (SEG((tidx) / SEG_SECS)[(tidx) % SEG_SECS * num_chan + (chan)])
+
+// the summary of each segment is the totals of chan's records of each of its 
+// minutes, and of the hour; refer to sum_range
+#define SEG_MINUTES          (SEG_SECS / 60)
+#define SUM_MINUTE(tidx,chan) (SEG_SUM((tidx) / SEG_SECS)[(tidx) % SEG_SECS / 60 * num_chan + (chan)])
+#define SUM_HOUR(tidx,chan)   (SEG_SUM((tidx) / SEG_SECS)[SEG_MINUTES * num_chan + (chan)])
+
+// limits of the segments, and of the summaries, decoded in playback of a 
+// version 4 file
+#define MAX_LOADED_BYTES     (64 << 20)
+#define MAX_LOADED_SUM_BYTES (16 << 20)
 
 #define MODE_LIVE      0
 #define MODE_PLAYBACK  1
@@ -13,21 +41,48 @@
 #define DISPLAY_PLOT      0
 #define DISPLAY_HISTOGRAM 1
 
+// the .dat file's durability policy, refer to the -w option; a positive
+// write_sync is the number of seconds between fdatasyncs
+#define WRITE_SYNC_NONE    0
+#define WRITE_SYNC_RECORD  -1
+#define WRITE_STAT_INTVL   60       // secs, of the -v0 writer statistics print
+#define WRITE_RETRIES      10       // a failed write is retried each sec, before FATAL
+
+// when there are multiple devices, the secs that a device's published seconds
+// may fall behind the other devices' before they are published as lost; this
+// is longer than the mccdaq ring
+#define PUBLISH_STALL_SECS 30
+
+// the encoding of the version 3 .dat file's records; the fields that follow the
+// buckets are limited to the bits of a uint32_t mask
+#define DAT_MAX_FIELDS          (MAX_BUCKET + 32)
+#define DAT_MAX_ENCODED(nflds)  (5 + (nflds) * 10)
+
 #define DEFAULT_AVG_INTVL 5  
+#define MAX_AVG_INTVL     86400
 #define DEFAULT_PHT       40    // PHT = Pulse Height Threshold
 #define DEFAULT_Y_MAX     1000  // must be an entry in y_max_tbl
-
-#define FILE_MAGIC 0x77777777
+#define DEFAULT_MCA_COL   5     // ADC units per column of the mca histogram display,
+                                // must be an entry in mca_col_tbl
 
 //
 // typedefs
 //
 
+// the totals of records, refer to sum_range
+typedef struct {
+    int64_t bucket[MAX_BUCKET];
+    int64_t samples;
+    int64_t samples_lost;
+    int64_t busy;
+} pulse_sum_t;
+
+// the segments, or summaries, decoded in playback, refer to loaded_add
 typedef struct {
-    int magic;
-    int pad;
-    uint64_t data_start_time;
-} file_hdr_t;
+    int * seg;
+    int   max;
+    int   next;
+} loaded_t;
 
 //
 // variables
@@ -39,21 +94,62 @@ static bool           tracking;
 static int            display_select;
 static int            end_idx;
 static bool           program_terminating;
+static int            num_xfer;
+#ifndef NO_USB
+static char         * source_spec[MAX_DEV] = { "usb" };
+#else
+static char         * source_spec[MAX_DEV] = { "sim" };
+#endif
+static int            num_dev;
+static bool           capture;
+static bool           listmode;
+static char         * discrim_args = "";
+static char         * filter_args = "";
+static char         * rt_args = "";
+static char         * write_args = "";
+static int            num_threads = 1;
+static int            mca_bin_width;
+static int            num_chan = 1;      // of all of the devices
+static int            display_chan;
 
 // neutron pulse count data ...
-static time_t         data_start_time;
-static pulse_count_t  data[MAX_DATA];
-static int            max_data;
+// - seg is the index of the segments, and seg_sum of their summaries; in live
+//   mode publish allocates each segment, and its summary, when its first 
+//   second is published, and stores them before max_data is advanced; 
+//   max_data is stored with release, and each reader loads it once with 
+//   acquire (MAX_DATA_LOAD), so the seconds below the value it loaded can be
+//   read without a lock; segments are not freed. In playback the segments point to the records of the file, either
+//   mapped in place (data_map), or decoded; and in a version 4 file, each 
+//   chunk's segment and summary are decoded when first used (chunk_map).
+static time_t          data_start_time;
+static pulse_count_t * seg[MAX_SEG];
+static pulse_count_t * seg_sum[MAX_SEG];
+static char          * data_map;
+static int             max_data;     // seconds, refer to MAX_DATA_LOAD
+
+// playback of a version 4 file ...
+static char          * chunk_map;
+static off_t           chunk_map_len;
+static int64_t       * chunk_off;
+static int             num_chunks;
+static int             last_chunk_secs;
+static bool            last_chunk_open;  // has no summary, the program did not terminate
+static int             chunk_nfields;
 
 // save neutron pulse count data to file ...
 static char           filename[200];
 static int            fd=-1;
 static pthread_t      live_mode_write_data_thread_id;
+static int            write_interval = 1;      // secs
+static int            write_sync = WRITE_SYNC_NONE;
+static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  write_cond = PTHREAD_COND_INITIALIZER;
 
 // params ...
 static int avg_intvl = DEFAULT_AVG_INTVL;
 static int pht       = DEFAULT_PHT;
 static int y_max     = DEFAULT_Y_MAX;
+static int mca_col   = DEFAULT_MCA_COL;
 
 //
 // prototypes
@@ -66,13 +162,33 @@ static void read_neutron_params(void);
 static void write_neutron_params(void);
 
 static void * live_mode_write_data_thread(void *cx);
+static int dat_write(void *buff, int len, off_t offset);
+static int dat_encode_summary(int s, int nfields, uint8_t *out);
+static void data_advise(int first, int last);
+static int chunk_open(char *map, off_t map_len, int hdr_size, int record_size);
+static bool chunk_hdr_valid(int s, int64_t off, dat_chunk_hdr_t *hdr);
+static bool chunk_hdr_get(int s, dat_chunk_hdr_t *hdr);
+static void seg_load(int s);
+static void sum_load(int s);
+static void loaded_add(loaded_t *l, pulse_count_t **tbl, int s, size_t max_bytes, size_t bytes);
+static void sum_range(int first, int last, int chan, pulse_sum_t *sum);
+static inline void sum_add(pulse_count_t *sum, pulse_count_t *pc);
+static int dat_encode_record(int *rec, int *prev, int nfields, uint8_t *out);
+static uint8_t * dat_decode_record(uint8_t *p, uint8_t *end, int *rec, int nfields);
+static uint8_t * dat_decode_records(uint8_t *p, uint8_t *end, pulse_count_t *data, size_t max_records,
+                                    int nfields, size_t *records);
 static void update_display(int maxy, int maxx);
 static void update_display_plot(void);
 static void update_display_histogram(void);
+static bool update_display_mca_histogram(void);
+static void update_display_histogram_time_range(void);
 static void print_centered(int y, int ctrx, int color, char *fmt, ...) __attribute__((format(printf, 4, 5)));
 static char *time_duration_str(int time_span);
 static double *get_average_cpm_for_all_buckets(int time_idx);
 static double get_average_cpm_for_pht(int time_idx);
+static double get_live_time_fraction(int time_idx);
+static double live_time_fraction(pulse_sum_t *sum);
+static double get_dead_time_fraction(int time_idx);
 static int input_handler(int input_char);
 
 //
@@ -107,19 +223,50 @@ int main(int argc, char **argv)
 
     // program terminating
     INFO("terminating\n");
+    pthread_mutex_lock(&write_mutex);
     program_terminating = true;
+    pthread_cond_broadcast(&write_cond);
+    pthread_mutex_unlock(&write_mutex);
     if (mode == MODE_LIVE) {
         assert(live_mode_write_data_thread_id != 0);
         pthread_join(live_mode_write_data_thread_id, NULL);
+        if (capture || listmode || mca_bin_width) {
+            mccdaq_stop();
+            capture_stop();
+            listmode_stop();
+            mca_stop();
+        }
     }
     return 0;
 }
 
 static void initialize(int argc, char **argv)
 {
-    #define USAGE "usage: neutron [-p <filename.dat] [-v <select>] [-h]\n" \
+    #define USAGE "usage: neutron [-p <filename.dat] [-s <source>]... [-c] [-l] [-d <args>] [-f <filter>] [-j <threads>] [-m <bin_width>] [-n <num_chan>] [-r <args>] [-w <args>] [-v <select>] [-x <num_xfer>] [-h]\n" \
                   "        -p <filename.dat> : playback\n" \
+                  "        -s <source>       : live mode ADC sample source, default usb (sim when built\n" \
+                  "                            with NO_USB); repeat for each of up to 4 devices,\n" \
+                  "                            acquired concurrently\n" \
+                  "                              usb[:serial=<serial number>]\n" \
+                  "                              sim[:<args>], refer to README.txt\n" \
+                  "                              file:<filename>[,rate=<samples/sec>][,loop]\n" \
+                  "                              synth[:rate=<samples/sec>][,period=<n>][,height=<n>]\n" \
+                  "        -c                : live mode capture of the ADC samples to neutron_<time>.cap,\n" \
+                  "                            of a single device\n" \
+                  "        -l                : live mode list of the pulses detected to neutron_<time>.lst\n" \
+                  "        -d <args>         : pulse threshold and shape discrimination, refer to README.txt\n" \
+                  "        -f <filter>       : pulse shaping filter: ma, trap or crrc, refer to README.txt\n" \
+                  "        -j <threads>      : number of pulse detection threads, default 1\n" \
+                  "        -m <bin_width>    : live mode pulse height histogram, in bins of <bin_width> ADC units,\n" \
+                  "                            to neutron_<time>.mca\n" \
+                  "        -n <num_chan>     : number of ADC channels of each device, 1, 2, 4 or 8, default 1\n" \
+                  "        -r <args>         : real-time scheduling of the live mode threads, refer to README.txt\n" \
+                  "                              [policy=fifo|rr][,prio=<n>][,writer_prio=<n>][,cpu=<n>]\n" \
+                  "                              [,writer_cpu=<n>][,mlock]\n" \
+                  "        -w <args>         : live mode .dat file writes, and fdatasync of the writes\n" \
+                  "                              [interval=<secs>][,sync=none|record|<secs>]\n" \
                   "        -v <select>       : enable verbose logging, select=0,1,2,3,all\n" \
+                  "        -x <num_xfer>     : number of usb transfers in flight, default 8\n" \
                   "        -h                : help\n"
 
     // open log file, line buffered; and
@@ -139,7 +286,7 @@ static void initialize(int argc, char **argv)
 
     // parse options
     while (true) {
-        int ch = getopt(argc, argv, "p:v:h");
+        int ch = getopt(argc, argv, "p:s:cld:f:j:m:n:r:w:v:x:h");
         if (ch == -1) {
             break;
         }
@@ -148,6 +295,64 @@ static void initialize(int argc, char **argv)
             mode = MODE_PLAYBACK;
             strcpy(filename, optarg);
             break;
+        case 's':
+            if (num_dev == MAX_DEV) {
+                FATAL("at most %d sources\n", MAX_DEV);
+            }
+            source_spec[num_dev++] = optarg;
+            break;
+        case 'c':
+            capture = true;
+            break;
+        case 'l':
+            listmode = true;
+            break;
+        case 'd':
+            discrim_args = optarg;
+            break;
+        case 'f':
+            filter_args = optarg;
+            break;
+        case 'j':
+            if (sscanf(optarg, "%d", &num_threads) != 1 || num_threads <= 0) {
+                FATAL("invalid threads '%s'\n", optarg);
+            }
+            break;
+        case 'm':
+            if (sscanf(optarg, "%d", &mca_bin_width) != 1 || 
+                mca_bin_width < 1 || mca_bin_width > MCA_MAX_BINS) 
+            {
+                FATAL("invalid mca bin_width '%s'\n", optarg);
+            }
+            break;
+        case 'n':
+            if (sscanf(optarg, "%d", &num_chan) != 1 || 
+                (num_chan != 1 && num_chan != 2 && num_chan != 4 && num_chan != MAX_CHAN))
+            {
+                FATAL("invalid num_chan '%s'\n", optarg);
+            }
+            break;
+        case 'r':
+            rt_args = optarg;
+            break;
+        case 'w': {
+            char value[100];
+            write_args = optarg;
+            if (getarg(write_args, "interval", value, sizeof(value)) &&
+                (sscanf(value, "%d", &write_interval) != 1 || write_interval < 1))
+            {
+                FATAL("invalid write interval '%s'\n", value);
+            }
+            if (getarg(write_args, "sync", value, sizeof(value))) {
+                if (strcmp(value, "none") == 0) {
+                    write_sync = WRITE_SYNC_NONE;
+                } else if (strcmp(value, "record") == 0) {
+                    write_sync = WRITE_SYNC_RECORD;
+                } else if (sscanf(value, "%d", &write_sync) != 1 || write_sync < 1) {
+                    FATAL("invalid write sync '%s'\n", value);
+                }
+            }
+            break; }
         case 'v':
             if (strcmp(optarg, "all") == 0) {
                 memset(verbose, 1, MAX_VERBOSE);
@@ -160,6 +365,14 @@ static void initialize(int argc, char **argv)
                 verbose[select] = true;
             }
             break;
+        case 'x':
+            if (sscanf(optarg, "%d", &num_xfer) != 1 || num_xfer <= 0) {
+                FATAL("invalid num_xfer '%s'\n", optarg);
+            }
+#ifdef NO_USB
+            WARN("num_xfer is ignored, built with NO_USB there is no usb source\n");
+#endif
+            break;
         case 'h':
             printf("%s\n", USAGE);
             exit(0);
@@ -191,7 +404,11 @@ static void initialize(int argc, char **argv)
     //           Ludlum 2929 amplifier output.
     // endif
     if (mode == MODE_PLAYBACK) {
-        int rc, data_len;
+        int rc, record_size;
+        off_t data_len;
+        size_t records;
+        char *map;
+        pulse_count_t *data;
         file_hdr_t file_hdr;
         struct stat buf;
         char s[100];
@@ -204,54 +421,192 @@ static void initialize(int argc, char **argv)
             FATAL("%s, open for reading, %s\n", filename, strerror(errno));
         }
 
-        // read and verify file_hdr
-        rc = read(fd, &file_hdr, sizeof(file_hdr));
-        if (rc != sizeof(file_hdr)) {
+        // read and verify file_hdr; version 1 files have a 16 byte file_hdr,
+        // and later versions contain the file_hdr size and record size
+        memset(&file_hdr, 0, sizeof(file_hdr));
+        rc = read(fd, &file_hdr, FILE_HDR_V1_SIZE);
+        if (rc != FILE_HDR_V1_SIZE) {
             FATAL("%s, read file_hdr, rc=%d, %s\n", filename, rc, strerror(errno));
         }
-        if (file_hdr.magic != FILE_MAGIC) {
+        if (file_hdr.magic == FILE_MAGIC) {
+            file_hdr.hdr_size = FILE_HDR_V1_SIZE;
+            file_hdr.record_size = FILE_RECORD_V1_SIZE;
+        } else if (file_hdr.magic == FILE_MAGIC_V2 || file_hdr.magic == FILE_MAGIC_V3 ||
+                   file_hdr.magic == FILE_MAGIC_V4) 
+        {
+            int len = file_hdr.hdr_size;
+            if (len < offsetof(file_hdr_t, num_chan)) {
+                FATAL("%s, invalid hdr_size %d\n", filename, len);
+            }
+            if (len > sizeof(file_hdr)) {
+                len = sizeof(file_hdr);
+            }
+            rc = pread(fd, &file_hdr, len, 0);
+            if (rc != len) {
+                FATAL("%s, read file_hdr, rc=%d, %s\n", filename, rc, strerror(errno));
+            }
+            if (file_hdr.record_size <= 0 ||
+                (file_hdr.magic != FILE_MAGIC_V2 && 
+                 (file_hdr.record_size % sizeof(int) || file_hdr.record_size < FILE_RECORD_V1_SIZE ||
+                  file_hdr.record_size > DAT_MAX_FIELDS * sizeof(int))))
+            {
+                FATAL("%s, invalid record_size %d\n", filename, file_hdr.record_size);
+            }
+        } else {
             FATAL("%s, invalid file_hdr, 0x%x\n", filename, file_hdr.magic);
         }
+        record_size = file_hdr.record_size;
+        num_chan = (file_hdr.num_chan ? file_hdr.num_chan : 1);
+        if (num_chan < 1 || num_chan > MAX_TOTAL_CHAN) {
+            FATAL("%s, invalid num_chan %d\n", filename, num_chan);
+        }
 
-        // the file data following the file_hdr is an array of pulse_count_t;
+        // the file data following the file_hdr is an array of records, which
+        // in a version 3 file are encoded, or in a version 4 file is chunks;
         // determine the data_len
         rc = fstat(fd, &buf);
         if (rc < 0) {
             FATAL("%s, failed fstat, %s\n", filename, strerror(errno));
         }
-        data_len = buf.st_size - sizeof(file_hdr);
-        if (data_len <= 0 || data_len >= sizeof(data)) {
-            FATAL("%s, data_len out of range, data_len=%d\n", filename, data_len);
+        data_len = buf.st_size - file_hdr.hdr_size;
+        if (data_len <= 0) {
+            FATAL("%s, data_len out of range, data_len=%lld\n", filename, (long long)data_len);
         }
-        if ((data_len % sizeof(pulse_count_t)) != 0) {
-            FATAL("%s, data_len=%d is not multiple of %zd\n", filename, data_len, sizeof(pulse_count_t));
+        if (file_hdr.magic != FILE_MAGIC_V3 && file_hdr.magic != FILE_MAGIC_V4 && 
+            (data_len % record_size) != 0) 
+        {
+            FATAL("%s, data_len=%lld is not multiple of %d\n", filename, (long long)data_len, record_size);
         }
 
-        // read the data
-        rc = read(fd, data, data_len);
-        if (rc != data_len) {
-            FATAL("%s, read data, rc=%d, %s\n", filename, rc, strerror(errno));
+        // map the file, its pages are read when they are first accessed. A version 4
+        // file's chunks are decoded when first used (refer to chunk_open). When the
+        // file's records are pulse_count_t, the segments point to them in place; so
+        // a long file opens at once, and only the pages of the seconds displayed are read
+        // (refer to data_advise). Otherwise the records are decoded (version 3) or 
+        // copied to an anonymous mapping, reading the file sequentially; when the
+        // file's record_size differs from sizeof(pulse_count_t), fields not present
+        // in the file's records are zero, which indicates that the live time is not
+        // known. A version 3 file's records are decoded, each following the 
+        // channel's record of the prior second, and a record truncated by the 
+        // program having been terminated while writing it is ignored.
+        map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            FATAL("%s, mmap, %s\n", filename, strerror(errno));
+        }
+        if (file_hdr.magic == FILE_MAGIC_V4) {
+            max_data = chunk_open(map, buf.st_size, file_hdr.hdr_size, record_size);
+        } else {
+            if (file_hdr.magic != FILE_MAGIC_V3 && record_size == sizeof(pulse_count_t) &&
+                file_hdr.hdr_size % sizeof(int) == 0)
+            {
+                data = (pulse_count_t *)(map + file_hdr.hdr_size);
+                data_map = map;
+                madvise(map, buf.st_size, MADV_RANDOM);
+                records = data_len / record_size;
+            } else {
+                // the records of a version 3 file are counted, by decoding them, 
+                // so that the mapping is the size of the records; an encoded 
+                // record is a few bytes, so the file's size would be a poor bound;
+                // the mapping is at least 1 record, as mmap of 0 bytes fails
+                uint8_t *p = (uint8_t *)map + file_hdr.hdr_size;
+                size_t copy_len = (record_size < sizeof(pulse_count_t) ? record_size : sizeof(pulse_count_t));
+                madvise(map, buf.st_size, MADV_SEQUENTIAL);
+                if (file_hdr.magic == FILE_MAGIC_V3) {
+                    if (dat_decode_records(p, p + data_len, NULL, SIZE_MAX, 
+                                           record_size / sizeof(int), &records) == NULL) 
+                    {
+                        WARN("%s, record %lld is truncated or invalid\n", filename, (long long)records);
+                    }
+                } else {
+                    records = data_len / record_size;
+                }
+                if (records / num_chan > (size_t)MAX_SEG * SEG_SECS || 
+                    records > SIZE_MAX / sizeof(pulse_count_t) - 1) 
+                {
+                    FATAL("%s, %lld records is too many\n", filename, (long long)records);
+                }
+                data = mmap(NULL, (records + 1) * sizeof(pulse_count_t), PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                if (data == MAP_FAILED) {
+                    FATAL("%s, mmap %zu records, %s\n", filename, records, strerror(errno));
+                }
+                if (file_hdr.magic == FILE_MAGIC_V3) {
+                    dat_decode_records(p, p + data_len, data, records, record_size / sizeof(int), &records);
+                    INFO("%s, decoded %lld bytes to %lld records\n", filename, (long long)data_len, (long long)records);
+                } else {
+                    for (size_t r = 0; r < records; r++) {
+                        memcpy(&data[r], p + r * record_size, copy_len);
+                    }
+                }
+                munmap(map, buf.st_size);
+            }
+            if (records / num_chan > (size_t)MAX_SEG * SEG_SECS) {
+                FATAL("%s, %lld records is too many\n", filename, (long long)records);
+            }
+
+            max_data = records / num_chan;
+            for (int s = 0; s * SEG_SECS < max_data; s++) {
+                seg[s] = data + (size_t)s * SEG_SECS * num_chan;
+            }
         }
 
         // close file
         close(fd);
         fd = -1;
 
-        // set global variables: data_start_time and max_data
+        // set global variable data_start_time
         data_start_time = file_hdr.data_start_time;
-        max_data = data_len / sizeof(pulse_count_t);
         INFO("data_start_time = %ld, %s\n", data_start_time, time2str(data_start_time,s,false));
         INFO("max_data        = %d\n", max_data);
+        INFO("record_size     = %d\n", record_size);
+        INFO("num_chan        = %d\n", num_chan);
+
+        // read the mca file, of the pulse height histogram, if there is one
+        char mca_filename[200];
+        sprintf(mca_filename, "%.*s.mca", (int)(strlen(filename)-4), filename);
+        mca_load(mca_filename);
     } else {
         file_hdr_t file_hdr;
         int rc;
 
         // LIVE mode init ...
 
-        // init mccdaq utils
-        rc = mccdaq_init();
-        if (rc < 0) {
-            FATAL("mccdaq_init failed\n");
+        // init the real-time scheduling, and lock the memory if selected;
+        // this precedes creating the threads
+        if (rt_init(rt_args) < 0) {
+            FATAL("rt_init failed\n");
+        }
+
+        // init the pulse shape discrimination
+        if (pulse_discrim_init(discrim_args) < 0) {
+            FATAL("pulse_discrim_init failed\n");
+        }
+
+        // init the pulse shaping filter
+        if (shaper_init(filter_args) < 0) {
+            FATAL("shaper_init failed\n");
+        }
+
+        // init mccdaq utils, adding a device for each source; the file source 
+        // sets the num_chan of the capture; the channels of all of the devices
+        // are stored, in device order
+        if (num_dev == 0) {
+            num_dev = 1;
+        }
+        for (int dev = 0; dev < num_dev; dev++) {
+            rc = mccdaq_init(source_spec[dev], num_xfer, num_chan);
+            if (rc < 0) {
+                FATAL("mccdaq_init %s failed\n", source_spec[dev]);
+            }
+        }
+        num_chan = mccdaq_get_num_chan() * num_dev;
+        if (capture && num_dev > 1) {
+            FATAL("capture is supported with a single device\n");
+        }
+
+        // create the pulse detection worker threads, of each device
+        if (pulse_threads_init(num_threads) < 0) {
+            FATAL("pulse_threads_init failed\n");
         }
 
         // create filename for writing, and write the file_hdr
@@ -260,8 +615,11 @@ static void initialize(int argc, char **argv)
             FATAL("%s, open for writing, %s\n", filename, strerror(errno));
         }
         memset(&file_hdr, 0, sizeof(file_hdr));
-        file_hdr.magic = FILE_MAGIC;
-        file_hdr.data_start_time = time(NULL);
+        file_hdr.magic = FILE_MAGIC_V4;
+        file_hdr.hdr_size = sizeof(file_hdr);
+        file_hdr.data_start_time = mccdaq_get_sample_clock(0);
+        file_hdr.record_size = sizeof(pulse_count_t);
+        file_hdr.num_chan = num_chan;
         rc = write(fd, &file_hdr, sizeof(file_hdr));
         if (rc != sizeof(file_hdr)) {
             FATAL("%s, write file_hdr, rc=%d, %s\n", filename, rc, strerror(errno));
@@ -278,6 +636,34 @@ static void initialize(int argc, char **argv)
         pthread_create(&live_mode_write_data_thread_id, NULL, 
                        live_mode_write_data_thread, NULL);
 
+        // if requested, start capturing the ADC samples to a file which has
+        // the same name as filename, with the .cap extension
+        if (capture) {
+            char cap_filename[200];
+            sprintf(cap_filename, "%.*s.cap", (int)(strlen(filename)-4), filename);
+            if (capture_start(cap_filename, data_start_time) < 0) {
+                FATAL("capture_start failed\n");
+            }
+        }
+
+        // if requested, start the list mode file, of the pulses detected
+        if (listmode) {
+            char lst_filename[200];
+            sprintf(lst_filename, "%.*s.lst", (int)(strlen(filename)-4), filename);
+            if (listmode_start(lst_filename, data_start_time) < 0) {
+                FATAL("listmode_start failed\n");
+            }
+        }
+
+        // if requested, start the mca file, of the pulse height histogram
+        if (mca_bin_width) {
+            char mca_filename[200];
+            sprintf(mca_filename, "%.*s.mca", (int)(strlen(filename)-4), filename);
+            if (mca_start(mca_filename, data_start_time, mca_bin_width, num_chan) < 0) {
+                FATAL("mca_start failed\n");
+            }
+        }
+
         // start acquiring ADC data using mccdaq utils
         mccdaq_start(mccdaq_callback);
 
@@ -340,54 +726,280 @@ static void write_neutron_params(void)
 
 // -----------------  LIVE MODE ROUTINES  ----------------------------------------
 
-// called from mccdaq_cb at 1 second intervals, with pulse count histogram data 
-// for the past second
-void publish(time_t time_now, pulse_count_t *pc)
+// called from mccdaq_cb at 1 second intervals, for each channel in channel order,
+// with pulse count histogram data for the past second, and the full resolution 
+// histogram of the pulse heights; when there are multiple devices this is called
+// by each device's consumer thread, for the device's channels
+void publish(int chan, time_t time_now, pulse_count_t *pc, uint32_t *heights)
 {
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    static time_t time_last[MAX_DEV];
+    static int    published[MAX_DEV];   // time_idx following the device's last second
+    static bool   stalled[MAX_DEV];
+    int dev_chans = num_chan / num_dev;
+    int dev = chan / dev_chans;
+    int min, d, s, t, c;
+
     // determine data array time_idx, and sanity check
     int time_idx = time_now - data_start_time;
-    if (time_idx < 0 || time_idx >= MAX_DATA) {
-        FATAL("time_idx=%d out of range 0..MAX_DATA-1\n", time_idx);
+    if (time_idx < 0 || time_idx / SEG_SECS >= MAX_SEG) {
+        FATAL("time_idx=%d out of range 0..%d\n", time_idx, MAX_SEG * SEG_SECS - 1);
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    // if the device stalled, and its seconds were published as lost, then 
+    // discard the seconds it publishes until it has caught up
+    if (time_idx < published[dev]) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    if (stalled[dev] && chan % dev_chans == 0) {
+        INFO("dev %d resumed publishing at second %d\n", dev, time_idx);
+        stalled[dev] = false;
+    }
+
+    // allocate the segment of time_idx, and its summary, and any preceding 
+    // segments that have not been allocated; calloc of a segment is satisfied
+    // by mmap, so its pages are zero and are allocated as they are written
+    for (s = time_idx / SEG_SECS; s >= 0 && seg[s] == NULL; s--) {
+        pulse_count_t *p = calloc((size_t)SEG_SECS * num_chan, sizeof(pulse_count_t));
+        pulse_count_t *sum = calloc((size_t)(SEG_MINUTES + 1) * num_chan, sizeof(pulse_count_t));
+        if (p == NULL || sum == NULL) {
+            FATAL("failed to allocate segment %d\n", s);
+        }
+        __atomic_store_n(&seg_sum[s], sum, __ATOMIC_RELEASE);
+        __atomic_store_n(&seg[s], p, __ATOMIC_RELEASE);
+        VERBOSE0("allocated segment %d, %zu bytes\n", s, (size_t)SEG_SECS * num_chan * sizeof(pulse_count_t));
     }
 
     // sanity check, that the time_now is 1 greater than at last call
-    static time_t time_last;
-    int delta_time = time_now - time_last;
-    if (time_last != 0 && delta_time != 1) {
-        WARN("unexpected delta_time %d, should be 1\n", delta_time);
+    if (chan % dev_chans == 0) {
+        int delta_time = time_now - time_last[dev];
+        if (time_last[dev] != 0 && delta_time != 1) {
+            WARN("dev %d unexpected delta_time %d, should be 1\n", dev, delta_time);
+        }
+        time_last[dev] = time_now;
     }
-    time_last = time_now;
 
-    // save neutron_count in data array
-    data[time_idx] = *pc;
-    __sync_synchronize();
-    max_data = time_idx+1;
+    // save neutron_count in data array, and add it to the minute and hour
+    // summaries, and save the pulse heights in the mca; the second is 
+    // complete when the last channel of each of the devices has been published
+    DATA_CHAN(time_idx, chan) = *pc;
+    sum_add(&SUM_MINUTE(time_idx, chan), pc);
+    sum_add(&SUM_HOUR(time_idx, chan), pc);
+    mca_add(chan, time_idx, heights);
+    if (chan % dev_chans == dev_chans-1) {
+        published[dev] = time_idx+1;
+
+        // a device that has stalled, or been unplugged, would stop the seconds
+        // being completed for all of the devices; so when a device falls 
+        // PUBLISH_STALL_SECS behind this device, its seconds are published as 
+        // lost: no counts, and all of the samples lost
+        for (d = 0; d < num_dev; d++) {
+            if (published[d] >= time_idx+1 - PUBLISH_STALL_SECS) {
+                continue;
+            }
+            if (!stalled[d]) {
+                WARN("dev %d has not published second %d, publishing its seconds as lost\n", 
+                     d, published[d]);
+                stalled[d] = true;
+            }
+            for (t = published[d]; t < time_idx+1 - PUBLISH_STALL_SECS; t++) {
+                for (c = d * dev_chans; c < (d + 1) * dev_chans; c++) {
+                    if (DATA_CHAN(t, c).samples + DATA_CHAN(t, c).samples_lost != 0) {
+                        continue;  // published, the device stalled within the second
+                    }
+                    DATA_CHAN(t, c).samples_lost = CHAN_FREQUENCY(dev_chans);
+                    sum_add(&SUM_MINUTE(t, c), &DATA_CHAN(t, c));
+                    sum_add(&SUM_HOUR(t, c), &DATA_CHAN(t, c));
+                }
+            }
+            published[d] = time_idx+1 - PUBLISH_STALL_SECS;
+        }
+
+        for (min = published[0], d = 1; d < num_dev; d++) {
+            if (published[d] < min) {
+                min = published[d];
+            }
+        }
+        if (min > max_data) {
+            __atomic_store_n(&max_data, min, __ATOMIC_RELEASE);
+            pthread_mutex_lock(&write_mutex);
+            pthread_cond_signal(&write_cond);
+            pthread_mutex_unlock(&write_mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
 }
 
+// The seconds published since the last write are encoded (refer to 
+// dat_encode_record) to a buffer, and written with one pwrite, every
+// write_interval secs; the records are written in chunks of a segment,
+// and when a chunk is completed its chunk_hdr is rewritten and its summary
+// is written (refer to DAT FILE RECORD ENCODING). fdatasync is
+// called according to write_sync: never, after each write, or every 
+// write_sync secs. With sync=record the thread is woken when each second is
+// published, so each second is on disk before the next. The latency of the 
+// writes and of the fdatasyncs, and the bytes written, are logged every 
+// WRITE_STAT_INTVL secs with -v0, and when terminating.
 static void * live_mode_write_data_thread(void *cx)
 {
-    int        time_idx, rc;
-    bool       terminate;
-    static int last_time_idx_written = -1;
+    int        time_idx, rc, shp_fd, chan, n, len, written = 0, t, c, s, end;
+    bool       terminate, chunk_done;
+    char       shp_filename[200];
+    uint64_t   start_us, now_us, time_last_sync_us, time_last_shp_us, time_last_stat_us;
+    uint64_t   stat_bytes = 0, stat_last_bytes = 0;
+    int64_t    stat_writes = 0, stat_syncs = 0;
+    off_t      offset = sizeof(file_hdr_t);
+    uint8_t  * buff = NULL;
+    int        buff_size = 0, size;
+    dat_chunk_hdr_t chunk_hdr;
+    int64_t  * index = NULL;
+    dat_index_trailer_t trailer;
+    const int  nfields = sizeof(pulse_count_t) / sizeof(int);
+    static int zero_rec[DAT_MAX_FIELDS];
+    struct timespec deadline;
+    static shape_hist_t shape_hist;
+    static jitter_t write_latency, sync_latency;
 
     // file should already been opened in initialize()
     assert(fd > 0);
 
+    rt_thread("write_data", RT_WRITER, 0);
+    if (write_sync > 0) {
+        INFO("%s: interval=%d sync=%d\n", filename, write_interval, write_sync);
+    } else {
+        INFO("%s: interval=%d sync=%s\n", filename, write_interval, 
+             write_sync == WRITE_SYNC_RECORD ? "record" : "none");
+    }
+
+    // create the file for the pulse shape histogram, which has the same
+    // name as filename, with the .shp extension
+    sprintf(shp_filename, "%.*s.shp", (int)(strlen(filename)-4), filename);
+    shp_fd = open(shp_filename, O_WRONLY|O_CREAT|O_EXCL, 0644);
+    if (shp_fd < 0) {
+        ERROR("%s, open for writing, %s\n", shp_filename, strerror(errno));
+    }
+
     // loop, writing data to neutron.dat file
+    time_last_sync_us = time_last_shp_us = time_last_stat_us = microsec_timer();
     while (true) {
         // read program_terminating flag prior to writing to the file
         terminate = program_terminating;
 
-        // write new neutron count data entries to the file
-        for (time_idx = last_time_idx_written+1; time_idx < max_data; time_idx++) {
-            pulse_count_t *pc = &data[time_idx];
+        // encode the new neutron count data entries, each following the channel's
+        // entry of the prior second, and write them to the file with one pwrite;
+        // a short write is continued, and a failed write is retried or is FATAL,
+        // since the records that follow are encoded from these. The records of
+        // each chunk are written separately; a chunk begins with a chunk_hdr, 
+        // and when the chunk is completed the chunk_hdr is rewritten with the
+        // lengths, and is followed by the summary
+        time_idx = MAX_DATA_LOAD();
+        n = time_idx - written;
+        start_us = microsec_timer();
+        while (written < time_idx) {
+            s = written / SEG_SECS;
+            end = ((s + 1) * SEG_SECS < time_idx ? (s + 1) * SEG_SECS : time_idx);
+            chunk_done = (end == (s + 1) * SEG_SECS);
+            size = sizeof(dat_chunk_hdr_t) + 
+                   ((end - written) + (chunk_done ? SEG_MINUTES + 1 : 0)) * num_chan * DAT_MAX_ENCODED(nfields);
+            if (size > buff_size) {
+                buff_size = size;
+                free(buff);
+                buff = malloc(buff_size);
+                if (buff == NULL) {
+                    FATAL("malloc %d\n", buff_size);
+                }
+            }
 
-            rc = write(fd, pc, sizeof(pulse_count_t));
-            if (rc != sizeof(pulse_count_t)) {
-                ERROR("writing pulse_count to %s, rc=%d, %s\n", filename, rc, strerror(errno));
+            len = 0;
+            if (written % SEG_SECS == 0) {
+                index = realloc(index, (s + 1) * sizeof(int64_t));
+                if (index == NULL) {
+                    FATAL("realloc index of %d chunks\n", s + 1);
+                }
+                index[s] = offset;
+                memset(&chunk_hdr, 0, sizeof(chunk_hdr));
+                chunk_hdr.magic = DAT_CHUNK_MAGIC;
+                chunk_hdr.seg = s;
+                memcpy(buff, &chunk_hdr, sizeof(chunk_hdr));
+                len = sizeof(chunk_hdr);
+            }
+            for (t = written; t < end; t++) {
+                for (c = 0; c < num_chan; c++) {
+                    len += dat_encode_record((int*)&DATA_CHAN(t, c),
+                                             t % SEG_SECS ? (int*)&DATA_CHAN(t-1, c) : zero_rec,
+                                             nfields, buff + len);
+                }
+            }
+            chunk_hdr.data_len += len - (written % SEG_SECS == 0 ? sizeof(chunk_hdr) : 0);
+            if (chunk_done) {
+                chunk_hdr.secs = SEG_SECS;
+                chunk_hdr.sum_len = dat_encode_summary(s, nfields, buff + len);
+                len += chunk_hdr.sum_len;
             }
 
-            last_time_idx_written = time_idx;
+            // the chunk_hdr is rewritten after the records and summary, so that
+            // a chunk is complete only when they are in the file; and the 
+            // records of a chunk that begins in buff are written with its
+            // initial chunk_hdr
+            if (dat_write(buff, len, offset) < 0) {
+                FATAL("%s: failed to write seconds %d to %d\n", filename, written, end - 1);
+            }
+            if (chunk_done && dat_write(&chunk_hdr, sizeof(chunk_hdr), index[s]) < 0) {
+                FATAL("%s: failed to write chunk_hdr of chunk %d\n", filename, s);
+            }
+            offset += len;
+            stat_bytes += len;
+            stat_writes++;
+            written = end;
+        }
+        if (n > 0) {
+            jitter_add(&write_latency, microsec_timer() - start_us);
+        }
+
+        // fdatasync, when sync=record after each write, otherwise every write_sync secs;
+        // when fdatasync fails the data written may not be on disk, and retrying
+        // does not help, the kernel no longer has the data to write
+        now_us = microsec_timer();
+        if ((write_sync == WRITE_SYNC_RECORD && n > 0) ||
+            (write_sync > 0 && (now_us - time_last_sync_us >= write_sync * 1000000ULL || terminate)))
+        {
+            start_us = now_us;
+            if (fdatasync(fd) < 0) {
+                FATAL("fdatasync %s, %s\n", filename, strerror(errno));
+            }
+            now_us = microsec_timer();
+            jitter_add(&sync_latency, now_us - start_us);
+            stat_syncs++;
+            time_last_sync_us = now_us;
+        }
+
+        // once per minute, and when terminating, overwrite the pulse shape histogram 
+        // file, which contains a histogram for each channel
+        if (shp_fd >= 0 && (now_us - time_last_shp_us >= 60000000 || terminate)) {
+            for (chan = 0; chan < num_chan; chan++) {
+                pulse_get_shape_hist(chan, &shape_hist);
+                shape_hist.start_time = data_start_time;
+                rc = pwrite(shp_fd, &shape_hist, sizeof(shape_hist), chan * sizeof(shape_hist));
+                if (rc != sizeof(shape_hist)) {
+                    ERROR("writing %s, rc=%d, %s\n", shp_filename, rc, strerror(errno));
+                }
+            }
+            time_last_shp_us = now_us;
+        }
+
+        // print the statistics of the past interval, when verbose
+        if (verbose[0] && now_us - time_last_stat_us >= WRITE_STAT_INTVL * 1000000ULL) {
+            VERBOSE0("%s: writes=%lld syncs=%lld bytes=%lld bytes/sec=%.0f write_max=%lldus sync_max=%lldus\n",
+                     filename, (long long)stat_writes, (long long)stat_syncs, (long long)stat_bytes,
+                     (stat_bytes - stat_last_bytes) * 1e6 / (now_us - time_last_stat_us),
+                     (long long)jitter_interval_max(&write_latency),
+                     (long long)jitter_interval_max(&sync_latency));
+            stat_last_bytes = stat_bytes;
+            time_last_stat_us = now_us;
         }
 
         // if terminate has been requested then break
@@ -395,16 +1007,603 @@ static void * live_mode_write_data_thread(void *cx)
             break;
         }
 
-        // sleep 1 sec
-        sleep(1);
+        // wait for write_interval secs; or when sync=record, until the next 
+        // second is published
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += write_interval;
+        pthread_mutex_lock(&write_mutex);
+        while (!program_terminating && !(write_sync == WRITE_SYNC_RECORD && MAX_DATA_LOAD() > written)) {
+            if (pthread_cond_timedwait(&write_cond, &write_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&write_mutex);
+    }
+
+    // complete the chunk being written, with the seconds written, and write
+    // the index of the chunks and the trailer; the trailer is written last,
+    // so that if a write fails the file has no index, and playback scans
+    // the chunk headers
+    if (written % SEG_SECS != 0) {
+        s = written / SEG_SECS;
+        size = (SEG_MINUTES + 1) * num_chan * DAT_MAX_ENCODED(nfields);
+        if (size > buff_size) {
+            buff_size = size;
+            free(buff);
+            buff = malloc(buff_size);
+            if (buff == NULL) {
+                FATAL("malloc %d\n", buff_size);
+            }
+        }
+        chunk_hdr.secs = written % SEG_SECS;
+        chunk_hdr.sum_len = dat_encode_summary(s, nfields, buff);
+        if (dat_write(buff, chunk_hdr.sum_len, offset) < 0 ||
+            dat_write(&chunk_hdr, sizeof(chunk_hdr), index[s]) < 0) 
+        {
+            FATAL("%s: failed to write the summary of chunk %d\n", filename, s);
+        }
+        offset += chunk_hdr.sum_len;
+    }
+    n = (written + SEG_SECS - 1) / SEG_SECS;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.magic = DAT_INDEX_MAGIC;
+    trailer.num_chunks = n;
+    trailer.index_offset = offset;
+    if (dat_write(index, n * sizeof(int64_t), offset) < 0 ||
+        dat_write(&trailer, sizeof(trailer), offset + n * sizeof(int64_t)) < 0)
+    {
+        FATAL("%s: failed to write the index\n", filename);
     }
+    if (fdatasync(fd) < 0) {
+        FATAL("fdatasync %s, %s\n", filename, strerror(errno));
+    }
+
+    // log the statistics
+    INFO("%s: writes=%lld syncs=%lld bytes=%lld\n", 
+         filename, (long long)stat_writes, (long long)stat_syncs, (long long)stat_bytes);
+    jitter_log("write_data write", &write_latency);
+    jitter_log("write_data fdatasync", &sync_latency);
 
-    // close the file, and exit this thread
+    // close the files, and exit this thread
     close(fd);
     fd = -1;
+    if (shp_fd >= 0) {
+        close(shp_fd);
+    }
+    free(buff);
+    free(index);
+    return NULL;
+}
+
+// writes len bytes to the .dat file at offset, continuing a short write; a
+// failed write is retried once per second, so that a transient error, such
+// as the disk being full, does not lose the data; returns -1 when the write 
+// has failed WRITE_RETRIES times
+static int dat_write(void *buff, int len, off_t offset)
+{
+    int rc, retries = 0;
+
+    for (uint8_t *p = buff; len > 0; p += rc, len -= rc, offset += rc) {
+        rc = pwrite(fd, p, len, offset);
+        if (rc < 0 && errno == EINTR) {
+            rc = 0;
+        } else if (rc <= 0) {
+            if (retries++ == WRITE_RETRIES) {
+                ERROR("writing pulse_count to %s, rc=%d, %s\n", filename, rc, strerror(errno));
+                return -1;
+            }
+            WARN("writing pulse_count to %s, rc=%d, %s, retrying\n", filename, rc, strerror(errno));
+            sleep(1);
+            rc = 0;
+        }
+    }
+    return 0;
+}
+
+// -----------------  DAT FILE RECORD ENCODING  ----------------------------
+
+// A version 3 .dat file's records, each a channel's pulse_count_t of a second,
+// are encoded as:
+// - varint n, the number of non-zero buckets
+// - for each non-zero bucket: varint of its index less the index of the prior
+//   non-zero bucket plus 1 (so the first is its index), and varint count
+// - varint mask, of the fields following the buckets (samples, samples_lost,
+//   ...) that differ from the channel's record of the prior second
+// - for each bit set in the mask: zigzag varint of the difference
+// The varints are little-endian base 128. Most of the buckets are 0, and the
+// fields following them rarely change, so a record is usually a few bytes 
+// rather than sizeof(pulse_count_t). The records are not aligned, so the
+// file is read and decoded sequentially.
+//
+// A version 4 .dat file's records are encoded as version 3, in chunks of the
+// SEG_SECS seconds of a segment; each chunk is:
+// - dat_chunk_hdr_t: the segment, the number of seconds, and the lengths of 
+//   the records and of the summary
+// - the records, num_chan for each second; the first second's records are 
+//   encoded following zero records, so a chunk is decoded without the chunks
+//   preceding it
+// - the summary: num_chan totals of the records of each of the SEG_MINUTES
+//   minutes, and then of the hour, each encoded following the channel's prior
+//   total (refer to sum_range)
+// The chunk_hdr is written with secs 0 when the chunk is begun, and is 
+// rewritten, following the records and the summary, when the chunk is 
+// completed. When 
+// the program terminates the chunk being written is completed, with the 
+// seconds written, and the file ends with the index of the chunks' offsets
+// and a dat_index_trailer_t. So the chunk, and the seconds, displayed in 
+// playback are located without reading the chunks preceding them; and the 
+// file of a program that did not terminate has no index, and its last 
+// chunk has no summary (refer to chunk_open).
+
+static inline uint8_t * put_varint(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static inline uint8_t * get_varint(uint8_t *p, uint8_t *end, uint32_t *v)
+{
+    uint32_t x = 0;
+    int      shift;
+
+    for (shift = 0; shift < 35 && p < end; shift += 7) {
+        x |= (uint32_t)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) {
+            *v = x;
+            return p;
+        }
+    }
     return NULL;
 }
 
+// encodes rec to out, prev is the channel's record of the prior second; 
+// returns the number of bytes, at most DAT_MAX_ENCODED(nfields)
+static int dat_encode_record(int *rec, int *prev, int nfields, uint8_t *out)
+{
+    uint8_t *p = out;
+    uint32_t mask = 0, n = 0;
+    int      i, last = -1;
+    int32_t  diff;
+
+    for (i = 0; i < MAX_BUCKET; i++) {
+        n += (rec[i] != 0);
+    }
+    p = put_varint(p, n);
+    for (i = 0; i < MAX_BUCKET; i++) {
+        if (rec[i] != 0) {
+            p = put_varint(p, i - last - 1);
+            p = put_varint(p, rec[i]);
+            last = i;
+        }
+    }
+
+    for (i = MAX_BUCKET; i < nfields; i++) {
+        if (rec[i] != prev[i]) {
+            mask |= 1u << (i - MAX_BUCKET);
+        }
+    }
+    p = put_varint(p, mask);
+    for (i = MAX_BUCKET; i < nfields; i++) {
+        if (mask & (1u << (i - MAX_BUCKET))) {
+            diff = rec[i] - prev[i];
+            p = put_varint(p, ((uint32_t)diff << 1) ^ (uint32_t)(diff >> 31));
+        }
+    }
+
+    return p - out;
+}
+
+// decodes the record at p, which ends at or before end, to rec; on entry rec
+// is the channel's record of the prior second; returns the position following
+// the record, or NULL when the record is truncated or invalid
+static uint8_t * dat_decode_record(uint8_t *p, uint8_t *end, int *rec, int nfields)
+{
+    uint32_t n, idx, v, mask;
+    int      i, last = -1;
+
+    memset(rec, 0, MAX_BUCKET * sizeof(int));
+    if ((p = get_varint(p, end, &n)) == NULL || n > MAX_BUCKET) {
+        return NULL;
+    }
+    while (n--) {
+        if ((p = get_varint(p, end, &idx)) == NULL || (p = get_varint(p, end, &v)) == NULL) {
+            return NULL;
+        }
+        last += idx + 1;
+        if (idx >= MAX_BUCKET || last >= MAX_BUCKET) {
+            return NULL;
+        }
+        rec[last] = v;
+    }
+
+    if ((p = get_varint(p, end, &mask)) == NULL) {
+        return NULL;
+    }
+    for (i = MAX_BUCKET; i < nfields; i++) {
+        if (mask & (1u << (i - MAX_BUCKET))) {
+            if ((p = get_varint(p, end, &v)) == NULL) {
+                return NULL;
+            }
+            rec[i] += (int32_t)((v >> 1) ^ -(v & 1));
+        }
+    }
+
+    return p;
+}
+
+// encodes the summary of segment s to out, following zero records; returns 
+// the number of bytes
+static int dat_encode_summary(int s, int nfields, uint8_t *out)
+{
+    static int zero_rec[DAT_MAX_FIELDS];
+    pulse_count_t *sum = SEG_SUM(s);
+    int len = 0, m, c;
+
+    for (m = 0; m <= SEG_MINUTES; m++) {
+        for (c = 0; c < num_chan; c++) {
+            len += dat_encode_record((int*)&sum[m * num_chan + c],
+                                     m > 0 ? (int*)&sum[(m-1) * num_chan + c] : zero_rec,
+                                     nfields, out + len);
+        }
+    }
+    return len;
+}
+
+// decodes up to max_records records, num_chan for each second, from p to end,
+// to data, or when data is NULL only counts them; the first records are 
+// decoded following zero records. The number of records decoded is returned
+// in records. Returns the position following the records, or NULL when a 
+// record is truncated or invalid.
+static uint8_t * dat_decode_records(uint8_t *p, uint8_t *end, pulse_count_t *data, size_t max_records,
+                                    int nfields, size_t *records)
+{
+    static int prev[MAX_TOTAL_CHAN][DAT_MAX_FIELDS];
+    size_t copy_len = (nfields * sizeof(int) < sizeof(pulse_count_t) ? nfields * sizeof(int) : sizeof(pulse_count_t));
+    size_t r;
+
+    memset(prev, 0, sizeof(prev));
+    for (r = 0; p < end && r < max_records; r++) {
+        int *rec = prev[r % num_chan];
+        p = dat_decode_record(p, end, rec, nfields);
+        if (p == NULL) {
+            break;
+        }
+        if (data != NULL) {
+            memcpy(&data[r], rec, copy_len);
+        }
+    }
+
+    *records = r;
+    return p;
+}
+
+// -----------------  DATA SUMMARIES  --------------------------------------
+
+// adds the fields of pc to sum
+static inline void sum_add(pulse_count_t *sum, pulse_count_t *pc)
+{
+    int *s = (int*)sum, *p = (int*)pc;
+
+    for (int i = 0; i < sizeof(pulse_count_t) / sizeof(int); i++) {
+        s[i] += p[i];
+    }
+}
+
+// sums chan's records of the seconds first to last, which must be within 0 to 
+// max_data-1; the summaries are used for the whole minutes and hours of the 
+// range, so a range of a day sums 24 hour totals and the minutes and seconds
+// at its ends, rather than 86400 records. In playback of a version 4 file the
+// segments and summaries are decoded when they are first used.
+static void sum_range(int first, int last, int chan, pulse_sum_t *sum)
+{
+    pulse_count_t *pc;
+    int t, s, i;
+
+    memset(sum, 0, sizeof(*sum));
+    for (t = first; t <= last; ) {
+        s = t / SEG_SECS;
+        if (t % 60 == 0 && t + 59 <= last) {
+            if (SEG_SUM(s) == NULL) {
+                sum_load(s);
+            }
+            if (t % SEG_SECS == 0 && t + SEG_SECS - 1 <= last) {
+                pc = &SUM_HOUR(t, chan);
+                t += SEG_SECS;
+            } else {
+                pc = &SUM_MINUTE(t, chan);
+                t += 60;
+            }
+        } else {
+            if (SEG(s) == NULL) {
+                seg_load(s);
+            }
+            pc = &DATA_CHAN(t, chan);
+            t++;
+        }
+
+        for (i = 0; i < MAX_BUCKET; i++) {
+            sum->bucket[i] += pc->bucket[i];
+        }
+        sum->samples += pc->samples;
+        sum->samples_lost += pc->samples_lost;
+        sum->busy += pc->busy;
+    }
+}
+
+// -----------------  PLAYBACK DATA  ---------------------------------------
+
+// when the playback file's records are mapped in place, advises the kernel 
+// that the records of the seconds first to last are about to be scanned; so
+// they are read ahead together, rather than faulted in a page at a time
+static void data_advise(int first, int last)
+{
+    static uintptr_t page_mask;
+    uintptr_t start, end;
+    int       max = MAX_DATA_LOAD();
+
+    if (data_map == NULL) {
+        return;
+    }
+    if (page_mask == 0) {
+        page_mask = ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+    }
+
+    clip_value(&first, 0, max-1);
+    clip_value(&last, 0, max-1);
+    if (first > last) {
+        return;
+    }
+    start = (uintptr_t)&DATA_CHAN(first, 0) & page_mask;
+    end = (uintptr_t)(&DATA_CHAN(last, num_chan-1) + 1);
+    madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+// opens the mapped version 4 file; the chunks are located from the index, or
+// when the file has no index, or the index is invalid, by scanning the 
+// chunk_hdrs, and the last chunk, which has no summary, is decoded to determine
+// its seconds; returns max_data. The chunk offsets located are valid, and
+// chunk_off[num_chunks] is the end of the last chunk; the chunk_hdrs of an
+// indexed file are validated when the chunk is first used (chunk_hdr_get), so 
+// opening the file reads only the index and the last chunk_hdr.
+static int chunk_open(char *map, off_t map_len, int hdr_size, int record_size)
+{
+    dat_index_trailer_t trailer;
+    dat_chunk_hdr_t     hdr;
+    int64_t             off;
+    int                 max_chunks = 0, s;
+    bool                indexed = false;
+
+    chunk_map = map;
+    chunk_map_len = map_len;
+    chunk_nfields = record_size / sizeof(int);
+    madvise(map, map_len, MADV_RANDOM);
+
+    // locate the chunks from the index
+    memset(&trailer, 0, sizeof(trailer));
+    if (map_len >= hdr_size + sizeof(trailer)) {
+        memcpy(&trailer, map + map_len - sizeof(trailer), sizeof(trailer));
+    }
+    if (trailer.magic == DAT_INDEX_MAGIC && 
+        trailer.num_chunks >= 0 && trailer.num_chunks <= MAX_SEG && 
+        trailer.index_offset >= hdr_size &&
+        trailer.index_offset + trailer.num_chunks * sizeof(int64_t) + sizeof(trailer) == map_len) 
+    {
+        num_chunks = trailer.num_chunks;
+        indexed = true;
+        chunk_off = malloc((num_chunks + 1) * sizeof(int64_t));
+        if (chunk_off == NULL) {
+            FATAL("%s, malloc index of %d chunks\n", filename, num_chunks);
+        }
+        memcpy(chunk_off, map + trailer.index_offset, num_chunks * sizeof(int64_t));
+        chunk_off[num_chunks] = trailer.index_offset;
+
+        // each chunk's chunk_hdr must follow the file_hdr, and precede the next
+        // chunk, or the index; and the last chunk must be valid and complete
+        for (s = 0; s < num_chunks; s++) {
+            if (chunk_off[s] < hdr_size || chunk_off[s] + (int64_t)sizeof(hdr) > chunk_off[s+1] ||
+                (s == num_chunks-1 && (!chunk_hdr_get(s, &hdr) || hdr.secs == 0)))
+            {
+                WARN("%s, chunk %d of the index is invalid, scanning the chunks\n", filename, s);
+                free(chunk_off);
+                chunk_off = NULL;
+                num_chunks = 0;
+                indexed = false;
+                break;
+            }
+        }
+    } else {
+        WARN("%s, has no index, scanning the chunks\n", filename);
+    }
+
+    // locate the chunks by scanning the chunk_hdrs; a chunk that is open, or
+    // is truncated, is the last; as is a chunk of fewer than SEG_SECS seconds
+    if (chunk_off == NULL) {
+        for (off = hdr_size; off + sizeof(hdr) <= map_len && num_chunks < MAX_SEG; ) {
+            if (!chunk_hdr_valid(num_chunks, off, &hdr)) {
+                WARN("%s, invalid chunk %d at offset %lld\n", filename, num_chunks, (long long)off);
+                break;
+            }
+            if (num_chunks + 1 >= max_chunks) {
+                max_chunks = (max_chunks ? 2 * max_chunks : 1024);
+                chunk_off = realloc(chunk_off, max_chunks * sizeof(int64_t));
+                if (chunk_off == NULL) {
+                    FATAL("%s, realloc index of %d chunks\n", filename, max_chunks);
+                }
+            }
+            chunk_off[num_chunks++] = off;
+            if (hdr.secs == 0 || off + sizeof(hdr) + hdr.data_len + hdr.sum_len > map_len) {
+                last_chunk_open = true;
+                break;
+            }
+            if (hdr.secs < SEG_SECS) {
+                break;
+            }
+            off += sizeof(hdr) + hdr.data_len + hdr.sum_len;
+        }
+        if (num_chunks > 0) {
+            chunk_off[num_chunks] = map_len;
+        }
+    }
+    if (num_chunks == 0) {
+        return 0;
+    }
+
+    // determine the seconds of the last chunk; when it is open, its records 
+    // are decoded to the end of the file
+    memcpy(&hdr, map + chunk_off[num_chunks-1], sizeof(hdr));
+    if (last_chunk_open) {
+        last_chunk_secs = SEG_SECS;
+        seg_load(num_chunks-1);
+    } else {
+        last_chunk_secs = hdr.secs;
+    }
+    INFO("%s, %d chunks, %s%s\n", filename, num_chunks, indexed ? "indexed" : "scanned",
+         last_chunk_open ? ", the last is incomplete" : "");
+
+    return (num_chunks - 1) * SEG_SECS + last_chunk_secs;
+}
+
+// returns true if the chunk_hdr of chunk s, at off, which is within the file,
+// has valid secs and lengths; the hdr is returned
+static bool chunk_hdr_valid(int s, int64_t off, dat_chunk_hdr_t *hdr)
+{
+    memcpy(hdr, chunk_map + off, sizeof(*hdr));
+    return hdr->magic == DAT_CHUNK_MAGIC && hdr->seg == s &&
+           hdr->secs >= 0 && hdr->secs <= SEG_SECS &&
+           hdr->data_len >= 0 && hdr->sum_len >= 0;
+}
+
+// returns true if the chunk_hdr of chunk s is valid, and, unless the chunk is
+// an open last chunk, its records and summary end within the chunk and it is
+// complete, or it is the last chunk; the hdr is returned
+static bool chunk_hdr_get(int s, dat_chunk_hdr_t *hdr)
+{
+    if (!chunk_hdr_valid(s, chunk_off[s], hdr)) {
+        return false;
+    }
+    if (s == num_chunks-1 && last_chunk_open) {
+        return true;
+    }
+    return (hdr->secs == SEG_SECS || (s == num_chunks-1 && hdr->secs > 0)) &&
+           chunk_off[s] + (int64_t)sizeof(*hdr) + hdr->data_len + hdr->sum_len <= chunk_off[s+1];
+}
+
+// decodes the records of chunk s to its segment; the segment decoded least
+// recently is freed when the segments decoded reach MAX_LOADED_BYTES. The
+// records of an open last chunk are decoded to the end of the file, and
+// last_chunk_secs is set to the seconds decoded.
+static void seg_load(int s)
+{
+    static loaded_t loaded;
+    dat_chunk_hdr_t hdr;
+    pulse_count_t * data;
+    uint8_t       * p, * end, * map_end = (uint8_t *)chunk_map + chunk_map_len;
+    size_t          records, max_records;
+    int             secs = (s == num_chunks-1 ? last_chunk_secs : SEG_SECS);
+
+    // decode the chunk's records; the records of an invalid chunk are zero
+    data = calloc((size_t)SEG_SECS * num_chan, sizeof(pulse_count_t));
+    if (data == NULL) {
+        FATAL("failed to allocate segment %d\n", s);
+    }
+    max_records = (size_t)secs * num_chan;
+    if (!chunk_hdr_get(s, &hdr)) {
+        ERROR("%s, chunk %d is invalid\n", filename, s);
+    } else {
+        p = (uint8_t *)chunk_map + chunk_off[s] + sizeof(hdr);
+        end = (s == num_chunks-1 && last_chunk_open ? map_end : p + hdr.data_len);
+        if (dat_decode_records(p, end, data, max_records, chunk_nfields, &records) == NULL ||
+            records < max_records) 
+        {
+            if (s == num_chunks-1 && last_chunk_open) {
+                last_chunk_secs = records / num_chan;
+            } else {
+                ERROR("%s, chunk %d, decoded %zu of %zu records\n", filename, s, records, max_records);
+            }
+        }
+    }
+
+    loaded_add(&loaded, seg, s, MAX_LOADED_BYTES, (size_t)SEG_SECS * num_chan * sizeof(pulse_count_t));
+    seg[s] = data;
+}
+
+// decodes the summary of chunk s; or when the file is not version 4, or chunk
+// s is an open last chunk, which has no summary, sums the records of chunk s.
+// The summary decoded least recently is freed when the summaries decoded
+// reach MAX_LOADED_SUM_BYTES.
+static void sum_load(int s)
+{
+    static loaded_t loaded;
+    dat_chunk_hdr_t hdr;
+    pulse_count_t * sum;
+    uint8_t       * p;
+    size_t          records, max_records = (size_t)(SEG_MINUTES + 1) * num_chan;
+    int             t, c, max;
+
+    sum = calloc(max_records, sizeof(pulse_count_t));
+    if (sum == NULL) {
+        FATAL("failed to allocate summary %d\n", s);
+    }
+    loaded_add(&loaded, seg_sum, s, MAX_LOADED_SUM_BYTES, max_records * sizeof(pulse_count_t));
+    seg_sum[s] = sum;
+
+    if (chunk_map != NULL && !(s == num_chunks-1 && last_chunk_open)) {
+        if (!chunk_hdr_get(s, &hdr)) {
+            ERROR("%s, chunk %d is invalid\n", filename, s);
+            return;
+        }
+        p = (uint8_t *)chunk_map + chunk_off[s] + sizeof(hdr) + hdr.data_len;
+        if (dat_decode_records(p, p + hdr.sum_len, sum, max_records, chunk_nfields, &records) == NULL ||
+            records != max_records)
+        {
+            ERROR("%s, summary of chunk %d is invalid\n", filename, s);
+        }
+        return;
+    }
+
+    if (SEG(s) == NULL) {
+        seg_load(s);
+    }
+    data_advise(s * SEG_SECS, (s + 1) * SEG_SECS - 1);
+    max = MAX_DATA_LOAD();
+    for (t = s * SEG_SECS; t < (s + 1) * SEG_SECS && t < max; t++) {
+        for (c = 0; c < num_chan; c++) {
+            sum_add(&SUM_MINUTE(t, c), &DATA_CHAN(t, c));
+        }
+    }
+    for (t = s * SEG_SECS; t < (s + 1) * SEG_SECS; t += 60) {
+        for (c = 0; c < num_chan; c++) {
+            sum_add(&SUM_HOUR(t, c), &SUM_MINUTE(t, c));
+        }
+    }
+}
+
+// records that entry s of tbl, of bytes, is loaded; and frees the entry 
+// loaded least recently when the entries loaded would exceed max_bytes, 
+// keeping at least 2
+static void loaded_add(loaded_t *l, pulse_count_t **tbl, int s, size_t max_bytes, size_t bytes)
+{
+    if (l->seg == NULL) {
+        l->max = (max_bytes / bytes > 2 ? max_bytes / bytes : 2);
+        l->seg = malloc(l->max * sizeof(int));
+        if (l->seg == NULL) {
+            FATAL("malloc %d\n", l->max);
+        }
+        memset(l->seg, -1, l->max * sizeof(int));
+    }
+
+    if (l->seg[l->next] >= 0) {
+        free(tbl[l->seg[l->next]]);
+        tbl[l->seg[l->next]] = NULL;
+    }
+    l->seg[l->next] = s;
+    l->next = (l->next + 1) % l->max;
+}
+
 // -----------------  CURSES WRAPPER CALLBACKS  ----------------------------
 
 // define plot area size and position
@@ -417,12 +1616,12 @@ static void update_display(int maxy, int maxx)
     static char x_axis[1000];
     static bool first_call = true;
 
-    int y;
+    int y, max = MAX_DATA_LOAD();
 
     // initialize on first call
     if (first_call) {
         INFO("maxx = %d  maxy = %d\n", maxx, maxy);
-        end_idx = max_data - 1;
+        end_idx = max - 1;
         memset(x_axis, '-', MAX_X);
         first_call = false;
     }
@@ -445,15 +1644,26 @@ static void update_display(int maxy, int maxx)
     mvprintw(25, 0, "avg_intvl = %d", avg_intvl);
     mvprintw(26, 0, "y_max     = %d", y_max);
     print_centered(27, 40, COLOR_PAIR_NONE, "%s", MODE_STR(mode));
-    print_centered(28, 40, COLOR_PAIR_NONE, "%s - %d", filename, max_data);
+    print_centered(28, 40, COLOR_PAIR_NONE, "%s - %d", filename, max);
+    if (num_chan > 1) {
+        mvprintw(28, 0, "chan      = %d", display_chan);
+    }
 
-    // display either the neutron count plot or histogram
+    // display either the neutron count plot or histogram, of at most the
+    // MAX_X * avg_intvl seconds ending at end_idx; when avg_intvl is a minute
+    // or more these are mostly summed from the summaries (refer to sum_range)
+    if (avg_intvl < 60) {
+        data_advise(end_idx - MAX_X * avg_intvl, end_idx);
+    }
     switch (display_select) {
     case DISPLAY_PLOT:
         update_display_plot();
         break;
     case DISPLAY_HISTOGRAM:
-        update_display_histogram();
+        if (!update_display_mca_histogram()) {
+            update_display_histogram();
+        }
+        update_display_histogram_time_range();
         break;
     }
 
@@ -465,12 +1675,14 @@ static void update_display(int maxy, int maxx)
     if (cpm != -1) {
         int color = (tracking ? COLOR_PAIR_GREEN : COLOR_PAIR_RED);
         print_centered(24, 40, color, "%0.3f CPM", cpm);
+        print_centered(25, 40, COLOR_PAIR_NONE, "live %0.2f%%  dead %0.2f%%", 
+                       100 * get_live_time_fraction(end_idx), 100 * get_dead_time_fraction(end_idx));
     }
 }
 
 static void update_display_plot(void)
 {
-    int    x, y, idx, start_idx;
+    int    x, y, idx, start_idx, last_idx, align;
     time_t start_time, end_time;
     char   start_time_str[100], end_time_str[100];
 
@@ -478,11 +1690,15 @@ static void update_display_plot(void)
     // neutron count data is displayed; note that tracking can only be
     // set when in LIVE mode
     if (tracking) {
-        end_idx = max_data - 1;
+        end_idx = MAX_DATA_LOAD() - 1;
     }
 
-    // draw the neutron count rate plot
-    start_idx = end_idx - avg_intvl * (MAX_X - 1);
+    // draw the neutron count rate plot; when avg_intvl is whole hours or 
+    // minutes, the plot ends at the last whole hour or minute, so each point
+    // is summed from the hour or minute summaries (refer to sum_range)
+    align = (avg_intvl % SEG_SECS == 0 ? SEG_SECS : avg_intvl % 60 == 0 ? 60 : 1);
+    last_idx = end_idx - (end_idx + 1) % align;
+    start_idx = last_idx - avg_intvl * (MAX_X - 1);
     idx = start_idx;
     for (x = BASE_X; x < BASE_X+MAX_X; x++) {
         double cpm = get_average_cpm_for_pht(idx);
@@ -496,7 +1712,7 @@ static void update_display_plot(void)
 
     // draw x axis start and end times
     start_time = data_start_time + start_idx - avg_intvl;
-    end_time   = data_start_time + end_idx;
+    end_time   = data_start_time + last_idx;
     time2str(start_time, start_time_str, false);
     time2str(end_time, end_time_str, false);
     mvprintw(MAX_Y+1, BASE_X-4, "%s", start_time_str+11);
@@ -515,8 +1731,6 @@ static void update_display_histogram(void)
 {
     int       bidx, x, y, yy;
     double  * cpm;
-    time_t    start_time, end_time;
-    char      start_time_str[100], end_time_str[100];
     const int first_bucket = PULSE_HEIGHT_TO_BUCKET_IDX(MIN_PULSE_HEIGHT);
 
     // calculate the array of average bucket values; where each average bucket
@@ -551,6 +1765,65 @@ static void update_display_histogram(void)
             print_centered(MAX_Y+1, x, COLOR_PAIR_NONE, "%d", BUCKET_IDX_TO_PULSE_HEIGHT(bidx));
         }
     }
+}
+
+// when the mca data is available for the interval end_idx-avg_intvl+1 to end_idx,
+// display the mca histogram, rebinned to the MAX_X columns of the display, and
+// return true
+static bool update_display_mca_histogram(void)
+{
+    static uint32_t hist[MCA_MAX_BINS];
+    int      bin_width = mca_get_bin_width(), num_bins, col_width, col, bin, x, y, yy;
+    uint64_t sum;
+    double   cpm, live;
+
+    if (bin_width == 0 || !mca_get_hist(display_chan, end_idx-avg_intvl+1, end_idx, hist)) {
+        return false;
+    }
+
+    // the columns are at least as wide as the mca bins; each column is 
+    // the sum of the bins whose lower edge is within the column
+    num_bins = (MCA_MAX_BINS + bin_width - 1) / bin_width;
+    col_width = (mca_col > bin_width ? mca_col : bin_width);
+    live = get_live_time_fraction(end_idx);
+    for (col = 0; col < MAX_X; col++) {
+        sum = 0;
+        for (bin = (col * col_width + bin_width - 1) / bin_width;
+             bin < num_bins && bin * bin_width < (col + 1) * col_width;
+             bin++)
+        {
+            sum += hist[bin];
+        }
+        if (sum == 0) {
+            continue;
+        }
+
+        // plot the column; use color CYAN if it is within the pulse height threshold
+        cpm = ((double)sum / avg_intvl) * 60 / live;
+        x = BASE_X + col;
+        y = nearbyint(MAX_Y * (1 - cpm / y_max));
+        if (y < 0) y = 0;
+        if (col * col_width >= pht) attron(COLOR_PAIR(COLOR_PAIR_CYAN));
+        for (yy = y; yy <= MAX_Y; yy++) {
+            mvprintw(yy,x,"*");
+        }
+        if (col * col_width >= pht) attroff(COLOR_PAIR(COLOR_PAIR_CYAN));
+    }
+
+    // label the x axis, and the column width
+    for (col = 0; col < MAX_X; col++) {
+        if (col == 0 || col == MAX_X/2 || col == MAX_X-1) {
+            print_centered(MAX_Y+1, BASE_X + col, COLOR_PAIR_NONE, "%d", col * col_width);
+        }
+    }
+    mvprintw(27, 0, "mca_col   = %d", col_width);
+    return true;
+}
+
+static void update_display_histogram_time_range(void)
+{
+    time_t start_time, end_time;
+    char   start_time_str[100], end_time_str[100];
 
     // display the time range over which this histogram has been evaluated
     end_time   = data_start_time + end_idx;
@@ -606,11 +1879,14 @@ static double *get_average_cpm_for_all_buckets(int time_idx)
     static struct save_s {
         int time_idx;
         int avg_intvl;
+        int chan;
         double cpm[MAX_BUCKET];
     } save[MAX_SAVE];
 
     struct save_s *s;
-    int tidx, bidx, hidx, sum;
+    int bidx, hidx;
+    pulse_sum_t sum;
+    double live;
 
     // on first call init cpm_no_data, which is the return value 
     // for when time_idx is out of range
@@ -622,7 +1898,7 @@ static double *get_average_cpm_for_all_buckets(int time_idx)
     }
 
     // if time_idx is out of range then return cpm_no_data
-    if (time_idx-avg_intvl+1 < 0 || time_idx >= max_data) {
+    if (time_idx-avg_intvl+1 < 0 || time_idx >= MAX_DATA_LOAD()) {
         return cpm_no_data;
     }
 
@@ -630,24 +1906,23 @@ static double *get_average_cpm_for_all_buckets(int time_idx)
     // if so, then return the saved result
     hidx = (time_idx % MAX_SAVE);
     s = &save[hidx];
-    if (s->time_idx == time_idx && s->avg_intvl == avg_intvl) {
+    if (s->time_idx == time_idx && s->avg_intvl == avg_intvl && s->chan == display_chan) {
         return s->cpm;
     }
 
     // calculate the average for each bucket over the range
-    // time_idx-avg_intvl+1 to time_idx
+    // time_idx-avg_intvl+1 to time_idx, corrected for the live time
+    sum_range(time_idx-avg_intvl+1, time_idx, display_chan, &sum);
+    live = live_time_fraction(&sum);
     for (bidx = 0; bidx < MAX_BUCKET; bidx++) {
-        sum = 0;
-        for (tidx = time_idx-avg_intvl+1; tidx <= time_idx; tidx++) {
-            sum += data[tidx].bucket[bidx];
-        }
-        s->cpm[bidx] = ((double)sum / avg_intvl) * 60;
+        s->cpm[bidx] = ((double)sum.bucket[bidx] / avg_intvl) * 60 / live;
     }
 
-    // set the time_idx and avg_intvl signature in the result save tbl
+    // set the time_idx, avg_intvl and chan signature in the result save tbl
     // update table of saved results with the 
     s->time_idx = time_idx;
     s->avg_intvl = avg_intvl;
+    s->chan = display_chan;
 
     // return the array of bucket average values
     return s->cpm;
@@ -658,59 +1933,116 @@ static double *get_average_cpm_for_all_buckets(int time_idx)
 // Return -1 if time_idx is not valid.
 static double get_average_cpm_for_pht(int time_idx)
 {
-    int tidx, sum, sum_buckets, bidx;
+    int64_t sum_buckets;
+    int bidx, t;
+    pulse_sum_t sum;
     double cpm;
 
+    // the saved results are in a table per segment, allocated when a result
+    // of the segment is first saved; so they grow with the seconds displayed.
+    // A table is cleared when it is first used after avg_intvl, pht or 
+    // display_chan has changed, which is when its gen differs from save.gen
+    typedef struct {
+        int    gen;
+        double cpm[SEG_SECS];
+        bool   cpm_valid[SEG_SECS];
+    } save_cpm_t;
+    static save_cpm_t * save_tbl[MAX_SEG];
     static struct {
         int    avg_intvl;
         int    pht;
-        double cpm[MAX_DATA];
-        bool   cpm_valid[MAX_DATA];
+        int    chan;
+        int    gen;
     } save;
+    save_cpm_t * st;
 
     // if time_idx is out of range then return -1
-    if (time_idx-avg_intvl+1 < 0 || time_idx >= max_data) {
+    if (time_idx-avg_intvl+1 < 0 || time_idx >= MAX_DATA_LOAD()) {
         return -1;
     }
 
-    // if current avg_intvl or pht is different than the avg_intvl/pht associated
-    // with the saved results, then clear the saved results so that they
+    // if current avg_intvl, pht or display_chan is different than those associated
+    // with the saved results, then start a new gen so that the saved results
     // will be recalculated
-    if (save.avg_intvl != avg_intvl || save.pht != pht) {
-        memset(save.cpm_valid, 0, sizeof(save.cpm_valid));
+    if (save.avg_intvl != avg_intvl || save.pht != pht || save.chan != display_chan) {
         save.avg_intvl = avg_intvl;
         save.pht = pht;
+        save.chan = display_chan;
+        save.gen++;
+    }
+
+    // locate the table of time_idx's segment, allocating it, or clearing it
+    // if it is of a prior gen
+    st = save_tbl[time_idx / SEG_SECS];
+    if (st == NULL) {
+        st = save_tbl[time_idx / SEG_SECS] = malloc(sizeof(save_cpm_t));
+        if (st == NULL) {
+            FATAL("failed to allocate saved cpm of segment %d\n", time_idx / SEG_SECS);
+        }
+        st->gen = save.gen - 1;
+    }
+    if (st->gen != save.gen) {
+        memset(st->cpm_valid, 0, sizeof(st->cpm_valid));
+        st->gen = save.gen;
     }
 
     // if there is a saved result available for time_idx then return it
-    if (save.cpm_valid[time_idx]) {
-        return save.cpm[time_idx];
+    t = time_idx % SEG_SECS;
+    if (st->cpm_valid[t]) {
+        return st->cpm[t];
     }
 
     // calculate the cpm value that will be returned; and save the result 
-    sum = 0;
-    for (tidx = time_idx-avg_intvl+1; tidx <= time_idx; tidx++) {
-        // sum the buckets which contain counts for pules with heights
-        // that are greater or eqal to the pulse haight threshold
-        sum_buckets = 0;
-        for (bidx = PULSE_HEIGHT_TO_BUCKET_IDX(pht); bidx < MAX_BUCKET; bidx++) {
-            sum_buckets += data[tidx].bucket[bidx];
-        }
+    sum_range(time_idx-avg_intvl+1, time_idx, display_chan, &sum);
 
-        // sum the sum_buckets that was just calculated
-        sum += sum_buckets;
+    // sum the buckets which contain counts for pules with heights
+    // that are greater or eqal to the pulse haight threshold
+    sum_buckets = 0;
+    for (bidx = PULSE_HEIGHT_TO_BUCKET_IDX(pht); bidx < MAX_BUCKET; bidx++) {
+        sum_buckets += sum.bucket[bidx];
     }
-    cpm = ((double)sum / avg_intvl) * 60;
-    save.cpm[time_idx] = cpm;
-    save.cpm_valid[time_idx] = true;
+    cpm = ((double)sum_buckets / avg_intvl) * 60 / live_time_fraction(&sum);
+    st->cpm[t] = cpm;
+    st->cpm_valid[t] = true;
 
     // return the cpm value
     return cpm;
 }
 
+// Return the fraction of ADC samples during which a pulse could be detected;
+//  that is the samples that were analyzed, rather than lost, less those
+//  within pulses (the dead time), over the time range time_idx-avg_intvl+1 
+//  to time_idx;
+// Return 1 if the number of samples is not known, such as for data
+//  from files written by earlier versions of this program.
+static double get_live_time_fraction(int time_idx)
+{
+    pulse_sum_t sum;
+
+    sum_range(time_idx-avg_intvl+1, time_idx, display_chan, &sum);
+    return live_time_fraction(&sum);
+}
+
+// Return the live time fraction of the totals sum.
+static double live_time_fraction(pulse_sum_t *sum)
+{
+    return (sum->samples > sum->busy ? 
+            (double)(sum->samples - sum->busy) / (sum->samples + sum->samples_lost) : 1);
+}
+
+// Return the fraction of the ADC samples analyzed that were within pulses,
+//  over the time range time_idx-avg_intvl+1 to time_idx.
+static double get_dead_time_fraction(int time_idx)
+{
+    pulse_sum_t sum;
+
+    sum_range(time_idx-avg_intvl+1, time_idx, display_chan, &sum);
+    return (sum.samples > 0 ? (double)sum.busy / sum.samples : 0);
+}
+
 static int input_handler(int input_char)
 {
-    int _max_data = max_data;
+    int _max_data = MAX_DATA_LOAD();
 
     // process input_char
     switch (input_char) {
@@ -734,11 +2066,28 @@ static int input_handler(int input_char)
         y_max = y_max_tbl[i];
         break; }
     case '-': case '=': {
-        // adjust avg_intvl
-        int incr = (avg_intvl >= 100 ? 10 : 1);
+        // adjust avg_intvl, by an hour above an hour
+        int incr = (avg_intvl > 3600 || (avg_intvl == 3600 && input_char == '=') ? 3600 :
+                    avg_intvl >= 100 ? 10 : 1);
         if (input_char == '-') avg_intvl -= incr;
         if (input_char == '=') avg_intvl += incr;
-        clip_value(&avg_intvl, 1, 3600);
+        clip_value(&avg_intvl, 1, MAX_AVG_INTVL);
+        break; }
+    case '[': case ']': {
+        // adjust the width of the columns of the mca histogram display
+        #define MAX_MCA_COL_TBL (sizeof(mca_col_tbl)/sizeof(mca_col_tbl[0]))
+        static int mca_col_tbl[] = { 1, 2, 5, 10, 20, 40, 70 };  // ADC units
+        int i;
+        for (i = 0; i < MAX_MCA_COL_TBL; i++) {
+            if (mca_col == mca_col_tbl[i]) {
+                break;
+            }
+        }
+        assert(i < MAX_MCA_COL_TBL);
+        if (input_char == '[') i--;
+        if (input_char == ']') i++;
+        clip_value(&i, 0, MAX_MCA_COL_TBL-1);
+        mca_col = mca_col_tbl[i];
         break; }
     case '1': case '2':
         // adjust pht (pulse height threshold)
@@ -766,6 +2115,10 @@ static int input_handler(int input_char)
         clip_value(&end_idx, 0, _max_data-1);
         tracking = (mode == MODE_LIVE && end_idx == _max_data-1);
         break;
+    case 'c':
+        // select the channel displayed
+        display_chan = (display_chan + 1) % num_chan;
+        break;
     case KEY_F0+1: case KEY_F0+2: 
         // select plot or historgram display
         display_select = (input_char == KEY_F0+1 ? DISPLAY_PLOT : DISPLAY_HISTOGRAM);
@@ -0,0 +1,366 @@
+#include <common.h>
+
+// Multichannel analyser (MCA) mode: a histogram of the pulse heights, of the
+// pulses counted in pulse_count.bucket[], with up to MCA_MAX_BINS bins of
+// bin_width ADC units; the bin_width is chosen with the -m option. The
+// pulse_count.bucket[] histogram, of MAX_BUCKET buckets of BUCKET_SIZE, is
+// unchanged.
+//
+// mca_add is called by publish, once per second, with the full resolution
+// histogram of the pulse heights for the second. Most of the bins are zero,
+// so the bins are stored sparsely, as a list of the non-zero bins and their
+// counts, in a ring of MCA_MAX_ENTRIES; when the ring is full the oldest
+// seconds are discarded from memory, so the memory used is bounded. The
+// mca_writer_thread writes each second's list to the .mca file. The display
+// rebins the histogram, over the seconds being displayed, with mca_get_hist.
+//
+// When there are multiple ADC channels each has its own histogram; the seconds
+// are added for each channel in turn, and a second is complete when it has
+// been added for all of the channels. The channels of multiple devices are
+// added by each device's consumer thread, independently, so mca_add is
+// serialized by a mutex.
+//
+// MCA file format:
+// - mca_hdr_t, which contains the bin_width, num_bins and num_chan
+// - for each second, and each channel: mca_record_hdr_t, which contains the 
+//   second's time_idx (seconds since start_time), the channel, and the number
+//   of entries that follow; and the entries, each is MCA_ENTRY(bin, count)
+
+//
+// defines
+//
+
+#define MCA_MAX_ENTRIES  (1 << 23)    // ring size, must be power of 2
+#define MCA_MAX_SECS     (20*86400)
+
+//
+// typedefs
+//
+
+typedef struct {
+    uint64_t start;        // position, in the ring, of the second's first entry
+    int32_t  n;            // number of entries
+    bool     present;
+} mca_index_t;
+
+//
+// variables
+//
+
+static bool          enabled;
+static int32_t       bin_width;
+static int32_t       num_bins;
+static int32_t       num_chan;
+static int           fd = -1;
+static char          filename[200];
+static pthread_t     writer_thread_id;
+static bool          writer_terminate;
+static uint32_t    * entries;
+static uint64_t      entries_produced;
+static mca_index_t * idx;                // of each second, and each channel
+static int32_t       max_time_idx;       // time_idx following the last second completed
+static int32_t       chan_time_idx[MAX_TOTAL_CHAN];  // time_idx following the last second added
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// prototypes
+//
+
+static int32_t mca_alloc(int32_t bin_width_arg, int32_t num_chan_arg);
+static void add_entries(int32_t chan, int32_t time_idx, uint32_t * e, int32_t n);
+static void * mca_writer_thread(void * cx);
+
+// -----------------  PUBLIC ROUTINES  ----------------------------------
+
+// live mode: create the .mca file, with bins of bin_width_arg ADC units, for
+// num_chan_arg channels
+int32_t mca_start(char * filename_arg, time_t start_time, int32_t bin_width_arg, int32_t num_chan_arg)
+{
+    mca_hdr_t hdr;
+    int32_t rc;
+
+    if (mca_alloc(bin_width_arg, num_chan_arg) < 0) {
+        return -1;
+    }
+
+    // create the mca file, and write the hdr
+    strncpy(filename, filename_arg, sizeof(filename)-1);
+    fd = open(filename, O_WRONLY|O_CREAT|O_EXCL, 0644);
+    if (fd < 0) {
+        ERROR("%s, open for writing, %s\n", filename, strerror(errno));
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = MCA_MAGIC;
+    hdr.hdr_size = sizeof(hdr);
+    hdr.start_time = start_time;
+    hdr.bin_width = bin_width;
+    hdr.num_bins = num_bins;
+    hdr.num_chan = num_chan;
+    rc = write(fd, &hdr, sizeof(hdr));
+    if (rc != sizeof(hdr)) {
+        ERROR("%s, write hdr, rc=%d, %s\n", filename, rc, strerror(errno));
+        return -1;
+    }
+
+    // create the writer thread
+    rc = pthread_create(&writer_thread_id, NULL, mca_writer_thread, NULL);
+    if (rc != 0) {
+        ERROR("pthread_create mca_writer_thread, %s\n", strerror(rc));
+        return -1;
+    }
+
+    INFO("mca to %s, bin_width=%d num_bins=%d num_chan=%d\n", filename, bin_width, num_bins, num_chan);
+    enabled = true;
+    return 0;
+}
+
+void mca_stop(void)
+{
+    if (!enabled || fd < 0) {
+        return;
+    }
+
+    writer_terminate = true;
+    pthread_join(writer_thread_id, NULL);
+
+    INFO("%s: seconds=%d entries=%lld\n", filename, max_time_idx, (long long)entries_produced);
+    close(fd);
+    fd = -1;
+}
+
+// playback mode: read the .mca file; returns -1 if the file does not exist
+// or is not valid, in which case the display uses pulse_count.bucket[]
+int32_t mca_load(char * filename_arg)
+{
+    mca_hdr_t        hdr;
+    mca_record_hdr_t rec;
+    uint32_t         e[MCA_MAX_BINS];
+    int32_t          rc, fd_load;
+    int64_t          offset;
+
+    fd_load = open(filename_arg, O_RDONLY);
+    if (fd_load < 0) {
+        return -1;
+    }
+
+    // read the hdr; files written by earlier versions have 1 channel, and
+    // their hdr ends at num_chan
+    memset(&hdr, 0, sizeof(hdr));
+    rc = read(fd_load, &hdr, offsetof(mca_hdr_t, num_chan));
+    if (rc != offsetof(mca_hdr_t, num_chan) || hdr.magic != MCA_MAGIC || 
+        hdr.hdr_size < offsetof(mca_hdr_t, num_chan)) 
+    {
+        ERROR("%s, invalid hdr\n", filename_arg);
+        close(fd_load);
+        return -1;
+    }
+    if (hdr.hdr_size >= sizeof(hdr) && pread(fd_load, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        ERROR("%s, read hdr, %s\n", filename_arg, strerror(errno));
+        close(fd_load);
+        return -1;
+    }
+    if (mca_alloc(hdr.bin_width, hdr.num_chan ? hdr.num_chan : 1) < 0 || num_bins != hdr.num_bins) {
+        ERROR("%s, invalid bin_width=%d num_bins=%d\n", filename_arg, hdr.bin_width, hdr.num_bins);
+        close(fd_load);
+        return -1;
+    }
+
+    // read the records; the ring holds the most recent MCA_MAX_ENTRIES
+    offset = hdr.hdr_size;
+    while (pread(fd_load, &rec, sizeof(rec), offset) == sizeof(rec)) {
+        if (rec.n > num_bins || rec.chan >= num_chan || rec.time_idx >= MCA_MAX_SECS) {
+            ERROR("%s, invalid record at offset %lld\n", filename_arg, (long long)offset);
+            break;
+        }
+        rc = pread(fd_load, e, rec.n * sizeof(uint32_t), offset + sizeof(rec));
+        if (rc != rec.n * sizeof(uint32_t)) {
+            break;
+        }
+        add_entries(rec.chan, rec.time_idx, e, rec.n);
+        offset += sizeof(rec) + rec.n * sizeof(uint32_t);
+    }
+
+    close(fd_load);
+    INFO("%s: bin_width=%d num_bins=%d num_chan=%d seconds=%d\n", 
+         filename_arg, bin_width, num_bins, num_chan, max_time_idx);
+    enabled = true;
+    return 0;
+}
+
+// called by publish, once per second for each channel, with the histogram of 
+// the heights of the pulses counted, in MCA_MAX_BINS bins of 1 ADC unit
+void mca_add(int32_t chan, int32_t time_idx, uint32_t * heights)
+{
+    uint32_t bins[MCA_MAX_BINS], e[MCA_MAX_BINS];
+    int32_t  i, n = 0;
+
+    if (!enabled || chan >= num_chan || time_idx < 0 || time_idx >= MCA_MAX_SECS) {
+        return;
+    }
+
+    // rebin, and list the non-zero bins
+    memset(bins, 0, num_bins * sizeof(uint32_t));
+    for (i = 0; i < MCA_MAX_BINS; i++) {
+        bins[i / bin_width] += heights[i];
+    }
+    for (i = 0; i < num_bins; i++) {
+        if (bins[i]) {
+            e[n++] = MCA_ENTRY(i, bins[i] < MCA_MAX_COUNT ? bins[i] : MCA_MAX_COUNT);
+        }
+    }
+
+    pthread_mutex_lock(&mutex);
+    add_entries(chan, time_idx, e, n);
+    pthread_mutex_unlock(&mutex);
+}
+
+// returns the bin_width, or 0 when there is no mca data
+int32_t mca_get_bin_width(void)
+{
+    return (enabled ? bin_width : 0);
+}
+
+// sums the channel's histograms of the seconds first to last into hist, of
+// num_bins; returns false if any of these seconds is not available
+bool mca_get_hist(int32_t chan, int32_t first, int32_t last, uint32_t * hist)
+{
+    mca_index_t * x;
+    uint64_t      produced;
+    int32_t       t, i;
+
+    if (!enabled || chan >= num_chan || first < 0 || 
+        last >= __atomic_load_n(&max_time_idx, __ATOMIC_ACQUIRE)) 
+    {
+        return false;
+    }
+
+    memset(hist, 0, num_bins * sizeof(uint32_t));
+    for (t = first; t <= last; t++) {
+        x = &idx[t * num_chan + chan];
+        if (!x->present) {
+            return false;
+        }
+        for (i = 0; i < x->n; i++) {
+            uint32_t e = entries[(x->start + i) & (MCA_MAX_ENTRIES-1)];
+            hist[MCA_ENTRY_BIN(e)] += MCA_ENTRY_COUNT(e);
+        }
+
+        // if the entries have been overwritten, while being summed, then
+        // this second is no longer available
+        produced = __atomic_load_n(&entries_produced, __ATOMIC_ACQUIRE);
+        if (produced - x->start > MCA_MAX_ENTRIES) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// -----------------  PRIVATE ROUTINES  ---------------------------------
+
+static int32_t mca_alloc(int32_t bin_width_arg, int32_t num_chan_arg)
+{
+    if (bin_width_arg < 1 || bin_width_arg > MCA_MAX_BINS) {
+        ERROR("mca bin_width must be 1 to %d\n", MCA_MAX_BINS);
+        return -1;
+    }
+    if (num_chan_arg < 1 || num_chan_arg > MAX_TOTAL_CHAN) {
+        ERROR("mca num_chan must be 1 to %d\n", MAX_TOTAL_CHAN);
+        return -1;
+    }
+    bin_width = bin_width_arg;
+    num_bins = (MCA_MAX_BINS + bin_width - 1) / bin_width;
+    num_chan = num_chan_arg;
+
+    entries = calloc(MCA_MAX_ENTRIES, sizeof(uint32_t));
+    idx = calloc((size_t)MCA_MAX_SECS * num_chan, sizeof(mca_index_t));
+    if (entries == NULL || idx == NULL) {
+        ERROR("calloc mca failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// adds the entries of a second of the channel to the ring, and indexes them; 
+// each channel's seconds are added in order, and the second is complete when 
+// it has been added for all of the channels
+static void add_entries(int32_t chan, int32_t time_idx, uint32_t * e, int32_t n)
+{
+    mca_index_t * x = &idx[time_idx * num_chan + chan];
+    int32_t i, c, min;
+
+    for (i = 0; i < n; i++) {
+        entries[(entries_produced + i) & (MCA_MAX_ENTRIES-1)] = e[i];
+    }
+    x->start = entries_produced;
+    x->n = n;
+    x->present = true;
+    __atomic_store_n(&entries_produced, entries_produced + n, __ATOMIC_RELEASE);
+    chan_time_idx[chan] = time_idx + 1;
+    for (min = chan_time_idx[0], c = 1; c < num_chan; c++) {
+        if (chan_time_idx[c] < min) {
+            min = chan_time_idx[c];
+        }
+    }
+    if (min > max_time_idx) {
+        __atomic_store_n(&max_time_idx, min, __ATOMIC_RELEASE);
+    }
+}
+
+// -----------------  MCA WRITER THREAD  --------------------------------
+
+static void * mca_writer_thread(void * cx)
+{
+    uint32_t         e[MCA_MAX_BINS];
+    mca_record_hdr_t rec;
+    struct iovec     iov[2] = { { &rec, sizeof(rec) }, { e, 0 } };
+    mca_index_t    * x;
+    int32_t          t, c, i, rc, written = 0, max_t, len;
+    bool             terminate;
+
+    rt_thread("mca", RT_WRITER, 0);
+
+    while (true) {
+        // read the terminate flag prior to checking for seconds added, so
+        // that all of the seconds added prior to terminating are written
+        terminate = writer_terminate;
+
+        max_t = __atomic_load_n(&max_time_idx, __ATOMIC_ACQUIRE);
+        for (t = written; t < max_t; t++) {
+            for (c = 0; c < num_chan; c++) {
+                x = &idx[t * num_chan + c];
+                if (!x->present) {
+                    continue;
+                }
+
+                // copy the entries from the ring, and check they were not overwritten
+                for (i = 0; i < x->n; i++) {
+                    e[i] = entries[(x->start + i) & (MCA_MAX_ENTRIES-1)];
+                }
+                if (__atomic_load_n(&entries_produced, __ATOMIC_ACQUIRE) - x->start > MCA_MAX_ENTRIES) {
+                    WARN("%s: time_idx %d chan %d overwritten before written\n", filename, t, c);
+                    continue;
+                }
+
+                rec.time_idx = t;
+                rec.n = x->n;
+                rec.chan = c;
+                iov[1].iov_len = x->n * sizeof(uint32_t);
+                len = sizeof(rec) + iov[1].iov_len;
+                rc = writev(fd, iov, 2);
+                if (rc != len) {
+                    ERROR("%s, write, rc=%d, %s\n", filename, rc, strerror(errno));
+                    return NULL;
+                }
+            }
+        }
+        written = max_t;
+
+        if (terminate) {
+            break;
+        }
+        usleep(100000);
+    }
+
+    return NULL;
+}
@@ -1,9 +1,375 @@
 #include <common.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// The pulse detector is a state machine which scans the data, in place, in the
+// ring slices passed to mccdaq_callback; its state is carried across calls. So
+// a pulse is detected regardless of how the data is split among the calls, or 
+// whether it spans the end of a second.
+//
+// Positions are counted from the sample clock's start time, and include the
+// samples lost; second N contains the positions N*frequency to 
+// (N+1)*frequency-1.
+//
+// When the ADC samples multiple channels, the data is frames of a sample of 
+// each channel (refer to common.h). Each channel has its own detector, det[chan],
+// baseline estimator, filter state and shape histogram; and its positions count
+// the channel's samples, frequency is CHAN_FREQUENCY. The frames are 
+// demultiplexed DEMUX_BLOCK frames at a time, to a buffer per channel, and each
+// channel's buffer is scanned while the block is still in the cache. When there
+// are worker threads the blocks are larger, so that each channel's block can be
+// shared by the workers.
+//
+// When a pulse shaping filter is selected (refer to shaper.c), the detector
+// scans the filter's output rather than the ADC samples.
+//
+// The baseline is estimated separately from the pulse detection, as the mode
+// of a histogram of every BASELINE_STRIDE'th sample that is below the pulse
+// threshold, over a window of the 2 most recent blocks of BASELINE_BLOCK 
+// samples; it is updated at the end of each block. The mode is not moved by
+// the pulses, nor by noise, and the update is O(1) per sample.
+//
+// At high count rates pulses overlap (pile-up); either the second pulse rides
+// on the tail of the first, and the two merge into one wide pulse, or the merged
+// pulse is too long and is abandoned. When a pulse ends, its samples are checked
+// for multiple maxima, and the piled up pulses are counted separately. So a
+// pulse is missed only when it arrives on the leading edge of another, before
+// the other has begun to fall; these samples are counted as busy, they are the
+// detector's dead time, which is used to correct the count rate (refer to 
+// get_live_time_fraction in main.c). Both are done once per pulse, not per 
+// sample.
+//
+// The detection can be shared by worker threads (the -j option). A slice of
+// at least PARALLEL_MIN samples is split into a chunk per worker, and is 
+// processed in 2 phases. In phase 1 each worker filters its chunk, when a 
+// filter is selected, and adds its chunk to a histogram per baseline block;
+// the histograms are then merged, and the baseline determined at each block 
+// end, in order. In phase 2 each worker scans its chunk. The detector's state
+// at the start of a chunk is not known, but it is known at each sample that 
+// is below the pulse threshold: not in a pulse. So each worker starts at the 
+// last such sample preceding its chunk, the overlap, and discards the 
+// pulses that end before its chunk; those are counted by the prior worker. 
+// The pulse_counts of the seconds that end in a worker's chunk, the list mode
+// events and the shape histogram are kept by the worker, and are merged in 
+// order when the workers are done. So the results are identical to scanning
+// the slice serially.
+//
+// When there are multiple devices (refer to util_mccdaq.c) mccdaq_callback is
+// called by each device's consumer thread, with the device number. Each device
+// has its own state, device[dev], and its own worker threads; and the channels
+// of device dev are det[dev*num_chan] to det[dev*num_chan+num_chan-1], so the 
+// channel number of the detectors and of the results is the channel's number
+// among all of the devices.
+
+#define MAX_PULSE_LEN  64   // samples, longer pulses are abandoned
+#define PILEUP_DIP     10   // ADC units, the dip between the maxima of piled up pulses
+
+#define BASELINE_BLOCK   (1 << 18)  // samples of a channel, about 0.5 second with 1 channel
+#define BASELINE_STRIDE  8          // 1 in 8 samples are added to the histogram
+#define BASELINE_MIN     1000       // min samples in the window to estimate the baseline
+
+#define DEMUX_BLOCK      8192       // frames demultiplexed at a time
+
+#define MAX_THREADS      16
+#define PARALLEL_MIN     (1 << 16)                       // min samples to use the worker threads
+#define PARALLEL_MAX     (1 << 20)                       // max samples per parallel region
+#define PARALLEL_MAX_SEG (PARALLEL_MAX / BASELINE_BLOCK + 2)  // max baseline blocks per region
+#define MAX_RECORDS      (PARALLEL_MAX / CHAN_FREQUENCY(MAX_CHAN) + 2)  // max seconds ending per region
+
+typedef struct worker_s worker_t;
+typedef struct par_s par_t;
+typedef struct device_s device_t;
+
+// the baseline in effect from pos
+typedef struct {
+    int64_t  pos;
+    int32_t  baseline;
+    double   confidence;
+} baseline_entry_t;
+
+// baseline estimator, of a channel; hist[cur] is the histogram of the current 
+// block, and hist[!cur] the prior block; the samples at or above thr[] are excluded
+typedef struct {
+    uint32_t hist[2][4096];
+    int32_t  thr[2];
+    int32_t  cur;
+    int64_t  next_pos;            // position of the end of the current block
+    int32_t  baseline;
+    double   confidence;          // fraction of the window within 2 of the baseline
+} bl_t;
+
+// the state of a pulse detector; det[chan] is the detector of the channel used 
+// when scanning serially, and each worker thread has its own
+typedef struct {
+    int32_t  chan;
+    bl_t   * bl;                  // the channel's baseline estimator
+    int32_t  baseline;
+    double   confidence;          // of the baseline
+    int64_t  pulse_start_pos;     // -1 when not in-a-pulse
+    bool     pulse_abandoned;     // the pulse was too long, waiting for it to end
+    int32_t  pulse_height;        // max height, so far, of the pulse
+    int32_t  pulse_area;          // sum of the heights, so far, of the pulse
+    int32_t  pulse_len;           // number of samples in pulse_v
+    int16_t  pulse_v[MAX_PULSE_LEN+2];  // heights of the sample preceding the pulse, 
+                                        // the pulse, and the sample following
+    int64_t  pos;                 // position of the next sample to scan
+    int64_t  received;            // position following the last sample received
+    int64_t  valid_from;          // position of the first sample following a gap
+    int16_t  last_sample;         // the sample preceding received
+    int64_t  next_baseline_pos;   // position at which the baseline next changes
+    int64_t  next_publish_pos;    // position at which the pulse_count is next published
+    pulse_count_t pulse_count;
+    uint32_t heights[MCA_MAX_BINS];  // histogram of the heights of the pulses counted
+    int32_t  total_pulses;
+    shape_hist_t * shape_hist;
+    baseline_entry_t * bl_tab;    // baselines determined in phase 1, or NULL
+    int32_t  bl_idx;              // the next entry of bl_tab
+    worker_t * w;                 // the worker that keeps the results, or NULL
+    device_t * dv;                // the device of the channel
+} det_t;
+
+// the results of a worker thread, merged when the workers are done
+typedef struct {
+    pulse_count_t pulse_count;
+    uint32_t heights[MCA_MAX_BINS];
+    int32_t  total_pulses;
+    time_t   time;
+    int32_t  baseline;
+    double   confidence;
+} record_t;
+
+struct worker_s {
+    det_t    det;
+    int32_t  k;                   // the worker's number
+    par_t  * par;                 // the worker threads that this is one of
+    uint32_t (*hist)[4096];       // histogram of each baseline block in the region
+    shape_hist_t shape_hist;
+    record_t records[MAX_RECORDS];
+    int32_t  nrecords;
+    listmode_event_t * events;
+    int32_t  nevents;
+    int32_t  max_events;
+    pthread_t thread_id;
+};
+
+// worker threads, and the parallel region, of len samples starting at
+// position pos, that they are processing; region[k] to region[k+1] is the
+// chunk of worker k, and sync[k] is the position the worker starts scanning
+struct par_s {
+    int32_t  dev;
+    int32_t  nthreads;
+    worker_t * w;
+    det_t    * det;               // the detector of the channel being processed
+    pthread_mutex_t mutex;
+    pthread_cond_t  start_cond;
+    pthread_cond_t  done_cond;
+    int64_t  gen;
+    int32_t  phase;
+    int32_t  done;
+
+    uint16_t * in;
+    int16_t  * x;
+    int16_t  * y;
+    int64_t  pos;
+    int32_t  len;
+    int32_t  nchunks;
+    int64_t  chunk[MAX_THREADS+1];
+    int64_t  sync[MAX_THREADS];
+    int64_t  seg[PARALLEL_MAX_SEG+1];
+    int32_t  nseg;
+    baseline_entry_t bl_tab[PARALLEL_MAX_SEG+1];
+    int32_t  nbl_tab;
+};
+
+// the state of each device; the buffer of each channel's samples, 
+// demultiplexed from the frames, and the device's worker threads
+struct device_s {
+    int32_t    dev;
+    bool       initialized;
+    time_t     sample_clock_start;
+    int32_t    mccdaq_restart_count;   // read when the device's first channel is published
+    int32_t    ring_high_water;
+    int32_t    gap_max_us;
+    int32_t    wakeup_max_us;
+    uint16_t * demux_buff[MAX_CHAN];
+    int32_t    demux_len;
+    par_t      par;
+};
+
+static int32_t      num_chan;           // of each device
+static int32_t      frequency;          // samples per second, of each channel
+
+// the state of each channel, of all of the devices, initialized by det_init
+static det_t        det[MAX_TOTAL_CHAN];
+static bl_t         bl[MAX_TOTAL_CHAN];
+static shape_hist_t shape_hist[MAX_TOTAL_CHAN];
+
+// the copy of each channel's shape histogram that is returned by 
+// pulse_get_shape_hist, updated when the channel's pulse_count is published
+static shape_hist_t    shape_hist_copy[MAX_TOTAL_CHAN];
+static pthread_mutex_t shape_hist_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static device_t     device[MAX_DEV] = { 
+    [0 ... MAX_DEV-1] = { .par = { .nthreads = 1, 
+                                   .mutex = PTHREAD_MUTEX_INITIALIZER, 
+                                   .start_cond = PTHREAD_COND_INITIALIZER, 
+                                   .done_cond = PTHREAD_COND_INITIALIZER } } };
+
+// pulse threshold and shape discrimination; the rise time and fwhm are in 
+// units of 1/16 sample
+static struct {
+    int32_t threshold;
+    int32_t max_width;
+    int32_t min_rise;
+    int32_t max_rise;
+    int32_t min_fwhm;
+    int32_t max_fwhm;
+} discrim = { MIN_PULSE_HEIGHT, 10, 0, INT32_MAX, 0, INT32_MAX };
+
+static void det_init(device_t * dv);
+static void receive_frames(device_t * dv, uint16_t * d, int32_t n);
+static void demux(device_t * dv, uint16_t * d, int32_t frames);
+static void receive_data(det_t * d, uint16_t * in, int32_t n);
+static void skip_lost_samples(det_t * d, int32_t lost);
+static void * worker_thread(void * cx);
+static void run_phase(par_t * par, int32_t phase);
+static void worker_phase(par_t * par, int32_t k, int32_t phase);
+static int16_t * scan_parallel(det_t * d, uint16_t * in, int32_t n);
+static void merge_worker(det_t * d, worker_t * w);
+static int64_t find_sync(par_t * par, int64_t pos);
+static void det_start(det_t * d, int64_t pos);
+static void scan(det_t * d, int16_t * x, int64_t x_pos, int32_t x_len, int64_t end_pos);
+static void scan_segment(det_t * d, int16_t * x, int64_t x_pos, int32_t x_len, int64_t end_pos);
+static void pulse_found(det_t * d, int16_t * x, int64_t x_pos, int32_t x_len, int32_t end_k);
+static void event_add(det_t * d, uint64_t pos, int32_t height, int32_t width, int32_t area,
+                      int32_t rise, int32_t fwhm, int32_t flags);
+static int32_t split_pileup(int16_t * v, int32_t len, int32_t * sub_start, int32_t * sub_height,
+                            int32_t * dead);
+static void pulse_shape(int16_t * v, int32_t len, int32_t h, int32_t * rise, int32_t * fwhm);
+static bool discrim_accept(int32_t width, int32_t rise, int32_t fwhm);
+static int32_t crossing(int16_t * v, int32_t i, int32_t level);
+static int32_t skip_baseline(int16_t * data, int32_t idx, int32_t end, int32_t baseline);
+static void baseline_accumulate(uint32_t * hist, int16_t * x, int64_t x_pos, int32_t k, int32_t k_end);
+static void baseline_update(bl_t * b, int64_t pos);
+static void baseline_next(det_t * d);
+static void publish_pulse_count(det_t * d, time_t time_now);
+static void pulse_count_add(pulse_count_t * pc, pulse_count_t * add);
+static void heights_add(uint32_t * heights, uint32_t * add);
 static void verbose_pulse_print(int32_t pulse_start_idx, int32_t pulse_end_idx, int32_t pulse_height,
                                 int32_t baseline, int16_t *data, int32_t max_data);
 static void print_plot_str(int32_t value, int32_t baseline);
 
+// -----------------  PULSE SHAPE DISCRIMINATION  -----------------
+
+// args is a comma separated list of the pulse threshold, and the limits of 
+// the pulses that are counted; the limits are in units of samples:
+// - threshold=<adc>  min pulse height; default MIN_PULSE_HEIGHT
+// - max_width=<n>   samples at or above the threshold; default 10
+// - min_rise, max_rise=<samples>    10% to 90% rise time
+// - min_fwhm, max_fwhm=<samples>    full width at half maximum
+// The pulses that are not counted are counted as rejected. Each of piled up
+// pulses is discriminated, using the samples from its start to the start of
+// the next, less the dip it starts from.
+int32_t pulse_discrim_init(char * args)
+{
+    char value[100];
+
+    #define DISCRIM_ARG(name, scale) \
+        do { \
+            if (getarg(args, #name, value, sizeof(value))) { \
+                discrim.name = lround(atof(value) * scale); \
+            } \
+        } while (0)
+
+    DISCRIM_ARG(threshold, 1);
+    DISCRIM_ARG(max_width, 1);
+    DISCRIM_ARG(min_rise, 16);
+    DISCRIM_ARG(max_rise, 16);
+    DISCRIM_ARG(min_fwhm, 16);
+    DISCRIM_ARG(max_fwhm, 16);
+    if (discrim.max_width < 1 || discrim.max_width > MAX_PULSE_LEN) {
+        ERROR("max_width must be 1 to %d\n", MAX_PULSE_LEN);
+        return -1;
+    }
+    if (discrim.threshold < 1 || discrim.threshold > 4095) {
+        ERROR("threshold must be 1 to 4095\n");
+        return -1;
+    }
+
+    INFO("threshold=%d max_width=%d rise=%.2f-%.2f fwhm=%.2f-%.2f\n",
+         discrim.threshold, discrim.max_width, 
+         discrim.min_rise/16., discrim.max_rise == INT32_MAX ? INFINITY : discrim.max_rise/16.,
+         discrim.min_fwhm/16., discrim.max_fwhm == INT32_MAX ? INFINITY : discrim.max_fwhm/16.);
+    return 0;
+}
+
+// returns a copy of the histogram of pulse height and shape, of the pulses
+// detected on the channel, including those rejected, but not those piled up;
+// the histogram is as of the last second published, it is updated without a 
+// lock by the detection, so the copy is made when the second is published
+void pulse_get_shape_hist(int32_t chan, shape_hist_t * sh)
+{
+    pthread_mutex_lock(&shape_hist_mutex);
+    *sh = shape_hist_copy[chan];
+    pthread_mutex_unlock(&shape_hist_mutex);
+    sh->magic = SHAPE_HIST_MAGIC;
+    sh->max_bucket = MAX_BUCKET;
+    sh->max_shape_bucket = MAX_SHAPE_BUCKET;
+}
+
+// creates the worker threads that share the pulse detection, for each of the
+// devices added by mccdaq_init; nthreads includes the device's mccdaq consumer
+// thread which is worker 0
+int32_t pulse_threads_init(int32_t nthreads)
+{
+    int32_t k, rc, dev;
+    par_t * par;
+
+    if (nthreads < 1 || nthreads > MAX_THREADS) {
+        ERROR("threads must be 1 to %d\n", MAX_THREADS);
+        return -1;
+    }
+    if (nthreads == 1) {
+        return 0;
+    }
+
+    for (dev = 0; dev < mccdaq_get_num_dev(); dev++) {
+        par = &device[dev].par;
+        par->dev = dev;
+        par->w = calloc(nthreads, sizeof(worker_t));
+        par->y = malloc((PARALLEL_MAX + 4) * sizeof(int16_t));
+        if (par->w == NULL || par->y == NULL) {
+            ERROR("calloc workers failed\n");
+            return -1;
+        }
+        for (k = 0; k < nthreads; k++) {
+            par->w[k].k = k;
+            par->w[k].par = par;
+            par->w[k].hist = calloc(PARALLEL_MAX_SEG, sizeof(par->w[k].hist[0]));
+            if (par->w[k].hist == NULL) {
+                ERROR("calloc worker hist failed\n");
+                return -1;
+            }
+        }
+
+        par->nthreads = nthreads;
+        for (k = 1; k < nthreads; k++) {
+            rc = pthread_create(&par->w[k].thread_id, NULL, worker_thread, &par->w[k]);
+            if (rc != 0) {
+                ERROR("pthread_create worker_thread, %s\n", strerror(rc));
+                return -1;
+            }
+        }
+    }
+
+    INFO("pulse detection threads=%d, of each of %d devices\n", nthreads, mccdaq_get_num_dev());
+    return 0;
+}
+
 // -----------------  MCCDAQ CALLBACK  ----------------------------
 
 // This program uses the raw ADC value, and does not convert to mV.
@@ -13,173 +379,1012 @@ static void print_plot_str(int32_t value, int32_t baseline);
 //    4095  =   10000 mv
 // mV = (ADC - 2048) * (10000/2047)
 // mV ~= (ADC - 2048) * 5
+//
+// The pulse_count is published once per second. Which second a sample belongs
+// to is determined by the sample clock (refer to mccdaq_set_sample_clock), by
+// counting the samples scanned and lost from the sample clock's start time; 
+// so each second contains exactly frequency samples, and the published 
+// pulse_counts do not depend on when the consumer thread runs. The 
+// pulse_counts of each device's channels are published in channel order.
 
-int32_t mccdaq_callback(uint16_t * d, int32_t max_d)
+int32_t mccdaq_callback(int32_t dev, uint16_t * d, int32_t max_d)
 {
-    #define MAX_DATA 1000000
+    device_t * dv = &device[dev];
+    det_t    * dv_det;
+    int32_t    lost, c;
 
-    static int16_t       data[MAX_DATA];
-    static int32_t       max_data;
-    static int32_t       idx;
-    static int32_t       baseline;
-    static pulse_count_t pulse_count;
-    static int32_t       total_pulses;
+    if (!dv->initialized) {
+        dv->dev = dev;
+        dv->sample_clock_start = mccdaq_get_sample_clock(dev);
+        det_init(dv);
+        dv->initialized = true;
+    }
+    dv_det = &det[dev * num_chan];
 
-    #define RESET_FOR_NEXT_SEC \
-        do { \
-            max_data = 0; \
-            idx = 0; \
-            memset(&pulse_count,0,sizeof(pulse_count)); \
-            total_pulses = 0; \
-        } while (0)
+    // the samples lost are those that precede d, they are whole frames, and
+    // include those lost by mccdaq (restarts and ring full); the pulse_counts
+    // for the seconds that end before d are published by skip_lost_samples 
+    // and scan
+    lost = mccdaq_get_lost_samples(dev) / num_chan;
+    for (c = 0; c < num_chan; c++) {
+        skip_lost_samples(&dv_det[c], lost);
+    }
+    receive_frames(dv, d, max_d);
 
-    // if max_data too big then 
-    //   print an error 
-    //   reset 
-    // endif
-    if (max_data + max_d > MAX_DATA) {
-        ERROR("max_data %d or max_d %d are too large\n", max_data, max_d);
-        RESET_FOR_NEXT_SEC;
-        return 0;
+    // return 'continue-scanning' 
+    return 0;
+}
+
+// -----------------  RECEIVE DATA  -------------------------------
+
+// the state of each of the device's channels' detector and baseline estimator;
+// and when there are multiple channels, the buffers that the frames are 
+// demultiplexed to
+static void det_init(device_t * dv)
+{
+    int32_t c, gc;
+
+    num_chan = mccdaq_get_num_chan();
+    frequency = CHAN_FREQUENCY(num_chan);
+
+    for (c = 0; c < num_chan; c++) {
+        gc = dv->dev * num_chan + c;
+        det[gc].chan = gc;
+        det[gc].dv = dv;
+        det[gc].bl = &bl[gc];
+        det[gc].pulse_start_pos = -1;
+        det[gc].next_baseline_pos = BASELINE_BLOCK;
+        det[gc].next_publish_pos = frequency;
+        det[gc].shape_hist = &shape_hist[gc];
+        bl[gc].thr[0] = bl[gc].thr[1] = 4096;
+        bl[gc].next_pos = BASELINE_BLOCK;
     }
 
-    // copy caller supplied data to static data buffer
-    memcpy(data+max_data, d, max_d*sizeof(int16_t));
-    max_data += max_d;
+    if (num_chan > 1) {
+        dv->demux_len = (dv->par.nthreads > 1 ? PARALLEL_MAX / num_chan : DEMUX_BLOCK);
+        for (c = 0; c < num_chan; c++) {
+            dv->demux_buff[c] = malloc(dv->demux_len * sizeof(uint16_t));
+            if (dv->demux_buff[c] == NULL) {
+                FATAL("malloc demux_buff failed\n");
+            }
+        }
+    }
+}
 
-    // if we have too little data just return, 
-    // until additional data is received
-    if (max_data < 100) {
-        return 0;
+// the n samples in d are whole frames; when there is 1 channel they are 
+// scanned in place, otherwise they are demultiplexed a block at a time, and
+// each channel's samples of the block are scanned
+static void receive_frames(device_t * dv, uint16_t * d, int32_t n)
+{
+    int32_t frames = n / num_chan, i, m, c;
+    det_t * dv_det = &det[dv->dev * num_chan];
+
+    if (num_chan == 1) {
+        receive_data(&dv_det[0], d, n);
+        return;
+    }
+
+    if (n % num_chan) {
+        WARN("%d samples is not a multiple of num_chan %d\n", n, num_chan);
+    }
+    for (i = 0; i < frames; i += m) {
+        m = (frames - i < dv->demux_len ? frames - i : dv->demux_len);
+        demux(dv, d + (int64_t)i * num_chan, m);
+        for (c = 0; c < num_chan; c++) {
+            receive_data(&dv_det[c], dv->demux_buff[c], m);
+        }
+    }
+}
+
+// copies each channel's samples, of the frames in d, to its demux_buff; the
+// number of channels is a constant in each case of the switch, so that the
+// compiler unrolls the inner loop
+static inline void demux_chan(uint16_t ** buff, uint16_t * d, int32_t frames, const int32_t nc)
+{
+    int32_t i, c;
+
+    for (i = 0; i < frames; i++) {
+        for (c = 0; c < nc; c++) {
+            buff[c][i] = d[i * nc + c];
+        }
+    }
+}
+
+static void demux(device_t * dv, uint16_t * d, int32_t frames)
+{
+    switch (num_chan) {
+    case 2: demux_chan(dv->demux_buff, d, frames, 2); break;
+    case 4: demux_chan(dv->demux_buff, d, frames, 4); break;
+    case 8: demux_chan(dv->demux_buff, d, frames, 8); break;
+    default: demux_chan(dv->demux_buff, d, frames, num_chan); break;
+    }
+}
+
+// scans the channel's samples in place in in; or when a pulse shaping filter is
+// selected, filters the samples and scans the filter's output; when there are 
+// worker threads and enough samples, they share the work
+static void receive_data(det_t * d, uint16_t * in, int32_t n)
+{
+    int16_t * y;
+    int32_t   m;
+
+    while (n > 0) {
+        if (d->dv->par.nthreads > 1 && n >= PARALLEL_MIN) {
+            m = (n < PARALLEL_MAX ? n : PARALLEL_MAX);
+            y = scan_parallel(d, in, m);
+        } else {
+            m = shaper_process(d->chan, in, n, &y);
+            scan(d, y, d->received, m, d->received + m);
+        }
+        d->last_sample = y[m-1];
+        d->received += m;
+        in += m;
+        n -= m;
+    }
+}
+
+// the samples that follow the lost samples are not contiguous with those
+// received; so end the pulse that is in progress, then account for the lost
+// samples in the seconds they span
+static void skip_lost_samples(det_t * d, int32_t lost)
+{
+    int32_t n;
+
+    if (lost <= 0) {
+        return;
+    }
+
+    if (d->pulse_start_pos != -1) {
+        if (!d->pulse_abandoned) {
+            d->pulse_count.busy += d->pulse_len;
+        }
+        d->pulse_start_pos = -1;
+        d->pulse_abandoned = false;
     }
+    shaper_reset(d->chan);
+
+    while (lost > 0) {
+        n = (d->next_publish_pos - d->pos < lost ? d->next_publish_pos - d->pos : lost);
+        d->pulse_count.samples_lost += n;
+        lost -= n;
+        d->pos += n;
+        if (d->pos == d->next_publish_pos) {
+            publish_pulse_count(d, d->dv->sample_clock_start + d->pos / frequency);
+            d->next_publish_pos += frequency;
+        }
+    }
+    d->received = d->pos;
+    d->valid_from = d->pos;
+}
+
+// -----------------  WORKER THREADS  -----------------------------
+
+static void * worker_thread(void * cx)
+{
+    worker_t * w = cx;
+    par_t    * par = w->par;
+    int32_t    phase;
+    int64_t    gen = 0;
+    char       name[16];
+
+    sprintf(name, "worker%d.%d", par->dev, w->k);
+    rt_thread(name, RT_WORKER, par->dev);
 
-    // search for pulses in the data
-    int32_t pulse_start_idx = -1;
-    int32_t pulse_end_idx   = -1;
     while (true) {
-        // terminate this loop when 
-        // - not in-a-pulse and near the end of data OR
-        // - at the end of data
-        if ((pulse_start_idx == -1 && idx >= max_data-20) || 
-            (idx == max_data))
-        {
-            break;
+        // wait for the next phase to be started
+        pthread_mutex_lock(&par->mutex);
+        while (par->gen == gen) {
+            pthread_cond_wait(&par->start_cond, &par->mutex);
+        }
+        gen = par->gen;
+        phase = par->phase;
+        pthread_mutex_unlock(&par->mutex);
+
+        worker_phase(par, w->k, phase);
+
+        // the last worker done signals run_phase
+        pthread_mutex_lock(&par->mutex);
+        if (++par->done == par->nthreads - 1) {
+            pthread_cond_signal(&par->done_cond);
+        }
+        pthread_mutex_unlock(&par->mutex);
+    }
+
+    return NULL;
+}
+
+// runs the phase on each of the workers, and waits for them to be done;
+// the calling thread is worker 0
+static void run_phase(par_t * par, int32_t phase)
+{
+    pthread_mutex_lock(&par->mutex);
+    par->phase = phase;
+    par->done = 0;
+    par->gen++;
+    pthread_cond_broadcast(&par->start_cond);
+    pthread_mutex_unlock(&par->mutex);
+
+    worker_phase(par, 0, phase);
+
+    pthread_mutex_lock(&par->mutex);
+    while (par->done < par->nthreads - 1) {
+        pthread_cond_wait(&par->done_cond, &par->mutex);
+    }
+    pthread_mutex_unlock(&par->mutex);
+}
+
+static void worker_phase(par_t * par, int32_t k, int32_t phase)
+{
+    worker_t * w = &par->w[k];
+    det_t    * d = &w->det;
+    int64_t    a = par->chunk[k], b = par->chunk[k+1], s0, s1;
+    int32_t    j;
+
+    // phase 1: filter the chunk, and add it to the histogram of each baseline
+    // block it overlaps
+    if (phase == 1) {
+        if (shaper_enabled()) {
+            shaper_filter(par->det->chan, par->in, a - par->pos, b - par->pos, par->y);
+        }
+        for (j = 0; j < par->nseg; j++) {
+            memset(w->hist[j], 0, sizeof(w->hist[0]));
+            s0 = (a > par->seg[j] ? a : par->seg[j]);
+            s1 = (b < par->seg[j+1] ? b : par->seg[j+1]);
+            if (s0 < s1) {
+                baseline_accumulate(w->hist[j], par->x, par->pos, s0 - par->pos, s1 - par->pos);
+            }
+        }
+        return;
+    }
+
+    // phase 2: scan the chunk; worker 0 continues from the serial detector's
+    // state, and the other workers start at their sync position, not in a pulse,
+    // and discard the results of the overlap that precedes their chunk
+    if (k >= par->nchunks) {
+        return;
+    }
+    if (k == 0) {
+        det_start(par->det, par->det->pos);
+        scan(par->det, par->x, par->pos, par->len, b);
+        return;
+    }
+
+    d->chan = par->det->chan;
+    d->dv = par->det->dv;
+    d->bl = par->det->bl;
+    d->pulse_start_pos = -1;
+    d->pulse_abandoned = false;
+    d->pos = par->sync[k];
+    d->valid_from = par->det->valid_from;
+    d->next_publish_pos = (a / frequency + 1) * frequency;
+    d->shape_hist = &w->shape_hist;
+    d->w = w;
+    det_start(d, d->pos);
+    scan(d, par->x, par->pos, par->len, a);
+
+    memset(&d->pulse_count, 0, sizeof(pulse_count_t));
+    memset(d->heights, 0, sizeof(d->heights));
+    d->total_pulses = 0;
+    memset(&w->shape_hist, 0, sizeof(shape_hist_t));
+    w->nevents = 0;
+    w->nrecords = 0;
+    scan(d, par->x, par->pos, par->len, b);
+}
+
+// scans the n samples in, which follow d->received, using the worker threads;
+// returns the samples scanned, which are the filter's output when a filter 
+// is selected
+static int16_t * scan_parallel(det_t * d, uint16_t * in, int32_t n)
+{
+    par_t * par = &d->dv->par;
+    bl_t  * b = d->bl;
+    int64_t pos = d->received, p;
+    int32_t i, j, k;
+
+    // the region, and the chunk of each worker
+    par->det = d;
+    par->in = in;
+    par->pos = pos;
+    par->len = n;
+    par->x = (int16_t*)in;
+    if (shaper_enabled()) {
+        shaper_plan(d->chan, in, n);
+        par->x = par->y;
+    }
+    for (k = 0; k <= par->nthreads; k++) {
+        par->chunk[k] = pos + (int64_t)n * k / par->nthreads;
+    }
+    par->nchunks = par->nthreads;
+
+    // the baseline blocks that the region overlaps; the baseline is updated 
+    // at seg[1] to seg[nseg-1], the first may be pending from a gap
+    par->nseg = 0;
+    par->seg[0] = pos;
+    for (p = (b->next_pos > pos ? b->next_pos : pos); 
+         p < pos + n; 
+         p = (p / BASELINE_BLOCK + 1) * BASELINE_BLOCK) 
+    {
+        par->seg[++par->nseg] = p;
+    }
+    par->seg[++par->nseg] = pos + n;
+
+    // phase 1
+    run_phase(par, 1);
+
+    // merge the histograms, and determine the baseline at the end of each
+    // block, in order
+    par->nbl_tab = 0;
+    par->bl_tab[par->nbl_tab++] = (baseline_entry_t){ INT64_MIN, b->baseline, b->confidence };
+    for (j = 0; j < par->nseg; j++) {
+        if (j > 0) {
+            baseline_update(b, par->seg[j]);
+            par->bl_tab[par->nbl_tab++] = (baseline_entry_t){ par->seg[j], b->baseline, b->confidence };
+        }
+        for (k = 0; k < par->nthreads; k++) {
+            for (i = 0; i < 4096; i++) {
+                b->hist[b->cur][i] += par->w[k].hist[j][i];
+            }
+        }
+    }
+
+    // the position at which each worker starts scanning; if there is none
+    // then the chunk is merged with the prior chunk
+    for (k = 1; k < par->nchunks; ) {
+        par->sync[k] = find_sync(par, par->chunk[k]);
+        if (par->sync[k] == -1) {
+            memmove(&par->chunk[k], &par->chunk[k+1], (par->nchunks - k) * sizeof(int64_t));
+            par->nchunks--;
+        } else {
+            k++;
+        }
+    }
+
+    // phase 2
+    run_phase(par, 2);
+
+    // merge the results of the workers, in order; and the detector continues
+    // from the state of the last worker
+    for (k = 1; k < par->nchunks; k++) {
+        merge_worker(d, &par->w[k]);
+    }
+    if (par->nchunks > 1) {
+        det_t * last = &par->w[par->nchunks-1].det;
+        d->pulse_start_pos  = last->pulse_start_pos;
+        d->pulse_abandoned  = last->pulse_abandoned;
+        d->pulse_height     = last->pulse_height;
+        d->pulse_area       = last->pulse_area;
+        d->pulse_len        = last->pulse_len;
+        memcpy(d->pulse_v, last->pulse_v, sizeof(d->pulse_v));
+        d->pos              = last->pos;
+        d->next_publish_pos = last->next_publish_pos;
+    }
+    d->bl_tab = NULL;
+    d->baseline = b->baseline;
+    d->confidence = b->confidence;
+    d->next_baseline_pos = b->next_pos;
+
+    return par->x;
+}
+
+// publishes the pulse_counts kept by the worker, and adds its pulse_count,
+// list mode events and shape histogram to the serial detector's, d
+static void merge_worker(det_t * d, worker_t * w)
+{
+    listmode_event_t * ev;
+    record_t * r;
+    int32_t i, j;
+
+    for (i = 0; i < w->nrecords; i++) {
+        r = &w->records[i];
+        pulse_count_add(&d->pulse_count, &r->pulse_count);
+        heights_add(d->heights, r->heights);
+        d->total_pulses += r->total_pulses;
+        d->baseline = r->baseline;
+        d->confidence = r->confidence;
+        publish_pulse_count(d, r->time);
+    }
+    pulse_count_add(&d->pulse_count, &w->det.pulse_count);
+    heights_add(d->heights, w->det.heights);
+    d->total_pulses += w->det.total_pulses;
+
+    for (i = 0; i < w->nevents; i++) {
+        ev = &w->events[i];
+        listmode_add(ev->chan, ev->pos, ev->height, ev->width, ev->area, ev->rise, ev->fwhm, ev->flags);
+    }
+
+    for (i = 0; i < MAX_BUCKET; i++) {
+        for (j = 0; j < MAX_SHAPE_BUCKET; j++) {
+            d->shape_hist->count[i][j] += w->shape_hist.count[i][j];
+        }
+    }
+}
+
+// returns the position following the last sample preceding pos, in the region,
+// that is below the pulse threshold, so that the detector is not in a pulse; 
+// or -1 if there is none
+static int64_t find_sync(par_t * par, int64_t pos)
+{
+    int32_t e = par->nbl_tab - 1, v, baseline;
+    int64_t p;
+
+    for (p = pos - 1; p >= par->pos; p--) {
+        while (par->bl_tab[e].pos > p) {
+            e--;
+        }
+        baseline = par->bl_tab[e].baseline;
+        v = par->x[p - par->pos];
+        if (v > 4095) {
+            v = 2048;
+        }
+        if (baseline == 0 || v < baseline + discrim.threshold) {
+            return p + 1;
+        }
+    }
+    return -1;
+}
+
+// the detector is to scan from pos, using the baselines determined in phase 1
+static void det_start(det_t * d, int64_t pos)
+{
+    par_t * par = &d->dv->par;
+    int32_t i;
+
+    for (i = par->nbl_tab - 1; par->bl_tab[i].pos > pos; i--) {
+        ;
+    }
+    d->bl_tab = par->bl_tab;
+    d->bl_idx = i;
+    baseline_next(d);
+}
+
+// -----------------  SCAN FOR PULSES  ----------------------------
+
+// scans the samples from d->pos to end_pos; x contains x_len samples starting 
+// at position x_pos; the baseline is updated at the end of each baseline block,
+// and the pulse_count is published at the end of each second
+static void scan(det_t * d, int16_t * x, int64_t x_pos, int32_t x_len, int64_t end_pos)
+{
+    int64_t seg_end_pos;
+
+    while (d->pos < end_pos) {
+        if (d->pos >= d->next_baseline_pos) {
+            baseline_next(d);
+        }
+
+        seg_end_pos = (end_pos < d->next_baseline_pos ? end_pos : d->next_baseline_pos);
+        if (d->next_publish_pos < seg_end_pos) {
+            seg_end_pos = d->next_publish_pos;
+        }
+        scan_segment(d, x, x_pos, x_len, seg_end_pos);
+
+        if (d->pos == d->next_publish_pos) {
+            publish_pulse_count(d, d->dv->sample_clock_start + d->pos / frequency);
+            d->next_publish_pos += frequency;
+        }
+    }
+}
+
+static void scan_segment(det_t * d, int16_t * x, int64_t x_pos, int32_t x_len, int64_t end_pos)
+{
+    int32_t k, k_end, v, baseline = d->baseline;
+
+    k = d->pos - x_pos;
+    k_end = end_pos - x_pos;
+    d->pulse_count.samples += k_end - k;
+    d->pos = end_pos;
+
+    // add the samples to the baseline estimator's histogram, unless that was
+    // done in phase 1; and if the baseline has not yet been determined then
+    // pulses can't be detected
+    if (d->bl_tab == NULL) {
+        baseline_accumulate(d->bl->hist[d->bl->cur], x, x_pos, k, k_end);
+    }
+    if (baseline == 0) {
+        return;
+    }
+
+    while (k < k_end) {
+        // when not in-a-pulse, skip the data that is below the pulse threshold
+        if (d->pulse_start_pos == -1) {
+            k = skip_baseline(x, k, k_end, baseline);
+            if (k == k_end) {
+                break;
+            }
         }
 
         // print warning if data out of range
-        if (data[idx] > 4095) {
-            WARN("data[%d] = %u, is out of range\n", idx, data[idx]);
-            data[idx] = 2048;
-        }
-
-        // update baseline ...
-        // if data[idx] is close to baseline then
-        //   baseline is okay
-        // else if data[idx+10] is close to baseline then
-        //   baseline is okay
-        // else if data[idx] and the preceding 3 data values are almost the same then
-        //   set baseline to data[idx]
+        v = x[k];
+        if (v > 4095) {
+            WARN("data at position %lld = %d, is out of range\n", (long long)(x_pos + k), v);
+            v = 2048;
+        }
+
+        // if not in-a-pulse then
+        //   a pulse starts when v is at least the threshold above baseline
+        // else if v is below the threshold then 
+        //   the pulse has ended, with the prior sample
+        // else if the pulse was abandoned then
+        //   the sample is busy, until the pulse ends
+        // else if the pulse is too long then
+        //   abandon it, and wait for it to end
+        // else
+        //   track the pulse's height
         // endif
-        if (pulse_start_idx == -1) {
-            if (data[idx] >= baseline-1 && data[idx] <= baseline+1) {
-                ;  // okay
-            } else if (idx+10 < max_data && data[idx+10] >= baseline-1 && data[idx+10] <= baseline+1) {
-                ;  // okay
-            } else if ((idx >= 3) &&
-                       (data[idx-1] >= data[idx]-1 && data[idx-1] <= data[idx]+1) &&
-                       (data[idx-2] >= data[idx]-1 && data[idx-2] <= data[idx]+1) &&
-                       (data[idx-3] >= data[idx]-1 && data[idx-3] <= data[idx]+1))
-            {
-                baseline = data[idx];
-            }
-        }
-
-        // if baseline has not yet determined then continue
-        if (baseline == 0) {
-            idx++;
-            continue;
-        }
-
-        // determine the pulse_start_idx and pulse_end_idx
-        if (data[idx] >= (baseline + MIN_PULSE_HEIGHT) && pulse_start_idx == -1) {
-            pulse_start_idx = idx;
-        } else if (pulse_start_idx != -1) {
-            if (data[idx] < (baseline + MIN_PULSE_HEIGHT)) {
-                pulse_end_idx = idx - 1;
-            } else if (idx - pulse_start_idx >= 10) {
-                WARN("discarding a possible pulse because it's too long, pulse_start_idx=%d\n",
-                     pulse_start_idx);
-                pulse_start_idx = -1;
-                pulse_end_idx = -1;
-            }
-        }
-
-        // if a pulse has been located ...
-        if (pulse_end_idx != -1) {
-            // determine pulse_height
-            int32_t i, pulse_height=-1;
-            for (i = pulse_start_idx; i <= pulse_end_idx; i++) {
-                if (data[i] - baseline > pulse_height) {
-                    pulse_height = data[i] - baseline;
-                }
+        if (d->pulse_start_pos == -1) {
+            if (v >= baseline + discrim.threshold) {
+                d->pulse_start_pos = x_pos + k;
+                d->pulse_height = v - baseline;
+                d->pulse_area = v - baseline;
+                d->pulse_v[0] = (x_pos + k - 1 < d->valid_from ? 0 :
+                                  (k > 0 ? x[k-1] : d->last_sample) - baseline);
+                d->pulse_v[1] = v - baseline;
+                d->pulse_len = 1;
             }
-            assert(pulse_height >= MIN_PULSE_HEIGHT);
-
-            // increment pulse_count histogram bucket
-            int bidx = PULSE_HEIGHT_TO_BUCKET_IDX(pulse_height);
-            pulse_count.bucket[bidx]++;
-            total_pulses++;
-
-            // if verbose logging is enabled and not more frequently than 
-            // once per second, print this pulse to the log file
-            if (verbose[1]) {
-                uint64_t time_now = microsec_timer();
-                static uint64_t time_last_pulse_print;
-                if (time_now > time_last_pulse_print + 1000000) {
-                    verbose_pulse_print(pulse_start_idx, pulse_end_idx, pulse_height, baseline, data, max_data);
-                    time_last_pulse_print = time_now;
-                }
+        } else if (v < baseline + discrim.threshold) {
+            if (!d->pulse_abandoned) {
+                d->pulse_v[d->pulse_len+1] = v - baseline;
+                pulse_found(d, x, x_pos, x_len, k - 1);
+            }
+            d->pulse_start_pos = -1;
+            d->pulse_abandoned = false;
+        } else if (d->pulse_abandoned) {
+            d->pulse_count.busy++;
+        } else if (d->pulse_len == MAX_PULSE_LEN) {
+            VERBOSE1("abandoning a possible pulse because it's too long, pulse_start_pos=%lld\n",
+                     (long long)d->pulse_start_pos);
+            d->pulse_count.rejected++;
+            d->pulse_count.busy += d->pulse_len + 1;
+            d->pulse_abandoned = true;
+        } else {
+            d->pulse_area += v - baseline;
+            d->pulse_v[++d->pulse_len] = v - baseline;
+            if (v - baseline > d->pulse_height) {
+                d->pulse_height = v - baseline;
             }
-
-            // done with this pulse
-            pulse_start_idx = -1;
-            pulse_end_idx = -1;
         }
 
         // move to next data 
-        idx++;
+        k++;
     }
+}
+
+// the pulse that started at d->pulse_start_pos has ended at x[end_k];
+// if it is piled up then discriminate each of the pulses, otherwise 
+// determine its shape; and count the pulses that pass the discrimination
+static void pulse_found(det_t * d, int16_t * x, int64_t x_pos, int32_t x_len, int32_t end_k)
+{
+    int16_t * v = d->pulse_v;
+    int32_t   h = d->pulse_height;
+    int32_t   sub_start[MAX_PULSE_LEN+1], sub_height[MAX_PULSE_LEN];
+    int16_t   sub_v[MAX_PULSE_LEN+2];
+    int32_t   rise, fwhm, bidx, sidx, nsub, naccepted, dead, base, len, i, j;
+    bool      accepted;
 
-    // once per second do the following ...
-    uint64_t time_now = time(NULL);
-    static uint64_t time_last_published;
-    if (time_now > time_last_published) {    
-        int32_t mccdaq_restart_count;
+    assert(h >= discrim.threshold);
 
-        // publish the pulse_count histogram for this one second interval
-        publish(time_now, &pulse_count);
-        time_last_published = time_now;
+    // if the pulse has multiple maxima then it is piled up; each of the
+    // pulses is v[sub_start[i]..sub_start[i+1]-1], and those that follow 
+    // the first rise from a dip, which is subtracted; each is discriminated 
+    // like a pulse that is not piled up, and those that pass are counted
+    nsub = split_pileup(v, d->pulse_len, sub_start, sub_height, &dead);
+    d->pulse_count.busy += dead;
+    if (nsub > 1) {
+        naccepted = 0;
+        for (i = 0; i < nsub; i++) {
+            base = (i == 0 ? 0 : v[sub_start[i]]);
+            len = sub_start[i+1] - sub_start[i];
+            for (j = 0; j <= len + 1; j++) {
+                sub_v[j] = v[sub_start[i] - 1 + j] - base;
+            }
+            pulse_shape(sub_v, len, sub_height[i], &rise, &fwhm);
+            accepted = discrim_accept(len, rise, fwhm);
+            if (accepted) {
+                d->pulse_count.bucket[PULSE_HEIGHT_TO_BUCKET_IDX(sub_height[i])]++;
+                d->heights[sub_height[i] < MCA_MAX_BINS ? sub_height[i] : MCA_MAX_BINS-1]++;
+                naccepted++;
+            } else {
+                d->pulse_count.rejected++;
+            }
+            event_add(d, d->pulse_start_pos + sub_start[i] - 1, sub_height[i], len, 0, rise, fwhm,
+                         (accepted ? LISTMODE_ACCEPTED : 0) | LISTMODE_PILEUP);
+        }
+        d->total_pulses += naccepted;
+        d->pulse_count.piled_up += naccepted;
+    } else {
+        // determine the pulse's rise time and fwhm
+        pulse_shape(v, d->pulse_len, h, &rise, &fwhm);
 
-        // check for conditions that warrant a warning message to be logged
-        mccdaq_restart_count = mccdaq_get_restart_count();
-        if (mccdaq_restart_count > 1 ||
-            max_data < 480000 || max_data > 520000 ||
-            baseline < 2350 || baseline > 2420)
-        {
-            WARN("mccdaq_restart_count=%d max_data=%d baseline=%d\n",
-                  mccdaq_restart_count, max_data, baseline);
+        // accumulate the histogram of height and shape, of all pulses
+        // that are not piled up
+        bidx = PULSE_HEIGHT_TO_BUCKET_IDX(h);
+        sidx = fwhm / SHAPE_BUCKET_SIZE;
+        if (sidx >= MAX_SHAPE_BUCKET) {
+            sidx = MAX_SHAPE_BUCKET - 1;
         }
+        d->shape_hist->count[bidx][sidx]++;
 
-        // verbose logging
-        VERBOSE0("ADC samples=%d restarts=%d baseline=%d total_pulses=%d\n",
-                 max_data, mccdaq_restart_count, baseline, total_pulses);
+        // if the pulse passes the discrimination then increment the pulse_count
+        // histogram bucket, otherwise count it as rejected
+        accepted = discrim_accept(d->pulse_len, rise, fwhm);
+        if (accepted) {
+            d->pulse_count.bucket[bidx]++;
+            d->heights[h < MCA_MAX_BINS ? h : MCA_MAX_BINS-1]++;
+            d->total_pulses++;
+        } else {
+            d->pulse_count.rejected++;
+        }
 
-        // reset variables for the next second 
-        RESET_FOR_NEXT_SEC;
+        // add to the list mode file, when enabled
+        event_add(d, d->pulse_start_pos, h, d->pulse_len, d->pulse_area, rise, fwhm,
+                     accepted ? LISTMODE_ACCEPTED : 0);
     }
 
-    // return 'continue-scanning' 
-    return 0;
+    // if verbose logging is enabled and not more frequently than 
+    // once per second, print this pulse to the log file; the start of
+    // the pulse may precede x, in which case it is not printed; the
+    // pulses found by the worker threads are not printed
+    if (verbose[1] && d->w == NULL) {
+        uint64_t time_now = microsec_timer();
+        static uint64_t time_last_pulse_print;
+        if (time_now > time_last_pulse_print + 1000000) {
+            int32_t start_k = d->pulse_start_pos - x_pos;
+            if (nsub > 1) {
+                VERBOSE1("PULSE:  piled up, %d pulses   %d accepted   area = %d\n",
+                         nsub, naccepted, d->pulse_area);
+            } else {
+                VERBOSE1("PULSE:  rise = %.2f   fwhm = %.2f   area = %d   %s\n",
+                         rise / 16., fwhm / 16., d->pulse_area, accepted ? "accepted" : "rejected");
+            }
+            verbose_pulse_print(start_k < 0 ? 0 : start_k, end_k, h, d->baseline, x, x_len);
+            time_last_pulse_print = time_now;
+        }
+    }
+}
+
+// determines whether the pulse in v[1..len] is piled up; a pulse starts each
+// time the heights dip at least PILEUP_DIP below the maximum and then rise at 
+// least the threshold above the minimum of the dip. Returns the number of 
+// pulses; the start of each, in v, is returned in sub_start, followed by len+1;
+// and the height of each in sub_height. The height of the pulses that follow 
+// the first are measured from the dip, which approximately subtracts the tail
+// of the preceding pulse. The samples during which another pulse would not be
+// separated, from the start of each pulse through its maximum, are returned
+// in dead.
+static int32_t split_pileup(int16_t * v, int32_t len, int32_t * sub_start, int32_t * sub_height,
+                            int32_t * dead)
+{
+    int32_t i, nsub = 0, peak = 1, valley = 0, base = 0;
+    bool    falling = false;
+
+    sub_start[0] = 1;
+    *dead = 0;
+    for (i = 2; i <= len; i++) {
+        if (!falling) {
+            if (v[i] > v[peak]) {
+                peak = i;
+            } else if (v[peak] - v[i] >= PILEUP_DIP) {
+                falling = true;
+                valley = i;
+            }
+        } else {
+            if (v[i] < v[valley]) {
+                valley = i;
+            } else if (v[i] - v[valley] >= discrim.threshold) {
+                sub_height[nsub] = v[peak] - base;
+                *dead += peak + 1 - sub_start[nsub];
+                sub_start[++nsub] = valley;
+                base = v[valley];
+                peak = i;
+                falling = false;
+            }
+        }
+    }
+    sub_height[nsub] = v[peak] - base;
+    *dead += peak + 1 - sub_start[nsub];
+    sub_start[++nsub] = len + 1;
+
+    return nsub;
+}
+
+// determines the shape of the pulse in v[1..len], of height h, where v[0] and
+// v[len+1] are the samples preceding and following the pulse; in units of 1/16
+// sample, the rise time is from the leading edge crossing 10% to crossing 90% 
+// of the height, and the fwhm is from the leading edge crossing 50% to the 
+// trailing edge crossing 50%
+static void pulse_shape(int16_t * v, int32_t len, int32_t h, int32_t * rise, int32_t * fwhm)
+{
+    int32_t peak, i;
+
+    // locate the peak, in v[1..len]
+    for (peak = 1; v[peak] != h; peak++) {
+        ;
+    }
+
+    *rise = crossing(v, peak, (h * 9 + 5) / 10) - crossing(v, peak, (h + 5) / 10);
+    for (i = peak; i < len+1 && v[i+1] >= (h + 1) / 2; i++) {
+        ;
+    }
+    if (i == len+1) {
+        *fwhm = i * 16;
+    } else {
+        *fwhm = i * 16 + 16 * (v[i] - (h + 1) / 2) / (v[i] - v[i+1]);
+    }
+    *fwhm -= crossing(v, peak, (h + 1) / 2);
+}
+
+// returns whether a pulse of the given width, in samples, and rise time and 
+// fwhm, in 1/16 samples, passes the discrimination
+static bool discrim_accept(int32_t width, int32_t rise, int32_t fwhm)
+{
+    return width <= discrim.max_width &&
+           rise >= discrim.min_rise && rise <= discrim.max_rise &&
+           fwhm >= discrim.min_fwhm && fwhm <= discrim.max_fwhm;
+}
+
+// returns the time, in 1/16 samples, at which the leading edge of the pulse
+// in v crosses level; v[peak] is at or above level
+static int32_t crossing(int16_t * v, int32_t peak, int32_t level)
+{
+    int32_t i;
+
+    for (i = peak; i > 0 && v[i-1] >= level; i--) {
+        ;
+    }
+    if (i == 0) {
+        return 0;
+    }
+    return (i - 1) * 16 + 16 * (level - v[i-1]) / (v[i] - v[i-1]);
+}
+
+// adds the pulse to the list mode file; or when found by a worker thread, 
+// keeps it, to be added in order when the workers are done
+static void event_add(det_t * d, uint64_t pos, int32_t height, int32_t width, int32_t area,
+                      int32_t rise, int32_t fwhm, int32_t flags)
+{
+    worker_t * w = d->w;
+    listmode_event_t * ev;
+
+    if (w == NULL) {
+        listmode_add(d->chan, pos, height, width, area, rise, fwhm, flags);
+        return;
+    }
+
+    if (w->nevents == w->max_events) {
+        w->max_events = (w->max_events ? 2 * w->max_events : 4096);
+        w->events = realloc(w->events, w->max_events * sizeof(listmode_event_t));
+        if (w->events == NULL) {
+            FATAL("realloc events failed\n");
+        }
+    }
+    ev = &w->events[w->nevents++];
+    ev->pos    = pos;
+    ev->height = height;
+    ev->width  = width;
+    ev->area   = area;
+    ev->rise   = rise;
+    ev->fwhm   = fwhm;
+    ev->flags  = flags;
+    ev->chan   = d->chan;
+}
+
+// -----------------  SKIP BASELINE  ------------------------------
+
+// returns the index of the first data, starting at idx, that is at or above
+// the pulse threshold, and so might start a pulse; or end if there is none.
+// Nearly all of the data is skipped, so this is vectorized when the compiler 
+// targets SSE2, AVX2 or NEON.
+static int32_t skip_baseline(int16_t * data, int32_t idx, int32_t end, int32_t baseline)
+{
+    int16_t thr = baseline + discrim.threshold;
+
+#if defined(__AVX2__)
+    __m256i vthr = _mm256_set1_epi16(thr-1);
+    for (; idx + 16 <= end; idx += 16) {
+        __m256i v = _mm256_loadu_si256((__m256i*)(data + idx));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpgt_epi16(v, vthr));
+        if (mask) {
+            return idx + __builtin_ctz(mask) / 2;
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i vthr = _mm_set1_epi16(thr-1);
+    for (; idx + 8 <= end; idx += 8) {
+        __m128i v = _mm_loadu_si128((__m128i*)(data + idx));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpgt_epi16(v, vthr));
+        if (mask) {
+            return idx + __builtin_ctz(mask) / 2;
+        }
+    }
+#elif defined(__ARM_NEON)
+    int16x8_t vthr = vdupq_n_s16(thr);
+    for (; idx + 8 <= end; idx += 8) {
+        uint16x8_t ge   = vcgeq_s16(vld1q_s16(data + idx), vthr);
+        uint64x2_t ge64 = vreinterpretq_u64_u16(ge);
+        if ((vgetq_lane_u64(ge64, 0) | vgetq_lane_u64(ge64, 1)) != 0) {
+            break;  // the scalar loop below locates it
+        }
+    }
+#endif
+
+    for (; idx < end && data[idx] < thr; idx++) {
+        ;
+    }
+    return idx;
+}
+
+// -----------------  BASELINE ESTIMATOR  -------------------------
+
+// adds the samples x[k] to x[k_end-1], whose position is a multiple of 
+// BASELINE_STRIDE, to hist; the samples at or above the pulse threshold are
+// excluded when the baseline is determined, so that the histograms of the
+// blocks can be accumulated before the baseline is known
+static void baseline_accumulate(uint32_t * hist, int16_t * x, int64_t x_pos, int32_t k, int32_t k_end)
+{
+    uint16_t v;
+
+    for (k += (BASELINE_STRIDE - (x_pos + k) % BASELINE_STRIDE) % BASELINE_STRIDE; 
+         k < k_end; 
+         k += BASELINE_STRIDE) 
+    {
+        v = x[k];
+        if (v < 4096) {
+            hist[v]++;
+        }
+    }
+}
+
+// at the end of each block, at pos, determine the baseline from the histogram
+// of the current and prior block, excluding the samples that were at or above
+// the pulse threshold: the mode, refined by the mean of the 5 values centered 
+// on the mode; and start the next block. If the baseline has risen by the 
+// threshold or more then nearly all of the samples are excluded, and the 
+// baseline would not move again; so when fewer than BASELINE_MIN remain, the
+// mode of all of the samples is used.
+static void baseline_update(bl_t * b, int64_t pos)
+{
+    uint32_t * cur = b->hist[b->cur], * prior = b->hist[!b->cur];
+    int32_t    cur_thr = b->thr[b->cur], prior_thr = b->thr[!b->cur];
+    uint64_t   total, n = 0, sum = 0, max;
+    int32_t    i, mode;
+
+    #define COUNT(i) ((i < cur_thr ? cur[i] : 0) + (i < prior_thr ? prior[i] : 0))
+
+    while (true) {
+        total = max = 0;
+        mode = 0;
+        for (i = 0; i < 4096; i++) {
+            uint32_t c = COUNT(i);
+            total += c;
+            if (c > max) {
+                max = c;
+                mode = i;
+            }
+        }
+        if (total >= BASELINE_MIN || (cur_thr == 4096 && prior_thr == 4096)) {
+            break;
+        }
+        cur_thr = prior_thr = 4096;
+    }
+
+    if (total >= BASELINE_MIN) {
+        for (i = (mode >= 2 ? mode-2 : 0); i <= mode+2 && i < 4096; i++) {
+            n += COUNT(i);
+            sum += (uint64_t)i * COUNT(i);
+        }
+        b->baseline = (sum + n / 2) / n;
+        b->confidence = (double)n / total;
+    }
+
+    b->cur = !b->cur;
+    memset(b->hist[b->cur], 0, sizeof(b->hist[0]));
+    b->thr[b->cur] = (b->baseline == 0 || b->baseline + discrim.threshold > 4096 ? 
+                      4096 : b->baseline + discrim.threshold);
+    b->next_pos = (pos / BASELINE_BLOCK + 1) * BASELINE_BLOCK;
+}
+
+// the detector has reached d->next_baseline_pos; when scanning serially the
+// baseline is updated, otherwise the baseline was determined in phase 1
+static void baseline_next(det_t * d)
+{
+    baseline_entry_t * e;
+
+    if (d->bl_tab == NULL) {
+        baseline_update(d->bl, d->pos);
+        d->baseline = d->bl->baseline;
+        d->confidence = d->bl->confidence;
+        d->next_baseline_pos = d->bl->next_pos;
+        return;
+    }
+
+    e = &d->bl_tab[d->bl_idx++];
+    d->baseline = e->baseline;
+    d->confidence = e->confidence;
+    d->next_baseline_pos = (d->bl_idx < d->dv->par.nbl_tab ? d->bl_tab[d->bl_idx].pos : INT64_MAX);
+}
+
+// -----------------  PUBLISH PULSE COUNT  ------------------------
+
+static void publish_pulse_count(det_t * d, time_t time_now)
+{
+    device_t * dv = d->dv;
+    pulse_count_t * pc = &d->pulse_count;
+    int32_t baseline = d->baseline;
+
+    // a worker thread keeps the pulse_count, to be published in order when 
+    // the workers are done
+    if (d->w != NULL) {
+        record_t * r = &d->w->records[d->w->nrecords++];
+        r->pulse_count = *pc;
+        memcpy(r->heights, d->heights, sizeof(r->heights));
+        memset(d->heights, 0, sizeof(d->heights));
+        r->total_pulses = d->total_pulses;
+        r->time = time_now;
+        r->baseline = d->baseline;
+        r->confidence = d->confidence;
+        memset(pc, 0, sizeof(pulse_count_t));
+        d->total_pulses = 0;
+        return;
+    }
+
+    // publish the pulse_count histogram for this one second interval, and
+    // copy the shape histogram for pulse_get_shape_hist
+    publish(d->chan, time_now, pc, d->heights);
+    pthread_mutex_lock(&shape_hist_mutex);
+    shape_hist_copy[d->chan] = *d->shape_hist;
+    pthread_mutex_unlock(&shape_hist_mutex);
+
+    // check for conditions that warrant a warning message to be logged; the
+    // mccdaq counts are of all of the device's channels, and are read with the
+    // device's first channel
+    if (d->chan % num_chan == 0) {
+        dv->mccdaq_restart_count = mccdaq_get_restart_count(dv->dev);
+        dv->ring_high_water = mccdaq_get_ring_high_water(dv->dev);
+        mccdaq_get_jitter(dv->dev, &dv->gap_max_us, &dv->wakeup_max_us);
+    }
+    if (dv->mccdaq_restart_count > 1 || pc->samples_lost > 1000 / num_chan ||
+        pc->samples < frequency - frequency / 25 || pc->samples > frequency + frequency / 25 ||
+        baseline < 2350 || baseline > 2420)
+    {
+        WARN("chan=%d mccdaq_restart_count=%d samples=%d samples_lost=%d baseline=%d gap_max=%dus\n",
+              d->chan, dv->mccdaq_restart_count, pc->samples, pc->samples_lost, baseline, dv->gap_max_us);
+    }
+
+    // verbose logging
+    VERBOSE0("chan=%d ADC samples=%d lost=%d restarts=%d ring_hwm=%d gap_max=%dus wake_max=%dus "
+             "baseline=%d conf=%.2f total_pulses=%d rejected=%d piled_up=%d busy=%d\n",
+             d->chan, pc->samples, pc->samples_lost, dv->mccdaq_restart_count, 
+             dv->ring_high_water, dv->gap_max_us, dv->wakeup_max_us, baseline, 
+             d->confidence, d->total_pulses, pc->rejected, pc->piled_up, pc->busy);
+
+    // reset variables for the next second 
+    memset(pc, 0, sizeof(pulse_count_t));
+    memset(d->heights, 0, sizeof(d->heights));
+    d->total_pulses = 0;
+}
+
+// adds each of the counts in add to pc
+static void pulse_count_add(pulse_count_t * pc, pulse_count_t * add)
+{
+    int32_t i;
+
+    for (i = 0; i < MAX_BUCKET; i++) {
+        pc->bucket[i] += add->bucket[i];
+    }
+    pc->samples      += add->samples;
+    pc->samples_lost += add->samples_lost;
+    pc->rejected     += add->rejected;
+    pc->busy         += add->busy;
+    pc->piled_up     += add->piled_up;
+}
+
+// adds the histogram of pulse heights add to heights
+static void heights_add(uint32_t * heights, uint32_t * add)
+{
+    int32_t i;
+
+    for (i = 0; i < MCA_MAX_BINS; i++) {
+        heights[i] += add[i];
+    }
 }
 
 // -----------------  VERBOSE PRINT PULSE  ------------------------
@@ -0,0 +1,836 @@
+#include <common.h>
+
+// This file contains the sources of ADC samples that do not require the
+// MCC-USB-204 device. These are selected using mccdaq_init's source_spec,
+// see the neutron -s option:
+// - sim:   simulation of the detector pulses, as sampled by the ADC device
+// - file:  replay of a capture file, or a file of raw ADC samples
+// - synth: synthetic samples at a selectable rate, which may be much greater
+//          than the ADC's sample rate; used to load test the pulse detection
+//
+// Each source's routines are passed the device number (refer to util_mccdaq.c).
+// The sim and file sources can be used by only one device; the synth source
+// can be used by each of the devices.
+
+//
+// defines
+//
+
+#define BLOCK_SAMPLES  8192   // max samples added to the ring per iteration
+
+//
+// prototypes
+//
+
+static int32_t sim_init(int32_t dev, char * args);
+static void sim_run(int32_t dev);
+static void sim_exit(int32_t dev);
+static int32_t file_init(int32_t dev, char * args);
+static void file_run(int32_t dev);
+static void file_exit(int32_t dev);
+static int32_t synth_init(int32_t dev, char * args);
+static void synth_run(int32_t dev);
+
+static void pace(uint64_t start_us, uint64_t samples, int32_t rate);
+static uint16_t * wait_ring_space(int32_t dev, int32_t * max_samples);
+
+//
+// sources
+//
+
+mccdaq_source_t mccdaq_source_sim   = { "sim",   sim_init,   sim_run,   sim_exit  };
+mccdaq_source_t mccdaq_source_file  = { "file",  file_init,  file_run,  file_exit };
+mccdaq_source_t mccdaq_source_synth = { "synth", synth_init, synth_run, NULL      };
+
+// -----------------  SIM SOURCE  ---------------------------------------
+
+// simulation of the He-3 detector and Ludlum amplifier output, as sampled by
+// the MCCDAQ ADC device; args are a comma separated list of:
+// - rate=<cps>          neutron pulse rate, poisson arrivals; default 100
+// - peak=<adc units>    height of the He-3 full-energy peak; default 300
+// - res=<percent>       full-energy peak std deviation, percent of peak; default 5
+// - wall=<fraction>     fraction of neutron pulses in the wall-effect continuum,
+//                       which extends from 0.25*peak to peak; default 0.3
+// - gamma_rate=<cps>    gamma pulse rate; default 0
+// - gamma_mean=<adc>    gamma pulse mean height, exponential distribution; default 30
+// - tau=<samples>       pulse decay time constant; default 1.0
+// - baseline=<adc>      default 2385
+// - noise=<adc>         gaussian noise std deviation; default 1.0
+// - drift=<adc>         baseline drift amplitude, sinusoidal; default 0
+// - drift_period=<secs> default 60
+// - emi_rate=<per sec>  rate of EMI bursts, which are damped oscillations; default 0
+// - emi_amp=<adc>       EMI burst amplitude; default 100
+// - seed=<n>            random number seed, for repeatable runs; default 1
+// - lose=<secs>         every <secs> seconds a block of samples is lost, like a
+//                       usb restart; to check that losses are counted in place,
+//                       see the README's capture replay check; default 0, none
+// - fast                generate samples as fast as they are consumed, rather
+//                       than at the ADC's sample rate
+// - truth=<filename>    ground-truth file, default sim_truth_yyyy-mm-dd_hh-mm-ss.dat
+//
+// The ground-truth file contains, for each second of simulated samples, the 
+// histogram of the heights of the pulses that were simulated. It has the same 
+// format as the neutron .dat file, and can be displayed using playback mode; 
+// and so compared with the .dat file produced from the simulated samples.
+//
+// When there are multiple channels (refer to mccdaq_get_num_chan) each channel
+// is simulated independently, with the same args, and the channels' samples are
+// interleaved in the ring.
+
+#define SIM_TAIL       128     // samples, max length of a pulse or EMI burst
+#define SIM_GAUSS_TBL  65536
+#define SIM_TWO_PI     6.283185307179586
+
+static double        sim_rate;
+static double        sim_peak;
+static double        sim_res;
+static double        sim_wall;
+static double        sim_gamma_rate;
+static double        sim_gamma_mean;
+static double        sim_tau;
+static double        sim_baseline;
+static double        sim_noise;
+static double        sim_drift;
+static double        sim_drift_period;
+static double        sim_emi_rate;
+static double        sim_emi_amp;
+static double        sim_lose;
+static uint64_t      sim_seed;
+static bool          sim_fast;
+
+static float         sim_gauss[SIM_GAUSS_TBL];
+static int32_t       sim_num_chan;
+static int32_t       sim_frequency;     // samples per second, of each channel
+static float         sim_acc[MAX_CHAN][BLOCK_SAMPLES+SIM_TAIL];
+static int           sim_truth_fd = -1;
+static pulse_count_t sim_truth[MAX_CHAN];
+static uint64_t      sim_truth_sec[MAX_CHAN];
+static uint64_t      sim_truth_samples;             // samples simulated, of each channel
+static uint64_t      sim_truth_total[MAX_BUCKET];   // of all channels
+
+static uint64_t sim_random(void);
+static double sim_uniform(void);
+static double sim_exponential(double mean);
+static void sim_add_pulse(float * acc, double pos, double height, double tau);
+static void sim_add_emi(float * acc, double pos);
+static void sim_truth_add(int32_t c, uint64_t pos, double height);
+static void sim_truth_flush(int32_t c, uint64_t pos);
+static void sim_truth_write(int32_t c, int32_t samples);
+
+static int32_t sim_init(int32_t dev, char * args)
+{
+    char     value[200], truth_filename[200], s[100];
+    int32_t  i, rc;
+    file_hdr_t file_hdr;
+
+    // the sim source can be used by only one device
+    if (sim_truth_fd >= 0) {
+        ERROR("the sim source is already in use\n");
+        return -1;
+    }
+
+    #define SIM_ARG(name, var, dflt) \
+        do { \
+            var = dflt; \
+            if (getarg(args, name, value, sizeof(value))) { \
+                var = atof(value); \
+            } \
+        } while (0)
+
+    // get the args
+    SIM_ARG("rate",         sim_rate,         100);
+    SIM_ARG("peak",         sim_peak,         300);
+    SIM_ARG("res",          sim_res,          5);
+    SIM_ARG("wall",         sim_wall,         0.3);
+    SIM_ARG("gamma_rate",   sim_gamma_rate,   0);
+    SIM_ARG("gamma_mean",   sim_gamma_mean,   30);
+    SIM_ARG("tau",          sim_tau,          1.0);
+    SIM_ARG("baseline",     sim_baseline,     2385);
+    SIM_ARG("noise",        sim_noise,        1.0);
+    SIM_ARG("drift",        sim_drift,        0);
+    SIM_ARG("drift_period", sim_drift_period, 60);
+    SIM_ARG("emi_rate",     sim_emi_rate,     0);
+    SIM_ARG("emi_amp",      sim_emi_amp,      100);
+    SIM_ARG("lose",         sim_lose,         0);
+    sim_seed = 1;
+    if (getarg(args, "seed", value, sizeof(value))) {
+        sim_seed = strtoull(value, NULL, 0);
+    }
+    sim_fast = getarg(args, "fast", value, sizeof(value));
+    if (!getarg(args, "truth", truth_filename, sizeof(truth_filename))) {
+        sprintf(truth_filename, "sim_truth_%s.dat", time2str(time(NULL),s,true));
+    }
+    if (sim_rate < 0 || sim_gamma_rate < 0 || sim_emi_rate < 0 || sim_tau <= 0 ||
+        sim_tau > SIM_TAIL/10 || sim_drift_period <= 0 || sim_gamma_mean <= 0 ||
+        sim_wall < 0 || sim_wall > 1 || sim_lose < 0)
+    {
+        ERROR("invalid args '%s'\n", args);
+        return -1;
+    }
+    INFO("rate=%g peak=%g res=%g wall=%g gamma_rate=%g gamma_mean=%g tau=%g\n",
+         sim_rate, sim_peak, sim_res, sim_wall, sim_gamma_rate, sim_gamma_mean, sim_tau);
+    INFO("baseline=%g noise=%g drift=%g drift_period=%g emi_rate=%g emi_amp=%g seed=%lld fast=%d lose=%g\n",
+         sim_baseline, sim_noise, sim_drift, sim_drift_period, sim_emi_rate, sim_emi_amp, 
+         (long long)sim_seed, sim_fast, sim_lose);
+
+    // init the table of gaussian distributed values, using the box-muller method;
+    // the noise is generated by randomly selecting values from this table
+    for (i = 0; i < SIM_GAUSS_TBL; i += 2) {
+        double u1 = 1 - sim_uniform(), u2 = sim_uniform();
+        double r = sqrt(-2 * log(u1));
+        sim_gauss[i]   = r * cos(SIM_TWO_PI * u2);
+        sim_gauss[i+1] = r * sin(SIM_TWO_PI * u2);
+    }
+
+    // the channels are simulated independently
+    sim_num_chan = mccdaq_get_num_chan();
+    sim_frequency = CHAN_FREQUENCY(sim_num_chan);
+
+    // create the ground-truth file, and write the file_hdr
+    sim_truth_fd = open(truth_filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (sim_truth_fd < 0) {
+        ERROR("%s, open for writing, %s\n", truth_filename, strerror(errno));
+        return -1;
+    }
+    memset(&file_hdr, 0, sizeof(file_hdr));
+    file_hdr.magic = FILE_MAGIC_V2;
+    file_hdr.hdr_size = sizeof(file_hdr);
+    file_hdr.data_start_time = time(NULL);
+    file_hdr.record_size = sizeof(pulse_count_t);
+    file_hdr.num_chan = sim_num_chan;
+    rc = write(sim_truth_fd, &file_hdr, sizeof(file_hdr));
+    if (rc != sizeof(file_hdr)) {
+        ERROR("%s, write file_hdr, rc=%d, %s\n", truth_filename, rc, strerror(errno));
+        return -1;
+    }
+    INFO("truth filename=%s\n", truth_filename);
+
+    // when generating samples faster than real time, the time of the
+    // samples is determined by counting them
+    if (sim_fast) {
+        mccdaq_set_sample_clock(dev, file_hdr.data_start_time);
+    }
+
+    return 0;
+}
+
+static void sim_run(int32_t dev)
+{
+    uint64_t   start_us, total = 0, lost = 0, lose_intvl;
+    uint16_t * data;
+    int32_t    i, j, n, c, max_data, nc = sim_num_chan, shift = __builtin_ctz(sim_num_chan);
+    double     next_pulse[MAX_CHAN], next_gamma[MAX_CHAN], next_emi[MAX_CHAN], baseline;
+    double     block_end, height;
+    bool       drop;
+
+    start_us = microsec_timer();
+    lose_intvl = sim_lose * sim_frequency;
+    for (c = 0; c < nc; c++) {
+        next_pulse[c] = (sim_rate > 0 ? sim_exponential(sim_frequency / sim_rate) : INFINITY);
+        next_gamma[c] = (sim_gamma_rate > 0 ? sim_exponential(sim_frequency / sim_gamma_rate) : INFINITY);
+        next_emi[c]   = (sim_emi_rate > 0 ? sim_exponential(sim_frequency / sim_emi_rate) : INFINITY);
+    }
+
+    while (!mccdaq_stopping()) {
+        // add the neutron pulses, gamma pulses, and EMI bursts that start in this 
+        // block to each channel's accumulator; the time of each is in units of 
+        // samples since the simulation started, and the interval between them is
+        // exponentially distributed, which is a poisson arrival process; the 
+        // neutron and gamma pulses are added in sample order, so that each is 
+        // added to the ground-truth histogram of the second it occurs in
+        block_end = total + BLOCK_SAMPLES;
+        for (c = 0; c < nc; c++) {
+            while (next_pulse[c] < block_end || next_gamma[c] < block_end) {
+                if (next_pulse[c] <= next_gamma[c]) {
+                    if (sim_uniform() < sim_wall) {
+                        height = sim_peak * (0.25 + 0.75 * sim_uniform());
+                    } else {
+                        height = sim_peak * (1 + sim_res / 100 * sim_gauss[sim_random() % SIM_GAUSS_TBL]);
+                    }
+                    sim_add_pulse(sim_acc[c], next_pulse[c] - total, height, sim_tau);
+                    sim_truth_add(c, next_pulse[c], height);
+                    next_pulse[c] += sim_exponential(sim_frequency / sim_rate);
+                } else {
+                    height = sim_exponential(sim_gamma_mean);
+                    sim_add_pulse(sim_acc[c], next_gamma[c] - total, height, sim_tau / 2);
+                    sim_truth_add(c, next_gamma[c], height);
+                    next_gamma[c] += sim_exponential(sim_frequency / sim_gamma_rate);
+                }
+            }
+            while (next_emi[c] < block_end) {
+                sim_add_emi(sim_acc[c], next_emi[c] - total);
+                next_emi[c] += sim_exponential(sim_frequency / sim_emi_rate);
+            }
+            sim_truth_flush(c, block_end);
+        }
+
+        // when generating at the ADC's sample rate, delay until the time the 
+        // device would have acquired this block
+        if (!sim_fast) {
+            pace(start_us, total + BLOCK_SAMPLES, sim_frequency);
+        }
+
+        // convert the accumulators to ADC samples, adding the baseline, baseline 
+        // drift, and noise; the channels' samples are interleaved, sample i of the
+        // block is channel i % nc; the block may be added to the ring in 2 parts, when
+        // the ring wraps; when generating at the ADC's sample rate a full ring 
+        // causes the remainder of the block to be lost, like the device; 
+        // otherwise wait for space; when the lose arg is used, the block that
+        // crosses each lose interval is dropped
+        baseline = sim_baseline + sim_drift * sin(SIM_TWO_PI * total / (sim_drift_period * sim_frequency));
+        drop = (lose_intvl > 0 && (total + BLOCK_SAMPLES) / lose_intvl != total / lose_intvl);
+        for (i = 0; i < BLOCK_SAMPLES * nc && !drop; i += n) {
+            data = (sim_fast ? wait_ring_space(dev, &max_data) : mccdaq_ring_space(dev, &max_data));
+            if (max_data == 0) {
+                break;
+            }
+            n = (max_data < BLOCK_SAMPLES * nc - i ? max_data : BLOCK_SAMPLES * nc - i);
+            for (j = 0; j < n; j++) {
+                float acc = sim_acc[(i+j) & (nc-1)][(i+j) >> shift];
+                int32_t v = nearbyintf(baseline + acc + sim_noise * sim_gauss[sim_random() % SIM_GAUSS_TBL]);
+                data[j] = (v < 0 ? 0 : v > 4095 ? 4095 : v);
+            }
+            mccdaq_ring_commit(dev, n);
+        }
+        if (i < BLOCK_SAMPLES * nc && !mccdaq_stopping()) {
+            mccdaq_ring_lost(dev, BLOCK_SAMPLES * nc - i);
+            for (c = 0; c < nc; c++) {
+                sim_truth[c].samples_lost += (BLOCK_SAMPLES * nc - i) / nc;
+            }
+            lost += BLOCK_SAMPLES * nc - i;
+        }
+
+        // move the accumulator tails, which contain the parts of pulses that extend
+        // past this block, to the start of the accumulators
+        for (c = 0; c < nc; c++) {
+            memmove(sim_acc[c], sim_acc[c]+BLOCK_SAMPLES, SIM_TAIL*sizeof(float));
+            memset(sim_acc[c]+SIM_TAIL, 0, BLOCK_SAMPLES*sizeof(float));
+        }
+        total += BLOCK_SAMPLES;
+        sim_truth_samples = total;
+    }
+
+    // log the ground-truth totals
+    INFO("simulated %lld samples, %lld lost\n", (long long)total * nc, (long long)lost);
+    for (i = 0; i < MAX_BUCKET; i++) {
+        if (sim_truth_total[i]) {
+            INFO("truth: pulse_height %3d - %3d : %lld\n",
+                 BUCKET_IDX_TO_PULSE_HEIGHT(i), BUCKET_IDX_TO_PULSE_HEIGHT(i+1)-1,
+                 (long long)sim_truth_total[i]);
+        }
+    }
+}
+
+// writes the ground-truth histogram of the last, partial, second of each channel,
+// which sim_truth_flush has not written; and closes the ground-truth file
+static void sim_exit(int32_t dev)
+{
+    int32_t c;
+
+    if (sim_truth_fd < 0) {
+        return;
+    }
+
+    for (c = 0; c < sim_num_chan; c++) {
+        if (sim_truth_samples > sim_truth_sec[c] * sim_frequency) {
+            sim_truth_write(c, sim_truth_samples - sim_truth_sec[c] * sim_frequency);
+        }
+    }
+
+    close(sim_truth_fd);
+    sim_truth_fd = -1;
+}
+
+// xorshift64* random number generator
+static uint64_t sim_random(void)
+{
+    sim_seed ^= sim_seed >> 12;
+    sim_seed ^= sim_seed << 25;
+    sim_seed ^= sim_seed >> 27;
+    return sim_seed * 0x2545F4914F6CDD1DULL;
+}
+
+// returns uniform distributed value in the range [0,1)
+static double sim_uniform(void)
+{
+    return (sim_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double sim_exponential(double mean)
+{
+    return -mean * log(1 - sim_uniform());
+}
+
+// adds a pulse, that starts at the fractional sample pos, to the accumulator; the
+// pulse shape is the difference of exponentials, with rise time constant tau/4, 
+// normalized so that its maximum value is height
+static void sim_add_pulse(float * acc, double pos, double height, double tau)
+{
+    double  tau_r = tau / 4, t, t_peak, norm;
+    int32_t i, start = ceil(pos);
+
+    t_peak = log(tau / tau_r) * tau * tau_r / (tau - tau_r);
+    norm = height / (exp(-t_peak/tau) - exp(-t_peak/tau_r));
+    for (i = start; i < start + 10*tau && i < BLOCK_SAMPLES+SIM_TAIL; i++) {
+        t = i - pos;
+        acc[i] += norm * (exp(-t/tau) - exp(-t/tau_r));
+    }
+}
+
+// adds an EMI burst, which is a damped 8 sample period oscillation
+static void sim_add_emi(float * acc, double pos)
+{
+    int32_t i, start = ceil(pos);
+    double  amp = sim_emi_amp * (0.5 + sim_uniform()), t;
+
+    for (i = start; i < start + SIM_TAIL && i < BLOCK_SAMPLES+SIM_TAIL; i++) {
+        t = i - pos;
+        acc[i] += amp * exp(-t/20) * sin(SIM_TWO_PI * t / 8);
+    }
+}
+
+// add a simulated pulse, at sample pos of channel c, to the ground-truth histogram
+static void sim_truth_add(int32_t c, uint64_t pos, double height)
+{
+    int32_t bidx;
+
+    sim_truth_flush(c, pos);
+    if (height < 0) {
+        return;
+    }
+    bidx = PULSE_HEIGHT_TO_BUCKET_IDX(nearbyint(height));
+    sim_truth[c].bucket[bidx]++;
+    sim_truth_total[bidx]++;
+}
+
+// write the ground-truth histogram of channel c for each second that ends before
+// pos; the channels are written independently, so each record is written at its
+// offset in the file
+static void sim_truth_flush(int32_t c, uint64_t pos)
+{
+    while (pos >= (sim_truth_sec[c] + 1) * sim_frequency) {
+        sim_truth_write(c, sim_frequency);
+    }
+}
+
+// write the ground-truth histogram of channel c for its current second, of which
+// the given number of samples were simulated; and start the next second
+static void sim_truth_write(int32_t c, int32_t samples)
+{
+    int32_t rc;
+    off_t   offset;
+
+    sim_truth[c].samples = samples - sim_truth[c].samples_lost;
+    offset = sizeof(file_hdr_t) + (sim_truth_sec[c] * sim_num_chan + c) * sizeof(pulse_count_t);
+    rc = pwrite(sim_truth_fd, &sim_truth[c], sizeof(pulse_count_t), offset);
+    if (rc != sizeof(pulse_count_t)) {
+        ERROR("write truth, rc=%d, %s\n", rc, strerror(errno));
+    }
+    memset(&sim_truth[c], 0, sizeof(pulse_count_t));
+    sim_truth_sec[c]++;
+}
+
+// -----------------  FILE SOURCE  --------------------------------------
+
+// replays a file of ADC samples, which is either a capture file (refer to
+// capture.c), or a file of raw samples which are uint16_t in host byte order;
+// args: <filename>[,rate=<samples/sec>][,loop][,exit]
+// - rate: replay rate, default FREQUENCY; 0 replays as fast as the samples
+//         are consumed
+// - loop: when the end of file is reached, replay from the beginning
+// - exit: when the end of file is reached, terminate the program
+//
+// The samples that are missing from a capture file, because the capture
+// fell behind, are counted as lost samples.
+//
+// The sample clock is used, starting at the capture file's start_time; so the
+// pulse_counts are published for the same seconds as when the samples were 
+// captured, and replay at any rate produces the same pulse_counts.
+//
+// The number of channels is that of the capture file; a file of raw samples
+// has the number of channels selected by mccdaq_init, the samples are interleaved.
+
+static int        file_fd = -1;
+static int32_t    file_dev;
+static int32_t    file_rate;
+static bool       file_loop;
+static bool       file_exit_at_eof;
+static int32_t    file_hdr_size;
+static bool       file_is_capture;
+static uint16_t * file_block;        // capture file: the decoded block
+static uint8_t  * file_block_bytes;  // capture file: the compressed block
+static int32_t    file_block_len;
+static int32_t    file_block_idx;
+static uint64_t   file_block_pos_next;
+
+static int32_t file_read(uint16_t * data, int32_t max_samples);
+static void file_rewind(void);
+
+static int32_t file_init(int32_t dev, char * args)
+{
+    char filename[200], value[100];
+    capture_hdr_t hdr;
+    int32_t len;
+
+    // the file source can be used by only one device
+    if (file_fd >= 0) {
+        ERROR("the file source is already in use\n");
+        return -1;
+    }
+    file_dev = dev;
+
+    // get the filename, which is the first of the args
+    if (sscanf(args, "%199[^,]", filename) != 1) {
+        ERROR("file source requires a filename\n");
+        return -1;
+    }
+    file_fd = open(filename, O_RDONLY);
+    if (file_fd < 0) {
+        ERROR("%s, open for reading, %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    // if the file is not a capture file then
+    //   it is a file of raw samples, which have no start time; use the current time
+    // else
+    //   the sample clock starts at the capture's start time, the default rate is 
+    //   the rate the samples were captured at, and allocate buffers for the blocks
+    // endif
+    file_rate = FREQUENCY;
+    len = read(file_fd, &hdr, sizeof(hdr));
+    if (len != sizeof(hdr) || hdr.magic != CAPTURE_MAGIC) {
+        mccdaq_set_sample_clock(dev, time(NULL));
+    } else {
+        mccdaq_set_sample_clock(dev, hdr.start_time);
+        file_is_capture = true;
+        file_hdr_size = hdr.hdr_size;
+        file_rate = hdr.frequency;
+        if (mccdaq_set_num_chan(hdr.num_chan ? hdr.num_chan : 1) < 0) {
+            return -1;
+        }
+        file_block = malloc(CAPTURE_BLOCK_SAMPLES * sizeof(uint16_t));
+        file_block_bytes = malloc(CAPTURE_BLOCK_MAX_BYTES);
+    }
+    file_rewind();
+
+    // get the optional args
+    if (getarg(args, "rate", value, sizeof(value))) {
+        file_rate = atoi(value);
+    }
+    if (file_rate < 0) {
+        ERROR("invalid args '%s'\n", args);
+        return -1;
+    }
+    file_loop = getarg(args, "loop", value, sizeof(value));
+    file_exit_at_eof = getarg(args, "exit", value, sizeof(value));
+    INFO("filename=%s format=%s rate=%d loop=%d exit=%d\n", 
+         filename, file_is_capture ? "capture" : "raw", file_rate, file_loop, file_exit_at_eof);
+
+    return 0;
+}
+
+static void file_run(int32_t dev)
+{
+    uint64_t   start_us, total = 0;
+    uint16_t * data;
+    int32_t    len, max_data;
+
+    start_us = microsec_timer();
+
+    while (!mccdaq_stopping()) {
+        // get ring space; when replaying at a fixed rate a full ring causes
+        // the block to be lost, like the device; otherwise wait for space
+        if (file_rate) {
+            pace(start_us, total, file_rate);
+            data = mccdaq_ring_space(dev, &max_data);
+        } else {
+            data = wait_ring_space(dev, &max_data);
+            if (mccdaq_stopping()) {
+                break;
+            }
+        }
+        if (max_data > BLOCK_SAMPLES) {
+            max_data = BLOCK_SAMPLES;
+        }
+
+        // read the samples directly into the ring; if the ring is full
+        // then read to a temporary buffer, and discard
+        if (max_data == 0) {
+            static uint16_t discard[BLOCK_SAMPLES];
+            len = file_read(discard, BLOCK_SAMPLES);
+        } else {
+            len = file_read(data, max_data);
+        }
+        if (len < 0) {
+            break;
+        }
+
+        // at end of file, either replay from the beginning, or
+        // idle until stopped; and if requested, terminate the program
+        // once the samples have been consumed
+        if (len == 0) {
+            if (file_loop) {
+                file_rewind();
+                continue;
+            }
+            INFO("end of file, %lld samples\n", (long long)total);
+            if (file_exit_at_eof) {
+                while (mccdaq_ring_produced(dev) != mccdaq_ring_consumed(dev) && !mccdaq_stopping()) {
+                    usleep(10000);
+                }
+                kill(getpid(), SIGTERM);
+            }
+            while (!mccdaq_stopping()) {
+                usleep(100000);
+            }
+            break;
+        }
+
+        // make the samples available to the consumer, or count them as lost
+        if (max_data == 0) {
+            mccdaq_ring_lost(dev, len);
+        } else {
+            mccdaq_ring_commit(dev, len);
+        }
+        total += len;
+    }
+}
+
+static void file_exit(int32_t dev)
+{
+    if (file_fd >= 0) {
+        close(file_fd);
+        file_fd = -1;
+    }
+    free(file_block);
+    free(file_block_bytes);
+    file_block = NULL;
+    file_block_bytes = NULL;
+}
+
+// returns the number of samples read, 0 at end of file, or -1 on error
+static int32_t file_read(uint16_t * data, int32_t max_samples)
+{
+    capture_block_hdr_t block_hdr;
+    int32_t len;
+
+    // raw file: read the samples, in whole frames; a partial frame at
+    // the end of the file is discarded
+    if (!file_is_capture) {
+        len = read(file_fd, data, max_samples * sizeof(uint16_t));
+        if (len < 0) {
+            ERROR("read, %s\n", strerror(errno));
+            return -1;
+        }
+        len /= sizeof(uint16_t);
+        return len - len % mccdaq_get_num_chan();
+    }
+
+    // capture file: when all of the samples of the current block have been
+    // returned, read and decode the next block
+    if (file_block_idx == file_block_len) {
+        len = read(file_fd, &block_hdr, sizeof(block_hdr));
+        if (len == 0) {
+            return 0;
+        }
+        if (len != sizeof(block_hdr) || 
+            block_hdr.magic != CAPTURE_BLOCK_MAGIC ||
+            block_hdr.nbytes <= 0 || block_hdr.nbytes > CAPTURE_BLOCK_MAX_BYTES ||
+            block_hdr.nsamples <= 0 || block_hdr.nsamples > CAPTURE_BLOCK_SAMPLES)
+        {
+            ERROR("invalid capture block hdr, len=%d\n", len);
+            return -1;
+        }
+        len = read(file_fd, file_block_bytes, block_hdr.nbytes);
+        if (len != block_hdr.nbytes ||
+            capture_decode(file_block_bytes, block_hdr.nbytes, file_block, block_hdr.nsamples) < 0)
+        {
+            ERROR("invalid capture block, sample_pos=%lld\n", (long long)block_hdr.sample_pos);
+            return -1;
+        }
+
+        // the samples that were not captured are lost
+        if (block_hdr.sample_pos > file_block_pos_next) {
+            WARN("gap of %lld samples, lost or not captured, at sample_pos %lld\n",
+                 (long long)(block_hdr.sample_pos - file_block_pos_next),
+                 (long long)file_block_pos_next);
+            mccdaq_ring_lost(file_dev, block_hdr.sample_pos - file_block_pos_next);
+        }
+        file_block_pos_next = block_hdr.sample_pos + block_hdr.nsamples;
+        file_block_len = block_hdr.nsamples;
+        file_block_idx = 0;
+    }
+
+    // return samples from the current block
+    len = file_block_len - file_block_idx;
+    if (len > max_samples) {
+        len = max_samples;
+    }
+    memcpy(data, file_block + file_block_idx, len * sizeof(uint16_t));
+    file_block_idx += len;
+    return len;
+}
+
+static void file_rewind(void)
+{
+    lseek(file_fd, file_is_capture ? file_hdr_size : 0, SEEK_SET);
+    file_block_len = 0;
+    file_block_idx = 0;
+    file_block_pos_next = 0;
+}
+
+// -----------------  SYNTH SOURCE  -------------------------------------
+
+// synthetic samples, copied from a pattern of pulses on a noisy baseline;
+// args: [rate=<samples/sec>][,period=<samples>][,height=<adc units>]
+// - rate:   samples per second, default 0 which is as fast as the samples
+//           are consumed
+// - period: samples between pulses, default 500
+// - height: pulse height, default 200
+// When there are multiple channels each has the same pattern. Each device has
+// its own args and pattern.
+
+#define SYNTH_BASELINE     2400
+#define SYNTH_PATTERN_LEN  65536
+
+typedef struct {
+    int32_t    rate;
+    int32_t    period;
+    int32_t    height;
+    uint16_t * pattern;
+    int32_t    pattern_len;   // samples, of all channels
+} synth_t;
+
+static synth_t synth[MAX_DEV];
+
+static int32_t synth_init(int32_t dev, char * args)
+{
+    static const int32_t shape[] = { 100, 79, 22, 5, 1 };  // percent of pulse height
+    synth_t * sy = &synth[dev];
+    char     value[100];
+    int32_t  i, j, c, nc = mccdaq_get_num_chan();
+    uint32_t seed = 1;
+
+    // get the optional args
+    sy->rate = 0;
+    sy->period = 500;
+    sy->height = 200;
+    if (getarg(args, "rate", value, sizeof(value))) {
+        sy->rate = atoi(value);
+    }
+    if (getarg(args, "period", value, sizeof(value))) {
+        sy->period = atoi(value);
+    }
+    if (getarg(args, "height", value, sizeof(value))) {
+        sy->height = atoi(value);
+    }
+    if (sy->rate < 0 || sy->period < 10 || sy->height < 0 || sy->height > 4095-SYNTH_BASELINE) {
+        ERROR("invalid args '%s'\n", args);
+        return -1;
+    }
+    INFO("rate=%d period=%d height=%d\n", sy->rate, sy->period, sy->height);
+
+    // when generating samples as fast as they are consumed, the time 
+    // of the samples is determined by counting them
+    if (sy->rate == 0) {
+        mccdaq_set_sample_clock(dev, time(NULL));
+    }
+
+    // the pattern length is a multiple of the period, so that the
+    // pattern can be repeated
+    sy->pattern_len = (SYNTH_PATTERN_LEN / sy->period + 1) * sy->period * nc;
+    sy->pattern = malloc(sy->pattern_len * sizeof(uint16_t));
+    if (sy->pattern == NULL) {
+        ERROR("malloc pattern failed\n");
+        return -1;
+    }
+
+    // init the pattern of the first channel: baseline with +/-1 noise, and a 
+    // pulse every period; and copy it to the other channels, interleaved
+    for (i = 0; i < sy->pattern_len / nc; i++) {
+        seed = seed * 1103515245 + 12345;
+        sy->pattern[i] = SYNTH_BASELINE + (int32_t)((seed >> 16) % 3) - 1;
+    }
+    for (i = sy->period/2; i < sy->pattern_len / nc; i += sy->period) {
+        for (j = 0; j < sizeof(shape)/sizeof(shape[0]); j++) {
+            sy->pattern[i+j] = SYNTH_BASELINE + sy->height * shape[j] / 100;
+        }
+    }
+    for (i = sy->pattern_len / nc - 1; i >= 0 && nc > 1; i--) {
+        for (c = 0; c < nc; c++) {
+            sy->pattern[i * nc + c] = sy->pattern[i];
+        }
+    }
+
+    return 0;
+}
+
+static void synth_run(int32_t dev)
+{
+    synth_t  * sy = &synth[dev];
+    uint64_t   start_us, total = 0;
+    uint16_t * data;
+    int32_t    n, offset, max_data;
+
+    start_us = microsec_timer();
+
+    while (!mccdaq_stopping()) {
+        // get ring space, see file_run
+        if (sy->rate) {
+            pace(start_us, total, sy->rate);
+            data = mccdaq_ring_space(dev, &max_data);
+            if (max_data == 0) {
+                mccdaq_ring_lost(dev, BLOCK_SAMPLES);
+                total += BLOCK_SAMPLES;
+                continue;
+            }
+        } else {
+            data = wait_ring_space(dev, &max_data);
+            if (max_data == 0) {
+                continue;
+            }
+        }
+
+        // copy from the pattern to the ring; when paced, at most BLOCK_SAMPLES
+        offset = total % sy->pattern_len;
+        n = sy->pattern_len - offset;
+        if (n > max_data) {
+            n = max_data;
+        }
+        if (sy->rate && n > BLOCK_SAMPLES) {
+            n = BLOCK_SAMPLES;
+        }
+        memcpy(data, sy->pattern + offset, n * sizeof(uint16_t));
+        mccdaq_ring_commit(dev, n);
+        total += n;
+    }
+}
+
+// -----------------  UTILS  --------------------------------------------
+
+// delay until the time at which 'samples' would have been produced at 'rate'
+static void pace(uint64_t start_us, uint64_t samples, int32_t rate)
+{
+    uint64_t target_us, time_now;
+
+    target_us = start_us + samples * 1000000 / rate;
+    time_now = microsec_timer();
+    if (target_us > time_now) {
+        usleep(target_us - time_now);
+    }
+}
+
+// waits for the consumer to free ring space; returns with max_samples 0
+// if mccdaq is stopping
+static uint16_t * wait_ring_space(int32_t dev, int32_t * max_samples)
+{
+    uint16_t * data;
+
+    while (true) {
+        data = mccdaq_ring_space(dev, max_samples);
+        if (*max_samples > 0 || mccdaq_stopping()) {
+            return data;
+        }
+        usleep(1000);
+    }
+}
@@ -0,0 +1,239 @@
+#define _GNU_SOURCE   // for pthread_setaffinity_np and pthread_setname_np
+#include <common.h>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+// Real-time scheduling of the live mode threads, selected with the -r option,
+// and the jitter statistics used to tune it.
+//
+// Each thread calls rt_thread when it starts, with its role; the thread is
+// named (so it can be identified with 'top -H' or 'ps -L'), pinned to a cpu,
+// and given the scheduling policy and priority of its role:
+// - producer:  reads the ADC, the usb transfers must be resubmitted before the
+//              device's fifo overruns; prio
+// - consumer:  the mccdaq consumer thread, and the pulse detection worker
+//              threads, which are behind the 20 second ring; prio-1
+// - writer:    the threads that write the .dat, .cap, .lst and .mca files;
+//              writer_prio, by default these are not real-time
+// The producer and consumer threads of device dev are pinned to cpus
+// cpu+2*dev and cpu+2*dev+1; when cpu is not selected, and there are multiple
+// devices and at least 2 cpus per device, they are pinned counting down from
+// the last cpu. The pulse detection worker threads are not pinned.
+//
+// The jitter_t statistics are a log2 histogram of intervals in microseconds;
+// refer to the commit gap and wakeup latency in util_mccdaq.c.
+
+//
+// defines
+//
+
+#ifndef MCL_ONFAULT
+#define MCL_ONFAULT 0
+#endif
+
+#define POLICY_STRING(x) \
+   ((x) == SCHED_FIFO  ? "fifo"  : \
+    (x) == SCHED_RR    ? "rr"    : \
+    (x) == SCHED_OTHER ? "other"   \
+                       : "????")
+
+//
+// variables
+//
+
+static int32_t policy = SCHED_OTHER;
+static int32_t prio = 50;
+static int32_t writer_prio;
+static int32_t first_cpu = -1;
+static int32_t writer_cpu = -1;
+
+// -----------------  PUBLIC ROUTINES  ----------------------------------
+
+// args: a comma separated list of
+//   policy=fifo|rr|other, prio=<1-99>, writer_prio=<0-99>, cpu=<n>,
+//   writer_cpu=<n>, mlock
+// returns -1 on error
+int32_t rt_init(char * args)
+{
+    char value[100];
+
+    // parse args
+    if (getarg(args, "policy", value, sizeof(value))) {
+        if (strcmp(value, "fifo") == 0) {
+            policy = SCHED_FIFO;
+        } else if (strcmp(value, "rr") == 0) {
+            policy = SCHED_RR;
+        } else if (strcmp(value, "other") == 0) {
+            policy = SCHED_OTHER;
+        } else {
+            ERROR("invalid policy '%s'\n", value);
+            return -1;
+        }
+    }
+    if (getarg(args, "prio", value, sizeof(value)) &&
+        (sscanf(value, "%d", &prio) != 1 || prio < 2 || prio > 99))
+    {
+        ERROR("invalid prio '%s', must be 2..99\n", value);
+        return -1;
+    }
+    if (getarg(args, "writer_prio", value, sizeof(value)) &&
+        (sscanf(value, "%d", &writer_prio) != 1 || writer_prio < 0 || writer_prio > 99))
+    {
+        ERROR("invalid writer_prio '%s', must be 0..99\n", value);
+        return -1;
+    }
+    if (getarg(args, "cpu", value, sizeof(value)) &&
+        (sscanf(value, "%d", &first_cpu) != 1 || first_cpu < 0))
+    {
+        ERROR("invalid cpu '%s'\n", value);
+        return -1;
+    }
+    if (getarg(args, "writer_cpu", value, sizeof(value)) &&
+        (sscanf(value, "%d", &writer_cpu) != 1 || writer_cpu < 0))
+    {
+        ERROR("invalid writer_cpu '%s'\n", value);
+        return -1;
+    }
+
+    // lock the memory, so that the threads do not stall on page faults;
+    // MCL_ONFAULT locks pages as they are touched, rather than populating
+    // all of the large static arrays now. The locked memory is not limited
+    // by RLIMIT_MEMLOCK when root, otherwise the limit must be unlimited,
+    // because once it is reached allocations fail.
+    if (getarg(args, "mlock", value, sizeof(value))) {
+        struct rlimit rl;
+        getrlimit(RLIMIT_MEMLOCK, &rl);
+        if (geteuid() != 0 && rl.rlim_cur != RLIM_INFINITY) {
+            ERROR("mlock requires root, or 'ulimit -l unlimited'\n");
+            return -1;
+        }
+        if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) < 0) {
+            ERROR("mlockall, %s\n", strerror(errno));
+            return -1;
+        }
+        INFO("memory is locked\n");
+    }
+
+    INFO("policy=%s prio=%d writer_prio=%d cpu=%d writer_cpu=%d\n",
+         POLICY_STRING(policy), prio, writer_prio, first_cpu, writer_cpu);
+    return 0;
+}
+
+// called by a thread when it starts; dev is the device number of the producer
+// and consumer threads; a failure to set the cpu or the policy is logged, and
+// the thread continues without it
+void rt_thread(char * name, int32_t role, int32_t dev)
+{
+    int32_t            ncpu, num_dev, cpu = -1, p = 0, rc;
+    cpu_set_t          cpus;
+    struct sched_param param;
+
+    pthread_setname_np(pthread_self(), name);
+
+    // determine the cpu, and the priority
+    switch (role) {
+    case RT_PRODUCER: case RT_CONSUMER:
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        num_dev = mccdaq_get_num_dev();
+        if (first_cpu >= 0) {
+            cpu = first_cpu + 2 * dev;
+        } else if (num_dev > 1 && ncpu >= 2 * num_dev) {
+            cpu = ncpu - 2 * (dev + 1);
+        }
+        if (cpu >= 0 && role == RT_CONSUMER) {
+            cpu++;
+        }
+        p = (role == RT_PRODUCER ? prio : prio - 1);
+        break;
+    case RT_WORKER:
+        p = prio - 1;
+        break;
+    case RT_WRITER:
+        cpu = writer_cpu;
+        p = writer_prio;
+        break;
+    }
+
+    // pin the thread to the cpu
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (rc != 0) {
+            WARN("%s: pthread_setaffinity_np cpu %d, %s\n", name, cpu, strerror(rc));
+            cpu = -1;
+        }
+    }
+
+    // set the real-time policy and priority
+    if (policy != SCHED_OTHER && p > 0) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = p;
+        rc = pthread_setschedparam(pthread_self(), policy, &param);
+        if (rc != 0) {
+            WARN("%s: pthread_setschedparam %s %d, %s\n", name, POLICY_STRING(policy), p, strerror(rc));
+            p = 0;
+        }
+    } else {
+        p = 0;
+    }
+
+    if (cpu >= 0 || p > 0) {
+        INFO("%s: cpu=%d policy=%s prio=%d\n", name, cpu, p ? POLICY_STRING(policy) : "other", p);
+    }
+}
+
+// -----------------  JITTER STATISTICS  --------------------------------
+
+// adds an interval; called by only one thread for each jitter_t
+void jitter_add(jitter_t * j, uint64_t us)
+{
+    int32_t b = (us ? 64 - __builtin_clzll(us) : 0);
+
+    j->bucket[b < MAX_JITTER_BUCKET ? b : MAX_JITTER_BUCKET-1]++;
+    j->count++;
+    j->sum_us += us;
+    if (us > j->max_us) {
+        j->max_us = us;
+    }
+    if (us > __atomic_load_n(&j->interval_max_us, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&j->interval_max_us, us, __ATOMIC_RELAXED);
+    }
+}
+
+// returns the maximum interval added since the last call
+uint64_t jitter_interval_max(jitter_t * j)
+{
+    return __atomic_exchange_n(&j->interval_max_us, 0, __ATOMIC_RELAXED);
+}
+
+// logs the count, mean, 99th percentile and max, and the histogram; the
+// percentile and the histogram are the upper bounds of the log2 buckets
+void jitter_log(char * name, jitter_t * j)
+{
+    char     s[MAX_JITTER_BUCKET*24], *p = s;
+    uint64_t cnt = 0;
+    int32_t  b, p99 = -1;
+
+    if (j->count == 0) {
+        return;
+    }
+
+    s[0] = '\0';
+    for (b = 0; b < MAX_JITTER_BUCKET; b++) {
+        cnt += j->bucket[b];
+        if (p99 < 0 && cnt >= j->count - j->count / 100) {
+            p99 = b;
+        }
+        if (j->bucket[b]) {
+            p += sprintf(p, " <%lld:%lld", 1LL << b, (long long)j->bucket[b]);
+        }
+    }
+
+    INFO("%s: count=%lld mean=%lldus p99<%lldus max=%lldus\n",
+         name, (long long)j->count, (long long)(j->sum_us / j->count),
+         1LL << p99, (long long)j->max_us);
+    INFO("%s: us histogram%s\n", name, s);
+}
@@ -0,0 +1,316 @@
+#include <common.h>
+
+// Pulse shaping filter, applied to the ADC samples ahead of the pulse detector
+// (refer to mccdaq_cb.c), to reduce the noise so that the pulse threshold can
+// be lowered. The filter is selected with the -f option:
+// - ma,n=<samples>                moving average
+// - trap,rise=<samples>,flat=<samples>   trapezoidal
+// - crrc,tau=<samples>            CR-RC, truncated to 8 tau
+//
+// All are FIR filters, with taps in units of 1/4096, applied to the samples
+// less the dc level; the dc level is then added back, so the baseline of the
+// output is at the same ADC value as the input, even for the filters that
+// remove dc (trap and crrc). The dc level is a running median of the input,
+// which pulses do not move; it is updated at the end of each SHAPER_BLOCK
+// samples, by SHAPER_DC_STEP/16 ADC unit toward the median of the block.
+//
+// shaper_process reads the samples directly from the mccdaq ring slice passed
+// to mccdaq_callback, with the filter's history carried across calls, and
+// returns the output in its own buffer. When the pulse detector's worker 
+// threads are used, shaper_plan first advances the dc level and history over
+// the whole slice, serially, and then each worker filters its chunk with 
+// shaper_filter; the output is the same as shaper_process's. Each ADC 
+// channel has its own dc level, history, output buffer and plan, so the
+// channels of multiple devices are filtered concurrently. The filter is a
+// loop over the taps, computing 4 samples at a time using the gcc vector
+// extension; so it uses SSE2, AVX2 or NEON, depending on the instruction set
+// the compiler targets (NATIVE=1 roughly doubles the speed, SSE2 lacks a 32
+// bit multiply).
+
+//
+// defines
+//
+
+#define SHAPER_MAX_TAPS  64
+#define SHAPER_HIST      (SHAPER_MAX_TAPS - 1)
+#define SHAPER_BLOCK     4096     // max samples per call, and dc update interval
+#define SHAPER_SHIFT     12       // taps are in units of 1/4096
+#define SHAPER_DC_STEP   4        // 1/16 ADC units, the max change of the dc level per block
+
+typedef int32_t v4si_t __attribute__((vector_size(16)));
+typedef int16_t v4hi_t __attribute__((vector_size(8)));
+
+// the state of a channel
+typedef struct {
+    int32_t  dc16;               // dc level, in 1/16 ADC units
+    int64_t  count;              // number of samples filtered
+    int32_t  block_above;        // samples of the current block above the dc level
+    int32_t  block_below;        // samples of the current block below the dc level
+    int32_t  x[SHAPER_HIST + SHAPER_BLOCK + 4] __attribute__((aligned(16)));  // history, and samples
+    int16_t  y[SHAPER_BLOCK + 4] __attribute__((aligned(16)));                // output
+    int32_t  plan_hist[SHAPER_HIST];  // the history preceding the samples planned
+    int32_t  plan_first;              // samples planned in the first block
+    int32_t * plan_dc;                // dc level of each block planned
+    int32_t  max_plan_dc;
+} chan_state_t;
+
+//
+// variables
+//
+
+static bool      enabled;
+static int32_t   ntaps;
+static int32_t   taps[SHAPER_MAX_TAPS];
+static int32_t   taps_sum;
+
+static chan_state_t chan_state[MAX_TOTAL_CHAN];
+
+//
+// prototypes
+//
+
+static void start(int32_t chan, uint16_t * in);
+static void track(int32_t chan, uint16_t * in, int32_t n);
+static void fir(int32_t * xh, int32_t n, int32_t dc, int16_t * out);
+
+// -----------------  PUBLIC ROUTINES  ----------------------------------
+
+// args is the filter type, followed by its parameters; an empty args
+// disables the filter
+int32_t shaper_init(char * args)
+{
+    char   value[100], desc[100];
+    double h[SHAPER_MAX_TAPS];
+    int32_t i;
+
+    if (args[0] == '\0') {
+        return 0;
+    }
+
+    if (getarg(args, "ma", value, sizeof(value))) {
+        int32_t n = (getarg(args, "n", value, sizeof(value)) ? atoi(value) : 4);
+        if (n < 1 || n > SHAPER_MAX_TAPS) {
+            ERROR("ma n must be 1 to %d\n", SHAPER_MAX_TAPS);
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            h[i] = 1. / n;
+        }
+        ntaps = n;
+        sprintf(desc, "moving average n=%d", n);
+    } else if (getarg(args, "trap", value, sizeof(value))) {
+        int32_t rise = (getarg(args, "rise", value, sizeof(value)) ? atoi(value) : 4);
+        int32_t flat = (getarg(args, "flat", value, sizeof(value)) ? atoi(value) : 2);
+        if (rise < 1 || flat < 0 || 2 * rise + flat > SHAPER_MAX_TAPS) {
+            ERROR("trap 2*rise+flat must be 2 to %d\n", SHAPER_MAX_TAPS);
+            return -1;
+        }
+        for (i = 0; i < 2 * rise + flat; i++) {
+            h[i] = (i < rise ? 1. / rise : i < rise + flat ? 0 : -1. / rise);
+        }
+        ntaps = 2 * rise + flat;
+        sprintf(desc, "trapezoidal rise=%d flat=%d", rise, flat);
+    } else if (getarg(args, "crrc", value, sizeof(value))) {
+        double tau = (getarg(args, "tau", value, sizeof(value)) ? atof(value) : 2);
+        if (tau <= 0 || 8 * tau + 1 > SHAPER_MAX_TAPS) {
+            ERROR("crrc tau must be greater than 0 and at most %.2f\n", (SHAPER_MAX_TAPS - 1) / 8.);
+            return -1;
+        }
+        // the taps are the differences of the step response, which is
+        // (t/tau) exp(1-t/tau), with a peak of 1 at t=tau
+        ntaps = 8 * tau + 1;
+        for (i = 0; i < ntaps; i++) {
+            h[i] = (i / tau) * exp(1 - i / tau) - (i == 0 ? 0 : ((i-1) / tau) * exp(1 - (i-1) / tau));
+        }
+        sprintf(desc, "CR-RC tau=%.2f", tau);
+    } else {
+        ERROR("invalid filter '%s'\n", args);
+        return -1;
+    }
+
+    // convert the taps to fixed point; the taps are reversed so that
+    // taps[0] applies to the oldest sample
+    taps_sum = 0;
+    for (i = 0; i < ntaps; i++) {
+        taps[i] = lround(h[ntaps-1-i] * (1 << SHAPER_SHIFT));
+        taps_sum += taps[i];
+    }
+
+    INFO("filter %s, %d taps\n", desc, ntaps);
+    enabled = true;
+    return 0;
+}
+
+// the samples of the channel that follow are not contiguous with those 
+// filtered so far; the filter's history is set to the dc level
+void shaper_reset(int32_t chan)
+{
+    int32_t i;
+
+    for (i = 0; i < SHAPER_HIST; i++) {
+        chan_state[chan].x[i] = (chan_state[chan].dc16 + 8) >> 4;
+    }
+}
+
+// filters the samples in, of the channel, up to the end of the current
+// SHAPER_BLOCK; returns the number of samples filtered, and the filtered samples
+// in *out. When the filter is not enabled all of the samples are returned 
+// unfiltered.
+int32_t shaper_process(int32_t chan, uint16_t * in, int32_t n, int16_t ** out)
+{
+    int32_t * x = chan_state[chan].x;
+    int64_t   count = chan_state[chan].count;
+    int32_t   i;
+
+    if (!enabled) {
+        *out = (int16_t*)in;
+        return n;
+    }
+
+    if (count == 0) {
+        start(chan, in);
+    }
+
+    // copy the samples, following the history, and filter
+    if (n > SHAPER_BLOCK - count % SHAPER_BLOCK) {
+        n = SHAPER_BLOCK - count % SHAPER_BLOCK;
+    }
+    for (i = 0; i < n; i++) {
+        x[SHAPER_HIST+i] = in[i];
+    }
+    fir(x, n, (chan_state[chan].dc16 + 8) >> 4, chan_state[chan].y);
+
+    // save the history for the next call, and track the dc level
+    memmove(x, x + n, SHAPER_HIST * sizeof(int32_t));
+    track(chan, in, n);
+
+    *out = chan_state[chan].y;
+    return n;
+}
+
+bool shaper_enabled(void)
+{
+    return enabled;
+}
+
+// advances the filter over the n samples in, of the channel, as shaper_process
+// would, without filtering them; saves the dc level of each block, and the 
+// history preceding in, for shaper_filter
+void shaper_plan(int32_t chan, uint16_t * in, int32_t n)
+{
+    chan_state_t * cs = &chan_state[chan];
+    int32_t * x = cs->x;
+    int32_t   i, m, nblk = 0;
+
+    if (cs->count == 0) {
+        start(chan, in);
+    }
+
+    if (n / SHAPER_BLOCK + 2 > cs->max_plan_dc) {
+        cs->max_plan_dc = n / SHAPER_BLOCK + 2;
+        cs->plan_dc = realloc(cs->plan_dc, cs->max_plan_dc * sizeof(int32_t));
+        if (cs->plan_dc == NULL) {
+            FATAL("realloc plan_dc failed\n");
+        }
+    }
+
+    memcpy(cs->plan_hist, x, sizeof(cs->plan_hist));
+    cs->plan_first = SHAPER_BLOCK - cs->count % SHAPER_BLOCK;
+    for (i = 0; i < n; i += m) {
+        m = (i == 0 ? cs->plan_first : SHAPER_BLOCK);
+        if (m > n - i) {
+            m = n - i;
+        }
+        cs->plan_dc[nblk++] = (cs->dc16 + 8) >> 4;
+        track(chan, in + i, m);
+    }
+
+    // the history for the samples that follow in
+    for (i = 0; i < SHAPER_HIST; i++) {
+        x[i] = (n - SHAPER_HIST + i >= 0 ? in[n - SHAPER_HIST + i] : x[n + i]);
+    }
+}
+
+// filters in[a] to in[b-1] of the samples passed to the channel's last shaper_plan,
+// to out[a] to out[b-1]; called concurrently by the pulse detector's worker threads
+void shaper_filter(int32_t chan, uint16_t * in, int32_t a, int32_t b, int16_t * out)
+{
+    chan_state_t * cs = &chan_state[chan];
+    int32_t xh[SHAPER_HIST + SHAPER_BLOCK + 4] __attribute__((aligned(16)));
+    int16_t yb[SHAPER_BLOCK + 4] __attribute__((aligned(16)));
+    int32_t blk, blk_end, i, n;
+
+    while (a < b) {
+        // the block containing in[a], and the end of the block
+        blk = (a < cs->plan_first ? 0 : 1 + (a - cs->plan_first) / SHAPER_BLOCK);
+        blk_end = cs->plan_first + blk * SHAPER_BLOCK;
+        n = (b < blk_end ? b : blk_end) - a;
+
+        // copy the history and the samples, and filter
+        for (i = 0; i < SHAPER_HIST; i++) {
+            xh[i] = (a - SHAPER_HIST + i >= 0 ? in[a - SHAPER_HIST + i] : cs->plan_hist[a + i]);
+        }
+        for (i = 0; i < n; i++) {
+            xh[SHAPER_HIST+i] = in[a+i];
+        }
+        fir(xh, n, cs->plan_dc[blk], yb);
+        memcpy(out + a, yb, n * sizeof(int16_t));
+        a += n;
+    }
+}
+
+// -----------------  PRIVATE ROUTINES  ---------------------------------
+
+// the dc level is initially the first sample
+static void start(int32_t chan, uint16_t * in)
+{
+    chan_state[chan].dc16 = in[0] << 4;
+    shaper_reset(chan);
+}
+
+// counts the samples above and below the dc level, n must not exceed the end
+// of the current block; at the end of a block, moves the dc level toward the
+// block's median
+static void track(int32_t chan, uint16_t * in, int32_t n)
+{
+    chan_state_t * cs = &chan_state[chan];
+    int32_t i, dc = (cs->dc16 + 8) >> 4;
+
+    for (i = 0; i < n; i++) {
+        cs->block_above += (in[i] > dc);
+        cs->block_below += (in[i] < dc);
+    }
+
+    cs->count += n;
+    if (cs->count % SHAPER_BLOCK == 0) {
+        cs->dc16 += SHAPER_DC_STEP * ((cs->block_above > cs->block_below) - (cs->block_below > cs->block_above));
+        cs->block_above = cs->block_below = 0;
+    }
+}
+
+// filters the n samples following the SHAPER_HIST samples of history in xh,
+// to out; out[i] is the sum of taps[j] * xh[i+j], the taps apply to the samples
+// xh[SHAPER_HIST+i-ntaps+1] to xh[SHAPER_HIST+i]; the output is limited to the 
+// range of the ADC. Up to 3 samples following n are read from xh and written
+// to out.
+static void fir(int32_t * xh, int32_t n, int32_t dc, int16_t * out)
+{
+    int32_t * xs = xh + SHAPER_HIST - ntaps + 1;
+    v4si_t    offset = (v4si_t){0} + ((1 << (SHAPER_SHIFT-1)) - dc * taps_sum);
+    v4si_t    vdc = (v4si_t){0} + dc;
+    v4si_t    vmax = (v4si_t){0} + 4095;
+    int32_t   i, j;
+
+    for (i = 0; i < n; i += 4) {
+        v4si_t acc = offset, v;
+        for (j = 0; j < ntaps; j++) {
+            memcpy(&v, xs + i + j, sizeof(v));
+            acc += taps[j] * v;
+        }
+        acc = (acc >> SHAPER_SHIFT) + vdc;
+        acc &= (acc > 0);
+        acc = (acc & (acc <= vmax)) | (vmax & (acc > vmax));
+        v4hi_t out16 = __builtin_convertvector(acc, v4hi_t);
+        memcpy(out + i, &out16, sizeof(out16));
+    }
+}
@@ -1,47 +1,60 @@
 #include <common.h>
 
-//#define MCCDAQ_TEST
+#include <poll.h>
+#include <sys/eventfd.h>
 
-#ifndef MCCDAQ_TEST
+// build with NO_USB defined to run without the MCC-USB-204, and without the
+// mccdaq and libusb libraries; only the sources in mccdaq_src.c are available
+#ifndef NO_USB
 #include <libusb/pmd.h>
 #include <libusb/usb-20X.h>
-#else
-// from libusb ...
-enum libusb_error { 
-  LIBUSB_SUCCESS = 0, LIBUSB_ERROR_IO = -1, LIBUSB_ERROR_INVALID_PARAM = -2, LIBUSB_ERROR_ACCESS = -3, 
-  LIBUSB_ERROR_NO_DEVICE = -4, LIBUSB_ERROR_NOT_FOUND = -5, LIBUSB_ERROR_BUSY = -6, LIBUSB_ERROR_TIMEOUT = -7, 
-  LIBUSB_ERROR_OVERFLOW = -8, LIBUSB_ERROR_PIPE = -9, LIBUSB_ERROR_INTERRUPTED = -10, LIBUSB_ERROR_NO_MEM = -11, 
-  LIBUSB_ERROR_NOT_SUPPORTED = -12, LIBUSB_ERROR_OTHER = -99 };
-enum libusb_endpoint_direction { LIBUSB_ENDPOINT_IN = 0x80, LIBUSB_ENDPOINT_OUT = 0x00 };
-typedef struct libusb_device_handle libusb_device_handle;
-int libusb_init (void ** cx);
-int libusb_bulk_transfer (struct libusb_device_handle *dev_handle, unsigned char endpoint, 
-       unsigned char *data, int length, int *transferred, unsigned int timeout);
-int libusb_clear_halt (libusb_device_handle *dev, unsigned char endpoint);
-// from mccdaq library ...
-#define NCHAN_USB20X      8  // max number of A/D channels in the device
-#define USB204_PID   (0x0114)
-#define AIN_SCAN_RUNNING   (0x1 << 1)
-#define AIN_SCAN_OVERRUN   (0x1 << 2)
-libusb_device_handle* usb_device_find_USB_MCC(int productId, char *serialID);
-int usb_get_max_packet_size(libusb_device_handle* udev, int endpointNum);
-void usbCalDate_USB20X(libusb_device_handle *udev, struct tm *date);
-void usbBuildGainTable_USB20X(libusb_device_handle *udev, float table[NCHAN_USB20X][2]);
-void cleanup_USB20X(libusb_device_handle *udev);
-void usbAInScanStart_USB20X(libusb_device_handle *udev, uint32_t count, double frequency, 
-        uint8_t channels, uint8_t options, uint8_t trigger_source, uint8_t trigger_mode);
-uint16_t usbStatus_USB20X(libusb_device_handle *udev);
-void usbAInScanStop_USB20X(libusb_device_handle *udev);
-void usbAInScanClearFIFO_USB20X(libusb_device_handle *udev);
 #endif
 
+// There may be up to MAX_DEV devices, each is added by a call to mccdaq_init,
+// and has its own source, ring, and producer and consumer threads; the
+// consumer thread passes the device number to the callback. So each device
+// is acquired and analyzed independently, and one slow device does not hold
+// back the others. The usb devices are selected by serial number, and each
+// has its own libusb context, so that a device's transfers complete in its
+// own producer thread. The threads' cpus and scheduling are set by rt.c.
+//
+// To tune the real-time scheduling, each device keeps jitter statistics of
+// - the commit gap: the interval between the producer's commits to the ring, 
+//   which for the usb source are the bulk transfer completions; a gap longer
+//   than the device's fifo holds causes a restart
+// - the wakeup latency: from the producer's most recent commit to the 
+//   consumer thread's return from poll, when the consumer was waiting
+// The maximums of each second are logged with -v0, and the histograms when
+// the program exits.
+
 //
 // defines
 //
 
-#define CHANNEL    0
-#define FREQUENCY  499999         // samples per second
+// the sizes of the ring, of the callback's data, and of the usb transfers are
+// multiples of MAX_CHAN samples; and so are the samples that the sources add to
+// the ring, and the samples lost; so the ring and the callback's data always 
+// contain whole frames, of num_chan samples, starting with channel 0
 #define MAX_DATA   (20*500000)    // 20 secs of data
+#define MAX_CB_DATA  (1 << 20)    // max samples passed to the callback per call
+
+#define MAX_XFER          32      // max number of usb bulk transfers in flight
+#define DEFAULT_NUM_XFER  8
+#define XFER_LENGTH       16384   // bytes, must be a multiple of usb_max_packet_size
+#define XFER_ALIGN        32      // samples, the number of samples in a usb packet
+#define TOUT_MS           2000
+#define MAX_RESTART_FAIL  50      // max consecutive restarts that receive no samples
+#define MAX_SERIAL        64
+
+// the producer may write up to this number of samples beyond produced before
+// committing them; for example the usb transfers in flight
+#define RING_WRITE_AHEAD  (MAX_XFER*XFER_LENGTH/2)
+
+// the losses are recorded at their position in the ring, refer to mccdaq_ring_lost;
+// a reader searches the most recent MAX_LOST/2 records, so that the producer
+// can add records while the reader searches
+#define MAX_LOST          4096
+#define OPTIONS           0
 
 #define STATE_CHANGE(new_state) \
     do { \
@@ -55,26 +68,94 @@ void usbAInScanClearFIFO_USB20X(libusb_device_handle *udev);
     (x) == STOPPING         ? "STOPPING"          \
                             : "????")
 
+// each device's data circular buffer is a single-producer / single-consumer ring;
+// produced is written only by the producer thread, and consumed only by
+// the consumer thread; the release store of either counter makes the ring
+// data that it covers visible to the other thread's acquire load
+#define RING_LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RING_STORE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
 //
 // typedefs
 //
 
 enum state { NOT_INITIALIZED, STOPPED, RUNNING, STOPPING };
 
+typedef struct mccdaq_dev_s mccdaq_dev_t;
+
+#ifndef NO_USB
+typedef struct {
+    struct libusb_transfer * t;
+    mccdaq_dev_t           * d;
+    uint64_t                 pos;         // offset of this transfer's data, in samples
+    bool                     in_flight;
+    bool                     discard;     // ring is full, data read to discard_buff
+} xfer_t;
+#endif
+
+typedef struct {
+    uint64_t pos;      // ring position that the samples were lost before
+    uint64_t total;    // total samples lost, before pos
+} lost_t;
+
+struct mccdaq_dev_s {
+    int32_t                dev;
+    mccdaq_source_t      * source;
+    uint16_t             * data;
+    uint64_t               produced;
+    uint64_t               consumed;
+    int                    efd;
+    uint64_t               ring_high_water;
+    uint64_t               lost_samples;     // applied by the consumer, read by the callback
+    lost_t                 lost_rec[MAX_LOST];
+    uint64_t               lost_recs;        // number of records added to lost_rec
+    uint64_t               lost_total;       // producer only
+    uint64_t               lost_pending;     // producer only, lost since the last commit
+    bool                   producer_thread_running;
+    bool                   consumer_thread_running;
+    pthread_t              producer_thread_id;
+    pthread_t              consumer_thread_id;
+    int32_t                restart_count;
+    time_t                 sample_clock_start;
+    bool                   realtime_clock;   // anchored to the time of day, refer to anchor_sample_clock
+    uint64_t               last_commit_us;   // producer only
+    uint64_t               commit_us;        // read by the consumer
+    jitter_t               commit_gap;
+    jitter_t               wakeup;
+
+#ifndef NO_USB
+    char                   serial[MAX_SERIAL];
+    libusb_context       * ctx;
+    libusb_device_handle * udev;
+    float                  cal_tbl[NCHAN_USB20X][2];
+    int32_t                usb_max_packet_size;
+    bool                   ring_full;
+    uint16_t               discard_buff[XFER_LENGTH/2];
+    uint64_t               scan_start_us;
+    uint64_t               scan_start_received;
+    uint64_t               received;
+    uint64_t               restart_received;
+    int32_t                restart_fail;
+    xfer_t                 xfer[MAX_XFER];
+    int32_t                xfer_in_flight;
+    bool                   xfer_error;
+    uint64_t               submit_pos;
+#endif
+};
+
 //
 // variables
 //
 
-static libusb_device_handle * g_udev;
-static float                  g_cal_tbl[NCHAN_USB20X][2];
-static uint16_t             * g_data;
-static uint64_t               g_produced;
+static mccdaq_dev_t           g_dev[MAX_DEV];
+static int32_t                g_num_dev;
 static mccdaq_callback_t      g_cb;
 static enum state             g_state;
-static bool                   g_producer_thread_running;
-static bool                   g_consumer_thread_running;
-static int32_t                g_restart_count;
-static int32_t                g_usb_max_packet_size;
+static int32_t                g_num_chan;
+
+#ifndef NO_USB
+static int32_t                g_num_xfer;
+#endif
 
 //
 // protoytpes
@@ -83,68 +164,153 @@ static int32_t                g_usb_max_packet_size;
 static void mccdaq_exit(void);
 static void * mccdaq_producer_thread(void * cx);
 static void * mccdaq_consumer_thread(void * cx);
+static void ring_wakeup_consumer(mccdaq_dev_t * d);
+static void anchor_sample_clock(mccdaq_dev_t * d);
+
+#ifndef NO_USB
+static int32_t usb_init(int32_t dev, char * args);
+static void usb_run(int32_t dev);
+static void usb_exit(int32_t dev);
+static libusb_device_handle * usb_open(mccdaq_dev_t * d);
+static void xfer_submit(xfer_t * x);
+static void xfer_callback(struct libusb_transfer * t);
+static void xfer_restart(mccdaq_dev_t * d);
+
+static mccdaq_source_t mccdaq_source_usb = { "usb", usb_init, usb_run, usb_exit };
+#endif
+
+//
+// sources
+//
+
+static mccdaq_source_t * g_source_tbl[] = {
+#ifndef NO_USB
+            &mccdaq_source_usb,
+#endif
+            &mccdaq_source_sim,
+            &mccdaq_source_file,
+            &mccdaq_source_synth,
+                };
+
+#define MAX_SOURCE_TBL (sizeof(g_source_tbl)/sizeof(g_source_tbl[0]))
 
 // -----------------  PUBLIC ROUTINES  ----------------------------------
 
-int32_t mccdaq_init(void)
+// adds a device, and returns its device number, or -1 on error;
+// source_spec is "<name>[:<args>]", where name selects an entry in g_source_tbl,
+// and args are passed to the source's init routine; num_chan is the number of
+// ADC channels that are sampled, channels 0 to num_chan-1, 0 selects 1 channel;
+// all of the devices have the num_chan of the first
+int32_t mccdaq_init(char *source_spec, int32_t num_xfer, int32_t num_chan)
 {
-    int32_t   ret;
+    char           name[100], *args;
+    int32_t        i;
+    mccdaq_dev_t * d;
 
-    // init usb library
-    ret = libusb_init(NULL);
-    if (ret != LIBUSB_SUCCESS) {
-        ERROR("libusb_init ret %d\n", ret);
+    // if all of the devices are in use then return error
+    if (g_num_dev == MAX_DEV) {
+        ERROR("at most %d devices\n", MAX_DEV);
         return -1;
     }
-
-    // find the MCC-USB-204 usb device
-    g_udev = usb_device_find_USB_MCC(USB204_PID, NULL);
-    if (!g_udev) {
-        ERROR("MCC-USB-204 not found\n");
+    d = &g_dev[g_num_dev];
+    d->dev = g_num_dev;
+
+    // parse the source_spec, and find the source
+    strncpy(name, source_spec, sizeof(name)-1);
+    name[sizeof(name)-1] = '\0';
+    args = strchr(name, ':');
+    if (args) {
+        *args++ = '\0';
+    } else {
+        args = "";
+    }
+    for (i = 0; i < MAX_SOURCE_TBL; i++) {
+        if (strcmp(name, g_source_tbl[i]->name) == 0) {
+            break;
+        }
+    }
+    if (i == MAX_SOURCE_TBL) {
+        ERROR("source '%s' not found\n", name);
         return -1;
     }
+    d->source = g_source_tbl[i];
+    INFO("dev %d: source = %s, args = '%s'\n", d->dev, d->source->name, args);
 
-    // print the usb packet size, should be 64 
-    g_usb_max_packet_size = usb_get_max_packet_size(g_udev,0);
-    INFO("usb_max_packet_size = %d\n", g_usb_max_packet_size);
-    if (g_usb_max_packet_size != 64) {
-        ERROR("usb_max_packet_size = %d\n", g_usb_max_packet_size);
+    // validate num_chan; a source may change it, such as the file
+    // source replaying a capture file
+    if (d->dev == 0 && mccdaq_set_num_chan(num_chan ? num_chan : 1) < 0) {
         return -1;
     }
 
-    // get the calibration date, and print
-    struct tm calDate;
-    usbCalDate_USB20X(g_udev, &calDate);
-    INFO("MFG Calibration date = %s", asctime(&calDate));
-
-    // get the calibration table, and print channel 0 values
-    int32_t idx = 0;
-    usbBuildGainTable_USB20X(g_udev, g_cal_tbl);
-    INFO("Calibration Table %d: Slope=%f  Offset=%f\n", 
-         idx, g_cal_tbl[idx][0], g_cal_tbl[idx][1]);
+#ifndef NO_USB
+    // validate num_xfer, which is the number of usb bulk transfers that
+    // are kept in flight by the usb source; 0 selects the default
+    if (num_xfer == 0) {
+        num_xfer = DEFAULT_NUM_XFER;
+    }
+    if (num_xfer < 1 || num_xfer > MAX_XFER) {
+        ERROR("num_xfer %d out of range 1..%d\n", num_xfer, MAX_XFER);
+        return -1;
+    }
+    g_num_xfer = num_xfer;
+#endif
 
     // allocate memory for producer
-    g_data = calloc(MAX_DATA, sizeof(uint16_t));
-    if (g_data == NULL) {
+    d->data = calloc(MAX_DATA, sizeof(uint16_t));
+    if (d->data == NULL) {
         ERROR("calloc size %zd", MAX_DATA*sizeof(uint16_t));
         return -1;
     }
-    g_produced = 0;
+    d->produced = 0;
+    d->consumed = 0;
 
-    // set state to stopped
-    STATE_CHANGE(STOPPED);
+    // create the eventfd, used by the producer to wakeup the consumer
+    d->efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (d->efd < 0) {
+        ERROR("eventfd, %s\n", strerror(errno));
+        return -1;
+    }
 
-    // register exit handler
-    atexit(mccdaq_exit);
+    // init the source
+    if (d->source->init(d->dev, args) < 0) {
+        ERROR("source %s init failed\n", d->source->name);
+        return -1;
+    }
 
-    // return success
-    INFO("success\n");
-    return 0;
+    // the seconds are cut by counting the samples from the sample clock's start
+    // time; a source that does not set the sample clock acquires in real time,
+    // and its sample clock starts now, and is anchored to the time of day when
+    // the source starts, refer to anchor_sample_clock. The seconds of the devices
+    // must be aligned; so either all of the devices are real time or none are,
+    // and all start at the first device's start time
+    d->realtime_clock = (d->sample_clock_start == 0);
+    if (d->dev == 0) {
+        if (d->realtime_clock) {
+            d->sample_clock_start = time(NULL);
+        }
+    } else {
+        if (d->realtime_clock != g_dev[0].realtime_clock) {
+            ERROR("the sources of the devices must all use the sample clock, or none\n");
+            return -1;
+        }
+        d->sample_clock_start = g_dev[0].sample_clock_start;
+    }
+
+    // on the first device, set state to stopped, and register exit handler
+    if (d->dev == 0) {
+        STATE_CHANGE(STOPPED);
+        atexit(mccdaq_exit);
+    }
+    g_num_dev++;
+
+    // return the device number
+    INFO("success, dev %d\n", d->dev);
+    return d->dev;
 }
 
 int32_t  mccdaq_start(mccdaq_callback_t cb)
 {
-    pthread_t thread;
+    mccdaq_dev_t * d;
 
     // if not initialized then return error
     if (g_state == NOT_INITIALIZED) {
@@ -160,8 +326,10 @@ int32_t  mccdaq_start(mccdaq_callback_t cb)
 
     // if stopping then wait for threads to stop
     if (g_state == STOPPING) {
-        while (g_producer_thread_running || g_consumer_thread_running) {
-            usleep(1000);
+        for (d = g_dev; d < g_dev + g_num_dev; d++) {
+            while (d->producer_thread_running || d->consumer_thread_running) {
+                usleep(1000);
+            }
         }
         STATE_CHANGE(STOPPED);
     }
@@ -172,8 +340,16 @@ int32_t  mccdaq_start(mccdaq_callback_t cb)
     }
 
     // clear data
-    memset(g_data, -1, MAX_DATA*sizeof(uint16_t));
-    g_produced = 0;
+    for (d = g_dev; d < g_dev + g_num_dev; d++) {
+        memset(d->data, -1, MAX_DATA*sizeof(uint16_t));
+        d->produced = 0;
+        d->consumed = 0;
+        d->ring_high_water = 0;
+        d->last_commit_us = 0;
+        d->lost_recs = 0;
+        d->lost_total = 0;
+        d->lost_pending = 0;
+    }
 
     // store callback
     g_cb = cb;
@@ -181,12 +357,14 @@ int32_t  mccdaq_start(mccdaq_callback_t cb)
     // set state
     STATE_CHANGE(RUNNING);
 
-    // create threads
-    if (pthread_create(&thread, NULL, mccdaq_producer_thread, NULL) != 0) {
-        FATAL("pthread_create mccdaq_producer_thread, %s\n", strerror(errno));
-    }
-    if (pthread_create(&thread, NULL, mccdaq_consumer_thread, NULL) != 0) {
-        FATAL("pthread_create mccdaq_consumer_thread, %s\n", strerror(errno));
+    // create the threads of each device
+    for (d = g_dev; d < g_dev + g_num_dev; d++) {
+        if (pthread_create(&d->producer_thread_id, NULL, mccdaq_producer_thread, d) != 0) {
+            FATAL("pthread_create mccdaq_producer_thread, %s\n", strerror(errno));
+        }
+        if (pthread_create(&d->consumer_thread_id, NULL, mccdaq_consumer_thread, d) != 0) {
+            FATAL("pthread_create mccdaq_consumer_thread, %s\n", strerror(errno));
+        }
     }
 
     // return success
@@ -195,6 +373,7 @@ int32_t  mccdaq_start(mccdaq_callback_t cb)
 
 int32_t mccdaq_stop(void)
 {
+    mccdaq_dev_t * d;
     int cnt=0;
 
     // if not initialized then return error
@@ -203,16 +382,21 @@ int32_t mccdaq_stop(void)
         return -1;
     }
 
-    // set state to STOPPING
+    // set state to STOPPING, and wakeup the consumer threads
     STATE_CHANGE(STOPPING);
+    for (d = g_dev; d < g_dev + g_num_dev; d++) {
+        ring_wakeup_consumer(d);
+    }
 
     // wait for threads to be not running
-    while (g_producer_thread_running || g_consumer_thread_running) {
-        usleep(1000);
-        if (++cnt > 2000) {
-            if (g_producer_thread_running) ERROR("producer_thread failed to stop\n");
-            if (g_consumer_thread_running) ERROR("consumer_thread failed to stop\n");
-            break;
+    for (d = g_dev; d < g_dev + g_num_dev; d++) {
+        while (d->producer_thread_running || d->consumer_thread_running) {
+            usleep(1000);
+            if (++cnt > 2000) {
+                if (d->producer_thread_running) ERROR("dev %d producer_thread failed to stop\n", d->dev);
+                if (d->consumer_thread_running) ERROR("dev %d consumer_thread failed to stop\n", d->dev);
+                break;
+            }
         }
     }
 
@@ -223,150 +407,322 @@ int32_t mccdaq_stop(void)
     return 0;
 }
 
-int32_t mccdaq_get_restart_count(void) 
+// returns the number of devices added by mccdaq_init
+int32_t mccdaq_get_num_dev(void)
 {
-    int32_t val = g_restart_count;
-    g_restart_count = 0;
+    return g_num_dev;
+}
+
+int32_t mccdaq_get_restart_count(int32_t dev)
+{
+    int32_t val = g_dev[dev].restart_count;
+    g_dev[dev].restart_count = 0;
     return val;
 }
 
-// -----------------  MCCDAQ EXIT HANDLER -------------------------------
+// returns the number of samples lost since the last call; samples are lost
+// when the scan is restarted, and when the ring is full
+int32_t mccdaq_get_lost_samples(int32_t dev)
+{
+    return __atomic_exchange_n(&g_dev[dev].lost_samples, 0, __ATOMIC_RELAXED);
+}
 
-static void mccdaq_exit(void)
+// returns the sample clock's start time, which is the time of sample 
+// position 0; refer to mccdaq_set_sample_clock
+time_t mccdaq_get_sample_clock(int32_t dev)
 {
-    // stop, and call cleanup 
-    mccdaq_stop();
-    cleanup_USB20X(g_udev);
+    return g_dev[dev].sample_clock_start;
 }
 
-// -----------------  MCCDAQ PRODUCER THREAD-----------------------------
+// returns the number of ADC channels of each device, whose samples are
+// interleaved in the ring
+int32_t mccdaq_get_num_chan(void)
+{
+    return g_num_chan;
+}
 
-static void * mccdaq_producer_thread(void * cx) 
+// returns the maximum number of samples that the consumer was behind the
+// producer, since the last call
+int32_t mccdaq_get_ring_high_water(int32_t dev)
 {
-    #define OPTIONS     0
-    #define MAX_LENGTH  20000
-    #define TOUT_MS     2000
+    return __atomic_exchange_n(&g_dev[dev].ring_high_water, 0, __ATOMIC_RELAXED);
+}
 
-    int32_t    ret, status;
-    int32_t    length_avail, length, transferred_bytes;
-    uint16_t * data = g_data;
+// returns the maximum commit gap and consumer wakeup latency, in microseconds,
+// since the last call
+void mccdaq_get_jitter(int32_t dev, int32_t * gap_max_us, int32_t * wakeup_max_us)
+{
+    *gap_max_us = jitter_interval_max(&g_dev[dev].commit_gap);
+    *wakeup_max_us = jitter_interval_max(&g_dev[dev].wakeup);
+}
+
+// -----------------  ROUTINES FOR SOURCES  -----------------------------
 
-    g_producer_thread_running = true;
+// the source's run routine should return when this returns true
+bool mccdaq_stopping(void)
+{
+    return g_state == STOPPING;
+}
 
-#if 0  // note - this did not seem to lessen the mccdaq restarts
-    // set realtime priority
-    struct sched_param param;
-    int rc;
-    memset(&param, 0, sizeof(param));
-    param.sched_priority = 80;
-    rc = sched_setscheduler(0, SCHED_FIFO, &param);
-    if (rc < 0) {
-        ERROR("sched_setscheduler, %s\n", strerror(errno));
+// returns a pointer to the ring's free space, and the number of samples of free
+// space that is contiguous; this is 0 when the ring is full
+uint16_t * mccdaq_ring_space(int32_t dev, int32_t * max_samples)
+{
+    mccdaq_dev_t * d = &g_dev[dev];
+    uint64_t avail = MAX_DATA - (d->produced - RING_LOAD(&d->consumed));
+    int32_t  offset = d->produced % MAX_DATA;
+
+    *max_samples = (avail < MAX_DATA - offset ? avail : MAX_DATA - offset);
+    return d->data + offset;
+}
+
+// makes samples, that the source has written to the ring space, available to
+// the consumer thread
+void mccdaq_ring_commit(int32_t dev, int32_t samples)
+{
+    mccdaq_dev_t * d = &g_dev[dev];
+    uint64_t produced, behind, now_us;
+
+    now_us = microsec_timer();
+    if (d->last_commit_us) {
+        jitter_add(&d->commit_gap, now_us - d->last_commit_us);
+    }
+    d->last_commit_us = now_us;
+    __atomic_store_n(&d->commit_us, now_us, __ATOMIC_RELAXED);
+
+    // record the samples lost since the last commit, at the position that
+    // they precede; the release store of lost_recs makes the record visible
+    if (d->lost_pending) {
+        lost_t * r = &d->lost_rec[d->lost_recs % MAX_LOST];
+        d->lost_total += d->lost_pending;
+        d->lost_pending = 0;
+        r->pos = d->produced;
+        r->total = d->lost_total;
+        RING_STORE(&d->lost_recs, d->lost_recs + 1);
     }
-#endif
 
-    // start the analog input scan
-    usbAInScanStart_USB20X(g_udev, 0, FREQUENCY, 1<<CHANNEL, OPTIONS, 0, 0);
+    produced = d->produced + samples;
+    RING_STORE(&d->produced, produced);
+    ring_wakeup_consumer(d);
 
-    // note that the code in the following loop is copied from the
-    // usbAInScanRead_USB20X routine in mccdaq/mcc-libusb/usb-20X.c;
-    // this is done because the usbAInScanRead_USB20X routine does not
-    // return error status; also the usbAInScanRead_USB20X routine does
-    // not return the actual number of scans transferred
+    behind = produced - RING_LOAD(&d->consumed);
+    if (behind > __atomic_load_n(&d->ring_high_water, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&d->ring_high_water, behind, __ATOMIC_RELAXED);
+    }
+}
 
-    // loop, performing usb buld transfers
-    while (true) {
-        // if state is STOPPING then
-        //   exit thread
-        // endif
-        if (g_state == STOPPING) {
-            break;
-        }
+// adds to the count of samples lost, such as when the ring is full; the loss
+// is recorded at the ring position of the next commit, and the consumer 
+// accounts for it when it reaches that position, so the sample clock counts 
+// the lost samples in their place in the sequence of samples. This is called 
+// from the usb source's libusb callbacks, so it must not block; the software
+// sources wait for the consumer to catch up, which paces them like the ADC.
+void mccdaq_ring_lost(int32_t dev, int32_t samples)
+{
+    mccdaq_dev_t * d = &g_dev[dev];
+    bool           drain = (d->sample_clock_start != 0);
 
-        // determine number of bytes to request in call to libusb_bulk_transfer;
-        // this is normally MAX_LENGTH, but will be less when the data pointer nears
-        // the end of the g_data buffer
-        length_avail = (g_data + MAX_DATA - data) * sizeof(uint16_t);
-        length = (length_avail >= MAX_LENGTH ? MAX_LENGTH : length_avail);
-
-        // transfer analog data from mcc usb 204 device to data buffer
-        ret = libusb_bulk_transfer(g_udev, 
-                                   LIBUSB_ENDPOINT_IN|1, 
-                                   (uint8_t*)data,
-                                   length, 
-                                   &transferred_bytes, 
-                                   TOUT_MS);
-        status = usbStatus_USB20X(g_udev);
-        VERBOSE2("ret=%d length=%d transferred_byts=%d status=%d\n", 
-              ret, length, transferred_bytes, status);
-
-        // print warning if transferred_bytes is odd
-        if (transferred_bytes & 1) {
-            WARN("transferred_bytes = %d\n", transferred_bytes);    
+#ifndef NO_USB
+    drain = drain && d->source != &mccdaq_source_usb;
+#endif
+    if (drain) {
+        while (RING_LOAD(&d->consumed) != d->produced && !mccdaq_stopping()) {
+            usleep(1000);
         }
+    }
+    d->lost_pending += samples;
+}
 
-        // if length is a multiple of usb_max_packet_size the device will send a zero byte packet.
-        // refer to usbAInScanRead_USB20X routine in mccdaq/mcc-libusb/usb-20X.c
-        if (((length % g_usb_max_packet_size) == 0) && !(status & AIN_SCAN_RUNNING)) {
-            uint8_t value[64];
-            int32_t xfered;
-            libusb_bulk_transfer(g_udev, 
-                                 LIBUSB_ENDPOINT_IN|1, 
-                                 value, 
-                                 2, 
-                                 &xfered, 
-                                 100);
-        }
+// called by a source's init routine when the time of a sample is determined
+// by counting samples, at CHAN_FREQUENCY per second per channel, from start_time;
+// rather than from the time of day when the source starts. This is used by 
+// sources that produce samples faster or slower than real time, such as replay
+// of a capture file. With either, the pulse_counts published for each second
+// are independent of how the samples were split among the callbacks.
+void mccdaq_set_sample_clock(int32_t dev, time_t start_time)
+{
+    g_dev[dev].sample_clock_start = start_time;
+}
 
-        // if error has occurred then
-        //   restart the analog input scan, and
-        //   keep track of number of resets
-        // endif
-        if ((ret == LIBUSB_ERROR_PIPE) || !(status & AIN_SCAN_RUNNING) || ret != 0) {
-            if (ret != LIBUSB_ERROR_PIPE && ret != 0) {
-                WARN("restarting, ret==%d status=0x%x\n", ret, status);
-            } else {
-                VERBOSE2("restarting, ret==%d status=0x%x\n", ret, status); 
-            }
+// sets the number of ADC channels; called by mccdaq_init, and by a source's
+// init routine when the source determines the number of channels; once the
+// first device has been added the num_chan can not be changed
+int32_t mccdaq_set_num_chan(int32_t num_chan)
+{
+    if (num_chan != 1 && num_chan != 2 && num_chan != 4 && num_chan != MAX_CHAN) {
+        ERROR("num_chan %d must be 1, 2, 4 or %d\n", num_chan, MAX_CHAN);
+        return -1;
+    }
+    if (g_num_dev > 0 && num_chan != g_num_chan) {
+        ERROR("num_chan %d differs from the first device's %d\n", num_chan, g_num_chan);
+        return -1;
+    }
+    if (num_chan != g_num_chan) {
+        INFO("num_chan = %d, %d samples per second per channel\n", num_chan, CHAN_FREQUENCY(num_chan));
+    }
+    g_num_chan = num_chan;
+    return 0;
+}
 
-            libusb_clear_halt(g_udev, LIBUSB_ENDPOINT_IN|1);
-            usbAInScanStart_USB20X(g_udev, 0, FREQUENCY, 1<<CHANNEL, OPTIONS, 0, 0);
+// -----------------  ROUTINES FOR RING READERS  ------------------------
 
-            __sync_fetch_and_add(&g_restart_count, 1);
-        }
+// These allow a thread, other than the consumer, to read the ring's data;
+// for example the capture writer thread. Such a reader does not hold back 
+// the producer, so after reading it must check that the data it read had
+// not been overwritten, using mccdaq_ring_overwritten.
+
+uint64_t mccdaq_ring_produced(int32_t dev)
+{
+    return RING_LOAD(&g_dev[dev].produced);
+}
 
-        // make data available to consumer thread
-        __sync_fetch_and_add(&g_produced, transferred_bytes / 2);
+uint64_t mccdaq_ring_consumed(int32_t dev)
+{
+    return RING_LOAD(&g_dev[dev].consumed);
+}
 
-        // update data pointer to prepare for next call to libusb_bulk_transfer
-        data += transferred_bytes / 2;
-        if (data > g_data + MAX_DATA) {
-            FATAL("data out of range, %zd\n", data-g_data);
+// returns a pointer to the data at pos, and the number of samples that are
+// contiguous and have been produced
+uint16_t * mccdaq_ring_data(int32_t dev, uint64_t pos, int32_t * max_samples)
+{
+    mccdaq_dev_t * d = &g_dev[dev];
+    uint64_t avail = RING_LOAD(&d->produced) - pos;
+    int32_t  offset = pos % MAX_DATA;
+
+    *max_samples = (avail < MAX_DATA - offset ? avail : MAX_DATA - offset);
+    return d->data + offset;
+}
+
+// returns the total samples lost before ring position pos, and in next the 
+// position of the next loss after pos, or UINT64_MAX if none has been recorded;
+// returns -1 if the records for pos are no longer available, because the reader
+// is too far behind, in which case next is the oldest record's position
+int64_t mccdaq_ring_lost_before(int32_t dev, uint64_t pos, uint64_t * next)
+{
+    mccdaq_dev_t * d = &g_dev[dev];
+    uint64_t       n, first, lo, hi, mid;
+    int64_t        total;
+
+    // binary search the records for the first whose pos is after pos
+    n = RING_LOAD(&d->lost_recs);
+    first = (n > MAX_LOST/2 ? n - MAX_LOST/2 : 0);
+    lo = first;
+    hi = n;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (d->lost_rec[mid % MAX_LOST].pos <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        if (data == g_data + MAX_DATA) {
-            VERBOSE2("resetting data to begining of circular buffer\n");
-            data = g_data;
+    }
+    *next = (lo < n ? d->lost_rec[lo % MAX_LOST].pos : UINT64_MAX);
+    total = (lo > first ? (int64_t)d->lost_rec[(lo-1) % MAX_LOST].total :
+             first == 0 ? 0 : -1);
+
+    // if the producer overwrote the records while they were read then 
+    // they are no longer available
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (RING_LOAD(&d->lost_recs) > first + MAX_LOST) {
+        *next = pos;
+        return -1;
+    }
+    return total;
+}
+
+// returns true if the data at pos may have been overwritten by the producer
+bool mccdaq_ring_overwritten(int32_t dev, uint64_t pos)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return RING_LOAD(&g_dev[dev].produced) + RING_WRITE_AHEAD - pos > MAX_DATA;
+}
+
+// -----------------  MCCDAQ EXIT HANDLER -------------------------------
+
+static void mccdaq_exit(void)
+{
+    mccdaq_dev_t * d;
+    char           name[100];
+
+    // stop, and call the sources' exit routines
+    mccdaq_stop();
+    for (d = g_dev; d < g_dev + g_num_dev; d++) {
+        if (d->source->exit) {
+            d->source->exit(d->dev);
         }
     }
 
-    // stop the scan
-    usbAInScanStop_USB20X(g_udev);
-    usbAInScanClearFIFO_USB20X(g_udev);
+    // log the jitter statistics
+    for (d = g_dev; d < g_dev + g_num_dev; d++) {
+        sprintf(name, "dev %d commit gap", d->dev);
+        jitter_log(name, &d->commit_gap);
+        sprintf(name, "dev %d consumer wakeup", d->dev);
+        jitter_log(name, &d->wakeup);
+    }
+}
+
+// -----------------  MCCDAQ PRODUCER THREAD-----------------------------
 
-    g_producer_thread_running = false;
+static void * mccdaq_producer_thread(void * cx)
+{
+    mccdaq_dev_t * d = cx;
+    char           name[16];
+
+    d->producer_thread_running = true;
+
+    sprintf(name, "producer%d", d->dev);
+    rt_thread(name, RT_PRODUCER, d->dev);
+
+    if (d->realtime_clock) {
+        anchor_sample_clock(d);
+    }
+
+    // the source's run routine adds samples to the device's ring, until
+    // mccdaq_stopping returns true
+    d->source->run(d->dev);
+
+    d->producer_thread_running = false;
     return NULL;
 }
 
+// A real time source's samples are counted from the sample clock's start 
+// time, which is a whole second; the samples that the ADC would have acquired
+// from then until the source starts are lost. This anchors the count of the 
+// samples, and so the seconds, to CLOCK_REALTIME, once. From then on the 
+// seconds are cut by counting the samples acquired and lost, without reading
+// the time of day; the usb source counts the samples lost by a restart from
+// the time elapsed, so the count keeps in step with the time.
+static void anchor_sample_clock(mccdaq_dev_t * d)
+{
+    struct timespec ts;
+    int64_t         frames;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    frames = (int64_t)(ts.tv_sec - d->sample_clock_start) * CHAN_FREQUENCY(g_num_chan) +
+             (int64_t)ts.tv_nsec * CHAN_FREQUENCY(g_num_chan) / 1000000000;
+    INFO("dev %d sample clock anchored, %lld samples lost before the start\n",
+         d->dev, (long long)frames * g_num_chan);
+    if (frames > 0) {
+        mccdaq_ring_lost(d->dev, frames * g_num_chan);
+    }
+}
+
 // -----------------  MCCDAQ CONSUMER THREAD-----------------------------
 
-static void * mccdaq_consumer_thread(void * cx) 
+static void * mccdaq_consumer_thread(void * cx)
 {
-    int64_t    consumed = 0;
-    int64_t    produced;
-    int64_t    count, max_count;
+    mccdaq_dev_t * d = cx;
+    uint64_t   consumed = 0;
+    uint64_t   produced, next;
+    int64_t    count, max_count, lost, applied = 0;
+    bool       lost_warned = false;
     uint16_t * data;
+    char       name[16];
+
+    d->consumer_thread_running = true;
 
-    g_consumer_thread_running = true;
+    sprintf(name, "consumer%d", d->dev);
+    rt_thread(name, RT_CONSUMER, d->dev);
 
     while (true) {
         // if state is STOPPING then
@@ -376,162 +732,487 @@ static void * mccdaq_consumer_thread(void * cx)
             break;
         }
 
-        // if no data then delay 
-        produced = g_produced;
-        if (produced == consumed) {
-            usleep(1000);
-            continue;
+        // apply the samples lost before the consumed position, for the 
+        // callback to read with mccdaq_get_lost_samples; and stop this 
+        // pass at the position of the next loss
+        lost = mccdaq_ring_lost_before(d->dev, consumed, &next);
+        if (lost < 0) {
+            if (!lost_warned) {
+                WARN("dev %d lost sample records overwritten, losses are counted late\n", d->dev);
+                lost_warned = true;
+            }
+        } else if (lost > applied) {
+            __atomic_fetch_add(&d->lost_samples, lost - applied, __ATOMIC_RELAXED);
+            applied = lost;
         }
 
-        // if too far behind then discard data
-        if (produced - consumed > 500000) {
-            INFO("falling behind, discarding %d samples\n", (int)(produced-consumed));
-            consumed = produced;
+        // if no data then wait for the producer to wakeup this thread;
+        // the timeout is so that STOPPING state will be noticed; when woken
+        // by a commit, keep track of the wakeup latency; the eventfd is 
+        // non-blocking, so the read returns EAGAIN if the wakeup has already
+        // been read
+        produced = RING_LOAD(&d->produced);
+        if (produced == consumed) {
+            struct pollfd pfd = { d->efd, POLLIN, 0 };
+            uint64_t val;
+            if (poll(&pfd, 1, 100) > 0) {
+                if (read(d->efd, &val, sizeof(val)) < 0 && errno != EAGAIN && errno != EINTR) {
+                    FATAL("dev %d eventfd read, %s\n", d->dev, strerror(errno));
+                }
+                if (RING_LOAD(&d->produced) != consumed) {
+                    jitter_add(&d->wakeup, microsec_timer() - __atomic_load_n(&d->commit_us, __ATOMIC_RELAXED));
+                }
+            }
             continue;
         }
 
-        // call callback to process the data;
+        // call callback to process the data, at most MAX_CB_DATA per call;
         // if callback requests stop then enter stopping state and exit thread
         count = produced - consumed;
-        data = g_data + (consumed % MAX_DATA);
-        max_count = g_data + MAX_DATA - data;
+        if (count > MAX_CB_DATA) {
+            count = MAX_CB_DATA;
+        }
+        if (next > consumed && next - consumed < (uint64_t)count) {
+            count = next - consumed;
+        }
+        data = d->data + (consumed % MAX_DATA);
+        max_count = d->data + MAX_DATA - data;
         if (count <= max_count) {
-            if (g_cb(data, count)) {
+            if (g_cb(d->dev, data, count)) {
                 STATE_CHANGE(STOPPING);
                 break;
             }
         } else {
-            if (g_cb(data, max_count) || g_cb(g_data, count-max_count)) {
+            if (g_cb(d->dev, data, max_count) || g_cb(d->dev, d->data, count-max_count)) {
                 STATE_CHANGE(STOPPING);
                 break;
             }
         }
 
-        // increase the amount consumed
+        // increase the amount consumed; this releases the ring space
+        // back to the producer
         consumed += count;
+        RING_STORE(&d->consumed, consumed);
     }
 
-    g_consumer_thread_running = false;
+    d->consumer_thread_running = false;
 
     return NULL;
 }
 
-// -----------------  MCCDAQ TEST ---------------------------------------
-
-// unit test - simple simulation of the MCCDAQ ADC device
+// the write returns EAGAIN only if the eventfd counter would overflow, in which
+// case the consumer has wakeups pending; if the write fails the consumer
+// notices the data at its poll timeout, and the failure is logged once
+static void ring_wakeup_consumer(mccdaq_dev_t * d)
+{
+    static bool logged;
+    uint64_t    one = 1;
 
-#ifdef MCCDAQ_TEST
+    while (write(d->efd, &one, sizeof(one)) < 0) {
+        if (errno == EAGAIN) {
+            break;
+        }
+        if (errno != EINTR) {
+            if (!logged) {
+                ERROR("dev %d eventfd write, %s\n", d->dev, strerror(errno));
+                logged = true;
+            }
+            break;
+        }
+    }
+}
 
-#define MAX_SIM_DATA 10000
+// -----------------  USB SOURCE  ---------------------------------------
 
-static uint16_t g_sim_data[MAX_SIM_DATA];
+#ifndef NO_USB
 
-int libusb_init (void ** cx)
+// args: [serial=<serial number>]; the serial number selects the device, and is
+// required when there are multiple usb devices
+static int32_t usb_init(int32_t dev, char * args)
 {
-    int i;
-    for (i = 0; i < MAX_SIM_DATA; i++) {
-        g_sim_data[i] = 2200;;
+    mccdaq_dev_t * d = &g_dev[dev];
+    int32_t        ret, i;
+
+    // get the serial number, and check that each of multiple usb devices
+    // is selected by a different serial number
+    if (!getarg(args, "serial", d->serial, sizeof(d->serial))) {
+        d->serial[0] = '\0';
+    }
+    for (i = 0; i < dev; i++) {
+        if (g_dev[i].source != &mccdaq_source_usb) {
+            continue;
+        }
+        if (g_dev[i].serial[0] == '\0' || d->serial[0] == '\0') {
+            ERROR("serial is required when there are multiple usb devices\n");
+            return -1;
+        }
+        if (strcmp(g_dev[i].serial, d->serial) == 0) {
+            ERROR("serial %s is selected by dev %d and dev %d\n", d->serial, i, dev);
+            return -1;
+        }
     }
-        
-    return LIBUSB_SUCCESS;
-}
 
-int libusb_bulk_transfer (struct libusb_device_handle *dev_handle, unsigned char endpoint,
-       unsigned char *data_arg, int length, int *transferred, unsigned int timeout)
-{
-    uint64_t us;
-    uint16_t *data = (uint16_t*)data_arg;
-    uint32_t max_data = length / 2;
+    // init usb library, with a context for this device
+    ret = libusb_init(&d->ctx);
+    if (ret != LIBUSB_SUCCESS) {
+        ERROR("libusb_init ret %d\n", ret);
+        return -1;
+    }
 
-    static uint64_t count;
+    // find the MCC-USB-204 usb device
+    d->udev = usb_open(d);
+    if (!d->udev) {
+        ERROR("MCC-USB-204 %s not found\n", d->serial);
+        return -1;
+    }
 
-    // validate length and max_data
-    if (length <= 0 || (length & 1) || max_data > MAX_SIM_DATA) {
-        FATAL("invalid length %d, max_data %d\n", length, max_data);
+    // print the usb packet size, should be 64
+    d->usb_max_packet_size = usb_get_max_packet_size(d->udev,0);
+    INFO("usb_max_packet_size = %d\n", d->usb_max_packet_size);
+    if (d->usb_max_packet_size != 64) {
+        ERROR("usb_max_packet_size = %d\n", d->usb_max_packet_size);
+        return -1;
     }
 
-    // special case 2 byte length
-    if (length == 2) {
-        *transferred = 2;
-        return LIBUSB_SUCCESS;
+    // get the calibration date, and print
+    struct tm calDate;
+    usbCalDate_USB20X(d->udev, &calDate);
+    INFO("MFG Calibration date = %s", asctime(&calDate));
+
+    // get the calibration table, and print the values of the channels scanned
+    usbBuildGainTable_USB20X(d->udev, d->cal_tbl);
+    for (int32_t idx = 0; idx < g_num_chan; idx++) {
+        INFO("Calibration Table %d: Slope=%f  Offset=%f\n",
+             idx, d->cal_tbl[idx][0], d->cal_tbl[idx][1]);
     }
 
-    // init the simulated return data
-    memcpy(data, g_sim_data, length);
-    if (((count % 25) == 0) && (max_data > 20)) {
-        if ((count/25) & 1) {
-            data[0] = 3000;
-            data[1] = 2600;
-            data[2] = 2400;
-            data[3] = 2300;
-        } else {
-            data[max_data/2+0] = 3000;
-            data[max_data/2+1] = 2600;
-            data[max_data/2+2] = 2400;
-            data[max_data/2+3] = 2300;
+    // allocate the usb transfers, these are used by usb_run
+    for (int32_t i = 0; i < g_num_xfer; i++) {
+        d->xfer[i].t = libusb_alloc_transfer(0);
+        if (d->xfer[i].t == NULL) {
+            ERROR("libusb_alloc_transfer failed\n");
+            return -1;
         }
+        d->xfer[i].d = d;
     }
-    count++;
-
-    // set transferred length 
-    *transferred = length;
-
-    // delay 
-    us = (uint64_t)max_data * 1000000L / FREQUENCY;
-    VERBOSE2("SLEEP %lld, MAX_DATA = %d\n", us, max_data);
-    usleep(us);
+    INFO("num_xfer = %d, xfer_length = %d\n", g_num_xfer, XFER_LENGTH);
 
     // return success
     return 0;
 }
 
-int libusb_clear_halt (libusb_device_handle *dev, unsigned char endpoint)
+static void usb_exit(int32_t dev)
 {
-    return 0;
-}
+    mccdaq_dev_t * d = &g_dev[dev];
+    int32_t        i;
+
+    // free the usb transfers, which usb_run has cancelled, before the 
+    // libusb context is freed
+    for (i = 0; i < g_num_xfer; i++) {
+        libusb_free_transfer(d->xfer[i].t);
+        d->xfer[i].t = NULL;
+    }
 
-libusb_device_handle* usb_device_find_USB_MCC(int productId, char *serialID)
-{
-    static int32_t  x;
-    return (libusb_device_handle*)&x;
+    cleanup_USB20X(d->udev);
+    libusb_exit(d->ctx);
 }
 
-int usb_get_max_packet_size(libusb_device_handle* udev, int endpointNum)
+// opens the MCC-USB-204 whose serial number is d->serial, or the first found
+// when d->serial is empty; this is like usb_device_find_USB_MCC, but the device
+// is opened in the device's own libusb context
+static libusb_device_handle * usb_open(mccdaq_dev_t * d)
 {
-    return 64;
-}
+    libusb_device                ** list;
+    libusb_device_handle          * udev = NULL;
+    struct libusb_device_descriptor desc;
+    unsigned char                   serial[MAX_SERIAL];
+    ssize_t                         cnt, i;
+
+    cnt = libusb_get_device_list(d->ctx, &list);
+    for (i = 0; i < cnt && udev == NULL; i++) {
+        if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+            desc.idVendor != MCC_VENDOR_ID || desc.idProduct != USB204_PID)
+        {
+            continue;
+        }
+        if (libusb_open(list[i], &udev) != 0) {
+            udev = NULL;
+            continue;
+        }
+        serial[0] = '\0';
+        libusb_get_string_descriptor_ascii(udev, desc.iSerialNumber, serial, sizeof(serial));
+        if (d->serial[0] != '\0' && strcmp((char*)serial, d->serial) != 0) {
+            libusb_close(udev);
+            udev = NULL;
+            continue;
+        }
+        INFO("dev %d is MCC-USB-204 serial %s\n", d->dev, serial);
+    }
+    if (cnt >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    if (udev == NULL) {
+        return NULL;
+    }
 
-void usbCalDate_USB20X(libusb_device_handle *udev, struct tm *date)
-{
-    time_t t;
-    t = time(NULL);
-    *date = *localtime(&t);
+    // claim the interface, detaching the kernel driver if there is one
+    if (libusb_kernel_driver_active(udev, 0) == 1) {
+        libusb_detach_kernel_driver(udev, 0);
+    }
+    if (libusb_claim_interface(udev, 0) != 0) {
+        ERROR("libusb_claim_interface failed\n");
+        libusb_close(udev);
+        return NULL;
+    }
+    return udev;
 }
 
-void usbBuildGainTable_USB20X(libusb_device_handle *udev, float table[NCHAN_USB20X][2])
-{
-}
+// The usb source keeps g_num_xfer usb bulk transfers in flight, using the
+// libusb asynchronous api. Each transfer reads directly into the next
+// section of the device's data circular buffer, so that a read is always queued
+// while the completed transfers are being processed. The device status is
+// only read when an error occurs, refer to xfer_restart.
 
-void cleanup_USB20X(libusb_device_handle *udev)
+static void usb_run(int32_t dev)
 {
-}
+    mccdaq_dev_t * d = &g_dev[dev];
+    int32_t i;
+
+    // submit all transfers, and start the analog input scan
+    d->submit_pos = d->produced;
+    d->xfer_error = false;
+    d->ring_full = false;
+    for (i = 0; i < g_num_xfer; i++) {
+        xfer_submit(&d->xfer[i]);
+    }
+    usbAInScanStart_USB20X(d->udev, 0, CHAN_FREQUENCY(g_num_chan), (1<<g_num_chan)-1, OPTIONS, 0, 0);
+    d->scan_start_us = microsec_timer();
+    d->scan_start_received = d->received;
 
-void usbAInScanStart_USB20X(libusb_device_handle *udev, uint32_t count, double frequency,
-        uint8_t channels, uint8_t options, uint8_t trigger_source, uint8_t trigger_mode)
-{
+    // loop, handling usb transfer completions; the completed transfers
+    // are processed, and resubmitted, by xfer_callback
+    while (true) {
+        // if state is STOPPING then
+        //   exit
+        // endif
+        if (mccdaq_stopping()) {
+            break;
+        }
+
+        // handle usb events, this calls xfer_callback for completed transfers
+        struct timeval tv = { 0, 100000 };
+        libusb_handle_events_timeout_completed(d->ctx, &tv, NULL);
+
+        // if an error has occurred then restart the analog input scan
+        if (d->xfer_error) {
+            xfer_restart(d);
+        }
+    }
+
+    // cancel transfers that are in flight, and wait for them to complete;
+    // setting xfer_error prevents the transfers from being resubmitted
+    d->xfer_error = true;
+    for (i = 0; i < g_num_xfer; i++) {
+        if (d->xfer[i].in_flight) {
+            libusb_cancel_transfer(d->xfer[i].t);
+        }
+    }
+    while (d->xfer_in_flight > 0) {
+        struct timeval tv = { 0, 100000 };
+        libusb_handle_events_timeout_completed(d->ctx, &tv, NULL);
+    }
+
+    // stop the scan
+    usbAInScanStop_USB20X(d->udev);
+    usbAInScanClearFIFO_USB20X(d->udev);
 }
 
-uint16_t usbStatus_USB20X(libusb_device_handle *udev)
+static void xfer_submit(xfer_t * x)
 {
-    return AIN_SCAN_RUNNING;
+    mccdaq_dev_t * d = x->d;
+    int32_t    ret, offset, length;
+    uint16_t * buff;
+
+    // determine the number of bytes to request; this is normally XFER_LENGTH,
+    // but will be less when the transfer nears the end of the data buffer
+    offset = d->submit_pos % MAX_DATA;
+    length = (MAX_DATA - offset) * sizeof(uint16_t);
+    if (length > XFER_LENGTH) {
+        length = XFER_LENGTH;
+    }
+
+    // if the consumer has not yet consumed the section of the data buffer that this
+    // transfer would read into then the ring is full; the device can't be
+    // paused, so the transfer reads into discard_buff and its data is discarded
+    x->discard = (d->submit_pos + length/2 - RING_LOAD(&d->consumed) > MAX_DATA);
+    buff = (x->discard ? d->discard_buff : d->data + offset);
+
+    // submit the transfer, its data will be read directly into the data buffer
+    libusb_fill_bulk_transfer(x->t,
+                              d->udev,
+                              LIBUSB_ENDPOINT_IN|1,
+                              (uint8_t*)buff,
+                              length,
+                              xfer_callback,
+                              x,
+                              TOUT_MS);
+    ret = libusb_submit_transfer(x->t);
+    if (ret != 0) {
+        WARN("libusb_submit_transfer ret=%d\n", ret);
+        d->xfer_error = true;
+        return;
+    }
+
+    x->pos = d->submit_pos;
+    x->in_flight = true;
+    d->xfer_in_flight++;
+    if (!x->discard) {
+        d->submit_pos += length / sizeof(uint16_t);
+    }
 }
 
-void usbAInScanStop_USB20X(libusb_device_handle *udev)
+static void xfer_callback(struct libusb_transfer * t)
 {
+    xfer_t       * x = t->user_data;
+    mccdaq_dev_t * d = x->d;
+    int32_t  samples;
+
+    x->in_flight = false;
+    d->xfer_in_flight--;
+
+    VERBOSE2("dev=%d status=%d length=%d actual_length=%d pos=%lld\n",
+             d->dev, t->status, t->length, t->actual_length, (long long)x->pos);
+
+    // if an error is being handled then discard this transfer's data,
+    // the transfer will be resubmitted by xfer_restart
+    if (d->xfer_error) {
+        return;
+    }
+
+    // transfers complete in the order they were submitted, so this
+    // transfer's data should follow the data already produced
+    if (x->pos != d->produced) {
+        WARN("dev %d transfer out of order, pos=%lld produced=%lld\n",
+             d->dev, (long long)x->pos, (long long)d->produced);
+        d->xfer_error = true;
+        return;
+    }
+
+    // print warning if transferred_bytes is odd
+    if (t->actual_length & 1) {
+        WARN("dev %d transferred_bytes = %d\n", d->dev, t->actual_length);
+    }
+
+    // if the transfer failed, or returned less data than requested, then the scan
+    // needs to be restarted; the data from a short transfer is kept, but is truncated
+    // to a multiple of XFER_ALIGN so that following transfers remain packet aligned
+    samples = t->actual_length / sizeof(uint16_t);
+    if (t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length != t->length) {
+        VERBOSE2("transfer status=%d actual_length=%d\n", t->status, t->actual_length);
+        samples -= samples % XFER_ALIGN;
+        d->xfer_error = true;
+    }
+
+    // keep track of the number of samples received from the device
+    d->received += samples;
+
+    // if the transfer's data was read into discard_buff, because the ring
+    // was full, then discard it; otherwise make the data available to the
+    // consumer thread
+    if (x->discard) {
+        if (!d->ring_full) {
+            INFO("dev %d ring full, consumer is %lld behind, discarding\n",
+                 d->dev, (long long)(d->produced - RING_LOAD(&d->consumed)));
+            d->ring_full = true;
+        }
+        mccdaq_ring_lost(d->dev, samples);
+    } else {
+        d->ring_full = false;
+        mccdaq_ring_commit(d->dev, samples);
+    }
+
+    // resubmit the transfer, to read the next section of the data buffer
+    if (!d->xfer_error && !mccdaq_stopping()) {
+        xfer_submit(x);
+    }
 }
 
-void usbAInScanClearFIFO_USB20X(libusb_device_handle *udev)
+static void xfer_restart(mccdaq_dev_t * d)
 {
+    int32_t  i, status;
+    int64_t  expected, lost;
+
+    // cancel the transfers still in flight, and wait for them to complete
+    for (i = 0; i < g_num_xfer; i++) {
+        if (d->xfer[i].in_flight) {
+            libusb_cancel_transfer(d->xfer[i].t);
+        }
+    }
+    while (d->xfer_in_flight > 0) {
+        struct timeval tv = { 0, 100000 };
+        libusb_handle_events_timeout_completed(d->ctx, &tv, NULL);
+    }
+
+    // if the prior restarts have received no samples, for example because
+    // the transfers can't be submitted, then the device has failed; retry 
+    // at most MAX_RESTART_FAIL times, at 100ms intervals, and then terminate
+    if (d->received == d->restart_received) {
+        if (++d->restart_fail >= MAX_RESTART_FAIL) {
+            FATAL("dev %d restart failed %d times\n", d->dev, d->restart_fail);
+        }
+        usleep(100000);
+    } else {
+        d->restart_fail = 0;
+    }
+    d->restart_received = d->received;
+
+    // read the device status, and log the restart; an overrun is the
+    // expected reason, and is logged only when verbose
+    status = usbStatus_USB20X(d->udev);
+    if (status & AIN_SCAN_OVERRUN) {
+        VERBOSE2("dev %d restarting, status=0x%x\n", d->dev, status);
+    } else {
+        WARN("dev %d restarting, status=0x%x\n", d->dev, status);
+    }
+
+    // if the scan has stopped the device will send a zero byte packet,
+    // read it so that it is not received by the first transfer submitted below;
+    // refer to usbAInScanRead_USB20X routine in mccdaq/mcc-libusb/usb-20X.c
+    if (!(status & AIN_SCAN_RUNNING)) {
+        uint8_t value[64];
+        int32_t xfered;
+        libusb_bulk_transfer(d->udev,
+                             LIBUSB_ENDPOINT_IN|1,
+                             value,
+                             2,
+                             &xfered,
+                             100);
+    }
+
+    // resubmit the transfers, following the data already produced, and
+    // restart the analog input scan
+    libusb_clear_halt(d->udev, LIBUSB_ENDPOINT_IN|1);
+    d->submit_pos = d->produced;
+    d->xfer_error = false;
+    for (i = 0; i < g_num_xfer; i++) {
+        xfer_submit(&d->xfer[i]);
+    }
+    usbAInScanStart_USB20X(d->udev, 0, CHAN_FREQUENCY(g_num_chan), (1<<g_num_chan)-1, OPTIONS, 0, 0);
+
+    // the samples lost by the restart are the number the device would have
+    // acquired since the prior scan was started, less the number that were
+    // received from that scan; in whole frames, the scan restarts at channel 0
+    expected = (microsec_timer() - d->scan_start_us) * CHAN_FREQUENCY(g_num_chan) / 1000000 * g_num_chan;
+    lost = expected - (int64_t)(d->received - d->scan_start_received);
+    lost -= lost % g_num_chan;
+    if (lost > 0) {
+        mccdaq_ring_lost(d->dev, lost);
+    }
+    d->scan_start_us = microsec_timer();
+    d->scan_start_received = d->received;
+
+    // keep track of number of restarts
+    __sync_fetch_and_add(&d->restart_count, 1);
 }
 
 #endif
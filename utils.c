@@ -1,5 +1,9 @@
 #include <common.h>
 
+FILE *fp_log;
+FILE *fp_log2;
+bool verbose[MAX_VERBOSE];
+
 uint64_t microsec_timer(void)
 {
     struct timespec ts;
@@ -28,3 +32,34 @@ char *time2str(time_t t, char *s, bool filename_format)
     return s;
 }
 
+
+// args is a comma separated list of "key=value" or "key"; if key is found 
+// then its value is copied to value, and true is returned;
+// example: getarg("rate=1000,fast", "rate", ...) returns value "1000"
+bool getarg(char *args, char *key, char *value, int32_t max_value)
+{
+    int32_t keylen = strlen(key);
+    char *p = args, *end;
+
+    while (*p) {
+        end = strchr(p, ',');
+        if (end == NULL) {
+            end = p + strlen(p);
+        }
+        if (strncmp(p, key, keylen) == 0 && (p[keylen] == '=' || p + keylen == end)) {
+            p += keylen;
+            if (*p == '=') {
+                p++;
+            }
+            int32_t len = end - p;
+            if (len > max_value - 1) {
+                len = max_value - 1;
+            }
+            memcpy(value, p, len);
+            value[len] = '\0';
+            return true;
+        }
+        p = (*end ? end + 1 : end);
+    }
+    return false;
+}